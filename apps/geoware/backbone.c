@@ -0,0 +1,173 @@
+#include "contiki.h"
+
+#include <stdio.h> /* For printf() */
+
+#include "geoware.h"
+
+/* Relay backbone for region floods, a connected dominating set computed
+   locally with the Wu-Li marking process and its two pruning rules, from
+   the neighbor positions and the 2-hop positions the beacons carry. Only
+   backbone nodes rebroadcast floods, every other node has a backbone
+   neighbor and still receives them, or relays itself inside a region the
+   backbone misses. 2-hop lists cut at MAX_NEIGHBOR_NEIGHBORS only make us
+   keep more nodes marked. */
+
+/* set by the marking process and advertised in our beacons */
+static uint8_t marked;
+
+/* marked and not pruned, we rebroadcast floods */
+static uint8_t backbone;
+
+/*---------------------------------------------------------------------------*/
+
+static uint16_t
+id(const rimeaddr_t *addr)
+{
+  return (addr->u8[0] << 8) | addr->u8[1];
+}
+
+/*---------------------------------------------------------------------------*/
+/* Check if pos is in the closed neighborhood of neighbor n. */
+static uint8_t
+knows(struct neighbor *n, pos_t pos)
+{
+  uint8_t i;
+
+  for(i = 0; i <= n->neighbors; i++) {
+    if(distance(n->pos[i], pos) < EPSILON) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Check if two of our neighbors are neighbors of each other. */
+static uint8_t
+connected(struct neighbor *u, struct neighbor *w)
+{
+  return knows(u, w->pos[0]) || knows(w, u->pos[0]);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Check if our open neighborhood is covered by the closed neighborhoods of
+ * u and w (pass the same neighbor twice for a single one).
+ */
+static uint8_t
+covered(struct neighbor *u, struct neighbor *w)
+{
+  struct neighbor *n;
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    if(!knows(u, n->pos[0]) && !knows(w, n->pos[0])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function recomputes our backbone membership. Called before every
+ * beacon, so neighbors see our marker with our current neighbor list.
+ */
+void
+backbone_update()
+{
+  struct neighbor *u;
+  struct neighbor *w;
+  uint16_t own = id(&rimeaddr_node_addr);
+  uint8_t was = backbone;
+
+  /* marking: we connect two neighbors that are not neighbors of each other */
+  marked = 0;
+  for(u = list_head(neighbors_list); u != NULL && !marked; \
+      u = list_item_next(u)) {
+    for(w = list_item_next(u); w != NULL; w = list_item_next(w)) {
+      if(!connected(u, w)) {
+        marked = 1;
+        break;
+      }
+    }
+  }
+
+  backbone = marked;
+
+  for(u = list_head(neighbors_list); u != NULL && backbone; \
+      u = list_item_next(u)) {
+    if(!(u->marked & BACKBONE_MARKED)) {
+      continue;
+    }
+
+    /* rule 1: a single marked neighbor with a higher id covers us */
+    if(own < id(&u->addr) && covered(u, u)) {
+      backbone = 0;
+      break;
+    }
+
+    /* rule 2: two connected marked neighbors, both with higher ids,
+       cover us */
+    for(w = list_item_next(u); w != NULL; w = list_item_next(w)) {
+      if((w->marked & BACKBONE_MARKED) && own < id(&u->addr) && own < id(&w->addr) && \
+          connected(u, w) && covered(u, w)) {
+        backbone = 0;
+        break;
+      }
+    }
+  }
+
+  if(backbone != was) {
+    printf("backbone: %s\n", backbone ? "yes" : "no");
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t
+backbone_marked()
+{
+  return (marked ? BACKBONE_MARKED : 0) | (backbone ? BACKBONE_MEMBER : 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t
+is_backbone()
+{
+  return backbone;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Check if we rebroadcast a flood for region r. The backbone may run around
+ * a region without a member inside, the nodes there would never hear the
+ * flood. So inside r a node relays as well when none of its neighbors in r
+ * is a backbone member.
+ */
+uint8_t
+backbone_relays(const region_t *r)
+{
+  struct neighbor *n;
+
+  if(backbone) {
+    return 1;
+  }
+
+  if(r == NULL || !region_contains(r, own_pos)) {
+    return 0;
+  }
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    if((n->marked & BACKBONE_MEMBER) && \
+        region_contains(r, neighbor_pos(n))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
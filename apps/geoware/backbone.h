@@ -0,0 +1,18 @@
+#ifndef BACKBONE_H
+#define BACKBONE_H
+
+#include <stdint.h>
+
+#include "geo.h"
+
+/* the backbone marker advertised in beacons: marked by the marking process,
+   and still a backbone member after pruning */
+#define BACKBONE_MARKED     0x01
+#define BACKBONE_MEMBER     0x02
+
+void backbone_update();
+uint8_t backbone_marked();
+uint8_t is_backbone();
+uint8_t backbone_relays(const region_t *r);
+
+#endif
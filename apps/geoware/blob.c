@@ -0,0 +1,313 @@
+#include "contiki.h"
+
+#include <stdio.h> /* For printf() */
+#include <string.h> /* For memcpy */
+
+#include "geoware.h"
+
+/* Uncomment below line to include debug output */
+#define DEBUG_PRINTS
+
+#ifdef DEBUG_PRINTS
+#define debug_printf printf
+#else
+#define debug_printf(format, args...)
+#endif
+
+/* number of fragments a blob of size bytes takes */
+#define FRAGS(size) (((size) + BLOB_FRAG_SIZE - 1) / BLOB_FRAG_SIZE)
+
+/* mask with a bit for each of n fragments */
+#define ALL(n) ((n) >= 32 ? 0xffffffffUL : (1UL << (n)) - 1)
+
+/*---------------------------------------------------------------------------*/
+/* This structure holds a blob being reassembled from its fragments, or a
+   complete one until the application takes it. */
+struct blob {
+  /* The ->next pointer is needed since we are placing these
+     on a Contiki list. */
+  struct blob *next;
+
+  /* -> source and ->source_pos hold the node the blob comes from and where
+     it is, for asking it for missing fragments */
+  rimeaddr_t source;
+  pos_t source_pos;
+
+  sid_t sID;
+  uint8_t id;
+  uint16_t size;
+
+  /* -> received holds a bit for every fragment we have */
+  uint32_t received;
+
+  /* -> nacks counts the times we asked for the missing fragments */
+  uint8_t nacks;
+
+  /* -> last holds when we last heard of the blob, in clock ticks */
+  clock_time_t last;
+
+  uint8_t data[BLOB_MAX_SIZE];
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   reassembly buffers. */
+MEMB(blobs_memb, struct blob, BLOB_REASSEMBLY);
+
+/* The blobs_list is a Contiki list that holds the blobs, oldest first. */
+LIST(blobs_list);
+
+/* The last blob we read, kept to send the fragments the owner asks for. */
+static struct {
+  sid_t sID;
+  uint8_t id;
+  uint16_t size;
+  uint32_t time;
+  uint8_t data[BLOB_MAX_SIZE];
+} out;
+
+/*---------------------------------------------------------------------------*/
+
+void
+blob_init()
+{
+  out.size = 0;
+
+  memb_init(&blobs_memb);
+  list_init(blobs_list);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static uint8_t
+complete(struct blob *b)
+{
+  return b->received == ALL(FRAGS(b->size));
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Read the blob sensor type for subscription sID, it replaces the blob we
+ * were sending. Returns the number of fragments, 0 if it cannot be read.
+ */
+uint8_t
+blob_read(sensor_t type, sid_t sID)
+{
+  mapping_t *mapping = get_mapping(type);
+  uint16_t size;
+
+  if(mapping == NULL || mapping->r != BLOB || mapping->read == NULL) {
+    printf("not a blob sensor.\n");
+    return 0;
+  }
+
+  size = ((uint16_t (*)(uint8_t*, uint16_t))mapping->read)(out.data, \
+    BLOB_MAX_SIZE);
+  if(size == 0) {
+    return 0;
+  }
+
+  out.sID = sID;
+  out.id++;
+  out.size = MIN(size, BLOB_MAX_SIZE);
+  out.time = timesync_time();
+
+  printf("new %s blob: %u bytes\n", mapping->strname, out.size);
+
+  return FRAGS(out.size);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Returns the number of fragments if blob of subscription sID is the one
+   we are sending, 0 if not. */
+uint8_t
+blob_outgoing(sid_t sID, uint8_t blob)
+{
+  if(out.size == 0 || out.sID != sID || out.id != blob) {
+    return 0;
+  }
+
+  return FRAGS(out.size);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Fill in fragment frag of the blob we are sending, the headers are left to
+ * the caller. Returns the number of data bytes, 0 if there is no such
+ * fragment.
+ */
+uint8_t
+blob_fragment(uint8_t frag, blob_frag_pkt_t *pkt)
+{
+  if(frag >= FRAGS(out.size)) {
+    return 0;
+  }
+
+  pkt->blob = out.id;
+  pkt->frag = frag;
+  pkt->size = out.size;
+#if GEOWARE_TIMESTAMPS
+  pkt->stamp = timesync_stamp(out.time);
+#endif
+  memcpy(pkt->data, &out.data[frag * BLOB_FRAG_SIZE], \
+    MIN(BLOB_FRAG_SIZE, out.size - frag * BLOB_FRAG_SIZE));
+
+  return MIN(BLOB_FRAG_SIZE, out.size - frag * BLOB_FRAG_SIZE);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Length of a fragment packet with its data. */
+uint8_t
+blob_frag_len(blob_frag_pkt_t *pkt)
+{
+  return BLOB_FRAG_LEN(MIN(BLOB_FRAG_SIZE, \
+    pkt->size - pkt->frag * BLOB_FRAG_SIZE));
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Add a fragment of len data bytes from source to its blob. A new blob of
+ * the same source and subscription replaces the one before, the oldest blob
+ * makes room if all the buffers are taken. Returns 1 once the blob is
+ * complete, 0 before and for fragments we already have.
+ */
+uint8_t
+blob_reassemble(const rimeaddr_t *source, blob_frag_pkt_t *pkt, uint8_t len)
+{
+  struct blob *b;
+  uint8_t frags = FRAGS(pkt->size);
+
+  if(pkt->size == 0 || pkt->size > BLOB_MAX_SIZE || pkt->frag >= frags || \
+      len < MIN(BLOB_FRAG_SIZE, pkt->size - pkt->frag * BLOB_FRAG_SIZE)) {
+    return 0;
+  }
+
+  for(b = list_head(blobs_list); b != NULL; b = list_item_next(b)) {
+    if(rimeaddr_cmp(&b->source, source) && \
+        b->sID == pkt->reading_hdr.subscription_hdr.sID) {
+      break;
+    }
+  }
+
+  if(b == NULL) {
+    if((b = memb_alloc(&blobs_memb)) == NULL) {
+      b = list_pop(blobs_list);
+      debug_printf("reassembly buffers full, dropping blob %u of %d.%d\n", \
+        b->id, b->source.u8[0], b->source.u8[1]);
+    }
+    b->id = pkt->blob + 1;
+    list_add(blobs_list, b);
+  }
+
+  if(b->id != pkt->blob) {
+    rimeaddr_copy(&b->source, source);
+    b->sID = pkt->reading_hdr.subscription_hdr.sID;
+    b->id = pkt->blob;
+    b->size = pkt->size;
+    b->received = 0;
+    b->nacks = 0;
+  }
+
+  if(complete(b) || (b->received & (1UL << pkt->frag))) {
+    return 0;
+  }
+
+  memcpy(&b->data[pkt->frag * BLOB_FRAG_SIZE], pkt->data, \
+    MIN(BLOB_FRAG_SIZE, pkt->size - pkt->frag * BLOB_FRAG_SIZE));
+  b->received |= 1UL << pkt->frag;
+  b->source_pos = pkt->source_pos;
+  b->last = clock_time();
+
+  return complete(b);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Returns 1 if we are waiting for fragments of a blob. */
+uint8_t
+blob_incomplete()
+{
+  struct blob *b;
+
+  for(b = list_head(blobs_list); b != NULL; b = list_item_next(b)) {
+    if(!complete(b)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Find a blob no fragment came in for BLOB_NACK_WAIT and fill in nack to
+ * ask its source for the missing ones, the headers are left to the caller.
+ * A blob still missing fragments after BLOB_MAX_NACKS is dropped. Returns
+ * 0 if there is nothing to ask for.
+ */
+uint8_t
+blob_stalled(blob_nack_pkt_t *nack)
+{
+  struct blob *b;
+  struct blob *next;
+
+  for(b = list_head(blobs_list); b != NULL; b = next) {
+    next = list_item_next(b);
+
+    if(complete(b) || clock_time() - b->last < BLOB_NACK_WAIT) {
+      continue;
+    }
+
+    if(b->nacks == BLOB_MAX_NACKS) {
+      printf("blob %u of %d.%d incomplete, dropping\n", b->id, \
+        b->source.u8[0], b->source.u8[1]);
+      list_remove(blobs_list, b);
+      memb_free(&blobs_memb, b);
+      continue;
+    }
+
+    b->nacks++;
+    b->last = clock_time();
+
+    nack->source_hdr.sID = b->sID;
+    nack->source_hdr.owner_pos = b->source_pos;
+    rimeaddr_copy(&nack->source_hdr.owner, &b->source);
+    nack->blob = b->id;
+    nack->missing = ALL(FRAGS(b->size)) & ~b->received;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Take a complete blob of subscription sID out, at most max bytes of it go
+ * to buf. Returns the size of the blob, 0 if there is none.
+ */
+uint16_t
+blob_get(sid_t sID, rimeaddr_t *source, uint8_t *buf, uint16_t max)
+{
+  struct blob *b;
+  uint16_t size;
+
+  for(b = list_head(blobs_list); b != NULL; b = list_item_next(b)) {
+    if(b->sID == sID && complete(b)) {
+      break;
+    }
+  }
+
+  if(b == NULL) {
+    return 0;
+  }
+
+  size = b->size;
+  rimeaddr_copy(source, &b->source);
+  memcpy(buf, b->data, MIN(size, max));
+
+  list_remove(blobs_list, b);
+  memb_free(&blobs_memb, b);
+
+  return size;
+}
+
+/*---------------------------------------------------------------------------*/
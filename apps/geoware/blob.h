@@ -0,0 +1,21 @@
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <stdint.h>
+
+#include "net/rime.h"
+
+#include "packets.h"
+
+void blob_init();
+uint8_t blob_read(sensor_t type, sid_t sID);
+uint8_t blob_outgoing(sid_t sID, uint8_t blob);
+uint8_t blob_fragment(uint8_t frag, blob_frag_pkt_t *pkt);
+uint8_t blob_frag_len(blob_frag_pkt_t *pkt);
+uint8_t blob_reassemble(const rimeaddr_t *source, blob_frag_pkt_t *pkt, \
+                        uint8_t len);
+uint8_t blob_incomplete();
+uint8_t blob_stalled(blob_nack_pkt_t *nack);
+uint16_t blob_get(sid_t sID, rimeaddr_t *source, uint8_t *buf, uint16_t max);
+
+#endif
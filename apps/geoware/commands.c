@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "commands.h"
 #include "geoware.h"
@@ -28,6 +29,49 @@ PROCESS_BEGIN();
 PROCESS_END();
 }
 
+PROCESS(beacon_power_process, "Change beacon tx power");
+SHELL_COMMAND(beacon_power_command, "btxp", "btxp: change beacon and flood transmit power", &beacon_power_process);
+/* --------------------------------- */
+PROCESS_THREAD(beacon_power_process, ev, data) {
+PROCESS_BEGIN();
+  uint8_t txp = (uint8_t) atoi((char *)data);
+  static char shell_out[4];
+
+  if(txp > CC2420_TXPOWER_MAX) {
+  	txp = CC2420_TXPOWER_MAX;
+  }
+
+  beacon_txpower = txp;
+  flood_txpower = txp;
+
+  snprintf(shell_out, sizeof(shell_out), "%d", txp);
+
+  shell_output_str(&beacon_power_command, "beacon TX power: ", shell_out);
+PROCESS_END();
+}
+
+PROCESS(position_process, "Change position");
+SHELL_COMMAND(position_command, "pos", "pos <x> <y>: change node position", &position_process);
+/* --------------------------------- */
+PROCESS_THREAD(position_process, ev, data) {
+PROCESS_BEGIN();
+  char *y = strchr((char *)data, ' ');
+  pos_t pos;
+
+  if(y == NULL) {
+    shell_output_str(&position_command, "usage: ", "pos <x> <y>");
+    PROCESS_EXIT();
+  }
+
+  pos.x = stof((char *)data);
+  pos.y = stof(y + 1);
+
+  geoware_set_position(pos);
+
+  shell_output_str(&position_command, "position: ", (char *)data);
+PROCESS_END();
+}
+
 PROCESS(subscribe_process, "Subscribe process");
 SHELL_COMMAND(subscribe_command, "sub", "sub: subscribe to a sensor reading", &subscribe_process);
 /* --------------------------------- */
@@ -48,6 +92,103 @@ PROCESS_BEGIN();
 PROCESS_END();
 }
 
+PROCESS(subscribe_vector_process, "Subscribe vector process");
+SHELL_COMMAND(subscribe_vector_command, "vsub", "vsub <types>: subscribe to sensor 1 and the sensors in the bit mask", &subscribe_vector_process);
+/* --------------------------------- */
+PROCESS_THREAD(subscribe_vector_process, ev, data) {
+PROCESS_BEGIN();
+  static char shell_out[6];
+  sid_t id;
+
+  pos_t center = {20.0, 20.0};
+  float radius = 11;
+  region_t region;
+
+  region_circle(&region, center, radius);
+  id = subscribe_vector(1, strtol((char*) data, NULL, 0), 5000, 0, 0, &region);
+
+  snprintf(shell_out, sizeof(shell_out), "%u", id);
+
+  shell_output_str(&subscribe_vector_command, "subscribed, id: ", shell_out);
+PROCESS_END();
+}
+
+PROCESS(snapshot_process, "Snapshot process");
+SHELL_COMMAND(snapshot_command, "snap", "snap: read a sensor once in a region", &snapshot_process);
+/* --------------------------------- */
+PROCESS_THREAD(snapshot_process, ev, data) {
+PROCESS_BEGIN();
+  static char shell_out[6];
+  sid_t id;
+
+  pos_t center = {20.0, 20.0};
+  float radius = 11;
+  region_t region;
+
+  region_circle(&region, center, radius);
+  id = snapshot(1, &region);
+
+  snprintf(shell_out, sizeof(shell_out), "%u", id);
+
+  shell_output_str(&snapshot_command, "snapshot sent, id: ", shell_out);
+PROCESS_END();
+}
+
+PROCESS(knn_process, "kNN process");
+SHELL_COMMAND(knn_command, "knn", "knn <k>: read a sensor once on the k nodes nearest a point", &knn_process);
+/* --------------------------------- */
+PROCESS_THREAD(knn_process, ev, data) {
+PROCESS_BEGIN();
+  static char shell_out[6];
+  sid_t id;
+
+  pos_t point = {20.0, 20.0};
+
+  id = knn(1, point, atoi((char*) data));
+
+  snprintf(shell_out, sizeof(shell_out), "%u", id);
+
+  shell_output_str(&knn_command, "kNN query sent, id: ", shell_out);
+PROCESS_END();
+}
+
+PROCESS(query_stored_process, "Query stored process");
+SHELL_COMMAND(query_stored_command, "qs", "qs <key>: read the readings stored under a key", &query_stored_process);
+/* --------------------------------- */
+PROCESS_THREAD(query_stored_process, ev, data) {
+PROCESS_BEGIN();
+  static char shell_out[6];
+  sid_t id;
+
+  id = query_stored(1, atoi((char*) data));
+
+  snprintf(shell_out, sizeof(shell_out), "%u", id);
+
+  shell_output_str(&query_stored_command, "query sent, id: ", shell_out);
+PROCESS_END();
+}
+
+PROCESS(history_process, "History process");
+SHELL_COMMAND(history_command, "hist", "hist <seconds>: average of a sensor in a region over the last seconds", &history_process);
+/* --------------------------------- */
+PROCESS_THREAD(history_process, ev, data) {
+PROCESS_BEGIN();
+  static char shell_out[6];
+  sid_t id;
+
+  pos_t center = {20.0, 20.0};
+  float radius = 11;
+  region_t region;
+
+  region_circle(&region, center, radius);
+  id = history(1, &region, atol((char*) data), 0, HISTORY_AVG);
+
+  snprintf(shell_out, sizeof(shell_out), "%u", id);
+
+  shell_output_str(&history_command, "history query sent, id: ", shell_out);
+PROCESS_END();
+}
+
 PROCESS(unsubscribe_process, "Unubscribe process");
 SHELL_COMMAND(unsubscribe_command, "usub", "usub: unsubscribe from a sensor reading", &unsubscribe_process);
 /* --------------------------------- */
@@ -66,6 +207,42 @@ PROCESS_BEGIN();
 PROCESS_END();
 }
 
+PROCESS(modify_subscription_process, "Modify subscription process");
+SHELL_COMMAND(modify_subscription_command, "msub", "msub <id> <period> <radius>: change a subscription", &modify_subscription_process);
+/* --------------------------------- */
+PROCESS_THREAD(modify_subscription_process, ev, data) {
+PROCESS_BEGIN();
+  char *period = strchr((char *)data, ' ');
+  char *radius = period != NULL ? strchr(period + 1, ' ') : NULL;
+  subscription_t *sub;
+  region_t region;
+  sid_t id;
+
+  if(radius == NULL) {
+    shell_output_str(&modify_subscription_command, "usage: ", \
+      "msub <id> <period> <radius>");
+    PROCESS_EXIT();
+  }
+
+  id = atoi((char*) data);
+
+  if((sub = get_subscription(id)) != NULL) {
+    /* only circles have a radius, other shapes keep their region */
+    region = sub->region;
+    region_set_radius(&region, stof(radius + 1));
+  }
+
+  if(sub == NULL || !update_subscription(id, atol(period + 1), \
+      sub->aggr_type, sub->aggr_num, &region)) {
+    shell_output_str(&modify_subscription_command, "not our subscription: ", \
+      (char *)data);
+    PROCESS_EXIT();
+  }
+
+  shell_output_str(&modify_subscription_command, "modified: ", (char *)data);
+PROCESS_END();
+}
+
 PROCESS(print_neigh_process, "Print neighbors process");
 SHELL_COMMAND(print_neigh_command, "pn", "pn: print neighbors", &print_neigh_process);
 /* --------------------------------- */
@@ -75,6 +252,15 @@ PROCESS_BEGIN();
 PROCESS_END();
 }
 
+PROCESS(print_time_process, "Print time process");
+SHELL_COMMAND(print_time_command, "time", "time: print the network time", &print_time_process);
+/* --------------------------------- */
+PROCESS_THREAD(print_time_process, ev, data) {
+PROCESS_BEGIN();
+  print_timesync();
+PROCESS_END();
+}
+
 void
 commands_init()
 {
@@ -83,7 +269,16 @@ commands_init()
   
   // own commands
   shell_register_command(&radio_power_command);
+  shell_register_command(&beacon_power_command);
+  shell_register_command(&position_command);
   shell_register_command(&subscribe_command);
+  shell_register_command(&subscribe_vector_command);
   shell_register_command(&unsubscribe_command);
+  shell_register_command(&snapshot_command);
+  shell_register_command(&knn_command);
+  shell_register_command(&query_stored_command);
+  shell_register_command(&history_command);
+  shell_register_command(&modify_subscription_command);
   shell_register_command(&print_neigh_command);
+  shell_register_command(&print_time_command);
 }
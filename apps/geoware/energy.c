@@ -0,0 +1,69 @@
+#include "contiki.h"
+#include "sys/energest.h"
+
+#include "energy.h"
+
+/* Battery model used to turn the Energest radio and cpu times into the
+   residual energy advertised in the beacons. Without Energest every node
+   reports a full battery. */
+
+#if ENERGEST_CONF_ON
+/* Energest types we account for and the current (in mA) drawn in each */
+static const uint8_t types[] = {ENERGEST_TYPE_CPU, ENERGEST_TYPE_LPM, \
+  ENERGEST_TYPE_TRANSMIT, ENERGEST_TYPE_LISTEN};
+static const float current[] = {CURRENT_CPU, CURRENT_LPM, \
+  CURRENT_TRANSMIT, CURRENT_LISTEN};
+
+/* the Energest times at the last update, used to tolerate counter wrap */
+static unsigned long last[sizeof(types)];
+
+/* charge (in mAs) used since boot */
+static float consumed;
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+void
+energy_init()
+{
+#if ENERGEST_CONF_ON
+  uint8_t i;
+
+  energest_flush();
+  for(i = 0; i < sizeof(types); i++) {
+    last[i] = energest_type_time(types[i]);
+  }
+  consumed = 0;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function returns the residual battery energy in percent. It has to
+ * be called more often than the Energest counters wrap, the beacons take
+ * care of that.
+ */
+uint8_t
+energy_residual()
+{
+#if ENERGEST_CONF_ON
+  unsigned long now;
+  float left;
+  uint8_t i;
+
+  energest_flush();
+  for(i = 0; i < sizeof(types); i++) {
+    now = energest_type_time(types[i]);
+    consumed += (float)(now - last[i]) / RTIMER_SECOND * current[i];
+    last[i] = now;
+  }
+
+  left = 100 - 100 * consumed / (BATTERY_CAPACITY * 3600.0);
+
+  return left > 0 ? (uint8_t)left : 0;
+#else
+  return 100;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,9 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+
+void energy_init();
+uint8_t energy_residual();
+
+#endif
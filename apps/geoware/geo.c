@@ -2,6 +2,7 @@
 
 #include <stdio.h> /* For printf() */
 #include <math.h>  /* For sqrt() */
+#include <string.h> /* For memcmp() */
 
 #include "geo.h"
 #include "helpers.h"
@@ -20,4 +21,246 @@ float distance(pos_t a, pos_t b) {
 
 int pos_cmp(pos_t a, pos_t b) {
 	return (a.x == b.x) && (a.y == b.y);
-}
\ No newline at end of file
+}
+/*---------------------------------------------------------------------------*/
+pos_t region_point(const region_t *r, uint8_t i) {
+	pos_t pos;
+
+	pos.x = (float)r->p[i].x / REGION_UNIT;
+	pos.y = (float)r->p[i].y / REGION_UNIT;
+
+	return pos;
+}
+/*---------------------------------------------------------------------------*/
+/* rounded to the nearest 1/REGION_UNIT */
+static int16_t region_coord(float v) {
+	return (int16_t)(v * REGION_UNIT + (v < 0 ? -0.5 : 0.5));
+}
+/*---------------------------------------------------------------------------*/
+void region_set_point(region_t *r, uint8_t i, pos_t pos) {
+	r->p[i].x = region_coord(pos.x);
+	r->p[i].y = region_coord(pos.y);
+}
+/*---------------------------------------------------------------------------*/
+void region_circle(region_t *r, pos_t center, float radius) {
+	r->shape = REGION_CIRCLE;
+	r->num = 2;
+	region_set_point(r, 0, center);
+	region_set_radius(r, radius);
+}
+/*---------------------------------------------------------------------------*/
+/* set the radius of every circle of a circle region */
+void region_set_radius(region_t *r, float radius) {
+	uint8_t i;
+
+	for(i = 0; r->shape == REGION_CIRCLE && i + 1 < r->num; i += 2) {
+		r->p[i+1].x = region_coord(radius);
+		r->p[i+1].y = 0;
+	}
+}
+/*---------------------------------------------------------------------------*/
+void region_rect(region_t *r, pos_t min, pos_t max) {
+	r->shape = REGION_RECT;
+	r->num = 2;
+	region_set_point(r, 0, min);
+	region_set_point(r, 1, max);
+}
+/*---------------------------------------------------------------------------*/
+/* which side of the edge a -> b the point is on, 0 if on the line */
+static float side(pos_t a, pos_t b, pos_t pos) {
+	return (b.x - a.x)*(pos.y - a.y) - (b.y - a.y)*(pos.x - a.x);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t part_contains(const region_t *r, uint8_t i, pos_t pos) {
+	pos_t a = region_point(r, i);
+	pos_t b = region_point(r, i + 1);
+
+	if(r->shape == REGION_CIRCLE) {
+		return distance(pos, a) <= b.x;
+	}
+
+	return pos.x >= a.x && pos.x <= b.x && pos.y >= a.y && pos.y <= b.y;
+}
+/*---------------------------------------------------------------------------*/
+uint8_t region_contains(const region_t *r, pos_t pos) {
+	uint8_t i;
+
+	if(r->shape == REGION_POLYGON) {
+		uint8_t pos_side = 0, neg_side = 0;
+
+		/* inside a convex polygon the point is on the same side of every edge */
+		for(i = 0; i < r->num; i++) {
+			float s = side(region_point(r, i), \
+				region_point(r, (i + 1) % r->num), pos);
+
+			pos_side |= s > 0;
+			neg_side |= s < 0;
+		}
+
+		return !(pos_side && neg_side);
+	}
+
+	for(i = 0; i + 1 < r->num; i += 2) {
+		if(part_contains(r, i, pos)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* bounding box of one part, the whole polygon for polygons */
+static void part_box(const region_t *r, uint8_t i, pos_t *min, pos_t *max) {
+	pos_t a = region_point(r, i);
+	pos_t b;
+
+	if(r->shape == REGION_CIRCLE) {
+		b = region_point(r, i + 1);
+		min->x = a.x - b.x;
+		min->y = a.y - b.x;
+		max->x = a.x + b.x;
+		max->y = a.y + b.x;
+	}
+	else if(r->shape == REGION_RECT) {
+		*min = a;
+		*max = region_point(r, i + 1);
+	}
+	else {
+		*min = *max = region_point(r, 0);
+		for(i = 1; i < r->num; i++) {
+			b = region_point(r, i);
+			min->x = MIN(min->x, b.x);
+			min->y = MIN(min->y, b.y);
+			max->x = MAX(max->x, b.x);
+			max->y = MAX(max->y, b.y);
+		}
+	}
+}
+/*---------------------------------------------------------------------------*/
+void region_box(const region_t *r, pos_t *min, pos_t *max) {
+	uint8_t i;
+	pos_t pmin, pmax;
+
+	part_box(r, 0, min, max);
+
+	if(r->shape == REGION_POLYGON) {
+		return;
+	}
+
+	for(i = 2; i + 1 < r->num; i += 2) {
+		part_box(r, i, &pmin, &pmax);
+		min->x = MIN(min->x, pmin.x);
+		min->y = MIN(min->y, pmin.y);
+		max->x = MAX(max->x, pmax.x);
+		max->y = MAX(max->y, pmax.y);
+	}
+}
+/*---------------------------------------------------------------------------*/
+/* Whether r has points to work with, num comes from packets we received. */
+uint8_t region_valid(const region_t *r) {
+	return r->num > 0 && r->num <= REGION_MAX_POINTS;
+}
+/*---------------------------------------------------------------------------*/
+/* Whether a and b are the same region, the points past num are unused. */
+uint8_t region_equal(const region_t *a, const region_t *b) {
+	return a->shape == b->shape && a->num == b->num && \
+		memcmp(a->p, b->p, a->num * sizeof(region_pos_t)) == 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Whether inner lies within outer, checked on the corners of inner's
+ * bounding box. That is exact only for a convex outer region, so outer
+ * regions of several parts only cover identical ones.
+ */
+uint8_t region_covers(const region_t *outer, const region_t *inner) {
+	pos_t min, max, corner;
+
+	if(outer->shape != REGION_POLYGON && outer->num > 2) {
+		return region_equal(outer, inner);
+	}
+
+	region_box(inner, &min, &max);
+
+	corner = min;
+	if(!region_contains(outer, corner)) {
+		return 0;
+	}
+	corner.x = max.x;
+	if(!region_contains(outer, corner)) {
+		return 0;
+	}
+	corner.y = max.y;
+	if(!region_contains(outer, corner)) {
+		return 0;
+	}
+	corner.x = min.x;
+	return region_contains(outer, corner);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Where to route towards to reach the region from pos: the center of the
+ * part whose bounding box is nearest, or the vertex centroid of a polygon.
+ */
+pos_t region_target(const region_t *r, pos_t from) {
+	uint8_t i;
+	pos_t min, max, center, edge, target;
+	float dist, best = -1;
+
+	if(r->shape == REGION_POLYGON) {
+		target.x = target.y = 0;
+		for(i = 0; i < r->num; i++) {
+			center = region_point(r, i);
+			target.x += center.x;
+			target.y += center.y;
+		}
+		target.x /= r->num;
+		target.y /= r->num;
+		return target;
+	}
+
+	target = region_point(r, 0);
+	for(i = 0; i + 1 < r->num; i += 2) {
+		part_box(r, i, &min, &max);
+		center.x = (min.x + max.x) / 2;
+		center.y = (min.y + max.y) / 2;
+
+		/* distance to the edge of the box, 0 from inside */
+		edge.x = MAX(min.x, MIN(from.x, max.x));
+		edge.y = MAX(min.y, MIN(from.y, max.y));
+		dist = distance(from, edge);
+		if(best < 0 || dist < best) {
+			best = dist;
+			target = center;
+		}
+	}
+
+	return target;
+}
+/*---------------------------------------------------------------------------*/
+void print_region(const region_t *r) {
+	uint8_t i;
+
+	if(r->shape == REGION_POLYGON) {
+		printf("polygon:\n");
+		for(i = 0; i < r->num; i++) {
+			print_pos(region_point(r, i));
+		}
+		return;
+	}
+
+	for(i = 0; i + 1 < r->num; i += 2) {
+		if(r->shape == REGION_CIRCLE) {
+			float radius = region_point(r, i + 1).x;
+
+			printf("circle center: ");
+			print_pos(region_point(r, i));
+			printf("radius: "PRINTFLOAT"\n", (long)radius, decimals(radius));
+		}
+		else {
+			printf("rect min: ");
+			print_pos(region_point(r, i));
+			printf("max: ");
+			print_pos(region_point(r, i + 1));
+		}
+	}
+}
@@ -1,6 +1,8 @@
 #ifndef GEO_H
 #define GEO_H
 
+#include "contiki.h"
+
 #define EPSILON 0.1
 
 typedef struct {
@@ -8,8 +10,50 @@ typedef struct {
   float y;
 } pos_t;
 
+/* Region shapes. Circles and rectangles take two points per part, so a
+   region holds up to REGION_MAX_POINTS / 2 of them: a circle its center and
+   the radius in the x of the second point, a rectangle its lower left and
+   upper right corner. A polygon is a single convex part of up to
+   REGION_MAX_POINTS vertices, in either winding order. */
+enum {
+  REGION_CIRCLE,
+  REGION_RECT,
+  REGION_POLYGON
+};
+
+/* Region points are kept in 16 bits, in 1/REGION_UNIT of a position unit,
+   so subscriptions stay small enough to batch. Use region_point() to read
+   them. */
+#ifndef REGION_UNIT
+#define REGION_UNIT 8
+#endif
+
+typedef struct {
+  int16_t x;
+  int16_t y;
+} region_pos_t;
+
+typedef struct {
+  uint8_t shape;
+  uint8_t num;    /**< Number of points used. */
+  region_pos_t p[REGION_MAX_POINTS];
+} region_t;
+
 void print_pos(pos_t pos);
 float distance(pos_t a, pos_t b);
 int pos_cmp(pos_t a, pos_t b);
 
-#endif
\ No newline at end of file
+pos_t region_point(const region_t *r, uint8_t i);
+void region_set_point(region_t *r, uint8_t i, pos_t pos);
+void region_circle(region_t *r, pos_t center, float radius);
+void region_set_radius(region_t *r, float radius);
+void region_rect(region_t *r, pos_t min, pos_t max);
+uint8_t region_contains(const region_t *r, pos_t pos);
+uint8_t region_valid(const region_t *r);
+uint8_t region_equal(const region_t *a, const region_t *b);
+uint8_t region_covers(const region_t *outer, const region_t *inner);
+pos_t region_target(const region_t *r, pos_t from);
+void region_box(const region_t *r, pos_t *min, pos_t *max);
+void print_region(const region_t *r);
+
+#endif
@@ -42,13 +42,16 @@
 #include "net/rime.h"
 #include "dev/serial-line.h"
 #include "dev/button-sensor.h"
+#include "dev/cc2420.h"
 #include "lib/random.h"
 #include "serial-shell.h"
 
 /* standard library includes */
 #include <stdio.h>  /* For printf() */
 #include <string.h> /* For memcpy */
+#include <stddef.h> /* For offsetof */
 #include <float.h>  /* for FLT_MAX */
+#include <math.h>   /* For sqrt() */
 
 /* project includes */
 #include "geoware.h"
@@ -68,6 +71,30 @@
 /* node's position */
 pos_t own_pos;
 
+/* our position when we last told the regions of our subscriptions where we
+   are, and the sequence number of that update */
+static pos_t announced_pos;
+static uint8_t owner_seq;
+
+/* radio power levels used for beacons and for subscription floods, 0 means
+   whatever the radio is currently set to */
+uint8_t beacon_txpower = BEACON_TXPOWER;
+uint8_t flood_txpower = FLOOD_TXPOWER;
+
+/* receiver sensitivity of the cc2420 in dBm */
+#define CC2420_SENSITIVITY -95
+
+/* output power (in dBm) of the cc2420 power levels 3, 7, 11, .. 31 */
+static const int8_t txpower_dbm[] = {-25, -15, -10, -7, -5, -3, -1, 0};
+
+/* the network time a received reading was sampled at, or when it arrived
+   if readings carry no timestamp */
+#if GEOWARE_TIMESTAMPS
+#define READING_TIME(pkt) timesync_unstamp((pkt).stamp)
+#else
+#define READING_TIME(pkt) timesync_time()
+#endif
+
 /*---------------------------------------------------------------------------*/
 
 /* was trying to use pointers on packet buffer and to avoid coppying it
@@ -75,10 +102,146 @@ pos_t own_pos;
    to the buffer */
 static subscription_pkt_t subscription_pkt;
 static unsubscription_pkt_t unsubscription_pkt;
+static owner_update_pkt_t owner_update_pkt;
+static refresh_pkt_t refresh_pkt;
+static subscription_update_pkt_t subscription_update_pkt;
+static subscription_batch_pkt_t subscription_batch_pkt;
+static snapshot_pkt_t snapshot_pkt;
+static snapshot_pkt_t snapshot_out_pkt;
+static knn_pkt_t knn_pkt;
+static knn_pkt_t knn_out_pkt;
+static knn_reply_pkt_t knn_reply_in;
+static ght_pkt_t ght_pkt;
+static ght_pkt_t ght_out_pkt;
+static ght_pkt_t ght_replica_pkt;
+static ght_query_pkt_t ght_query_pkt;
+static ght_query_pkt_t ght_query_out_pkt;
+static history_pkt_t history_pkt;
+static history_pkt_t history_out_pkt;
 static reading_pkt_t reading_pkt_in;
 static reading_pkt_t reading_pkt_out;
+static shared_reading_pkt_t shared_reading_pkt_in;
+static shared_reading_pkt_t shared_reading_pkt_out;
+static vector_reading_pkt_t vector_reading_pkt_in;
+static vector_reading_pkt_t vector_reading_pkt_out;
+
+/* The blob we send: the subscription it is for, the fragments still to
+   send, and the timer pacing them. */
+static blob_frag_pkt_t blob_frag_in;
+static blob_frag_pkt_t blob_frag_out;
+static sid_t blob_sID;
+static uint32_t blob_todo;
+static struct ctimer blob_timer;
+
+/* The blobs we reassemble, the timer checks for stalled ones */
+static blob_nack_pkt_t blob_nack_in;
+static blob_nack_pkt_t blob_nack_out;
+static struct ctimer blob_nack_timer;
 static broadcast_pkt_t broadcast_pkt;
 
+/* This structure describes the subscription update waiting to be sent. */
+struct pending_update {
+  sid_t sID;
+  uint8_t changes;
+  pos_t reach_center;
+  float reach_radius;
+};
+
+/* our subscriptions that still have to be sent out, subscriptions issued
+   within SUBSCRIPTION_BATCH_WINDOW of each other go out together */
+static sid_t pending_subs[MAX_ACTIVE_SUBSCRIPTIONS];
+static uint8_t pending_subs_num;
+static struct ctimer batch_timer;
+
+/* the destinations of a shared reading that part ways with the rest here,
+   sent on as a packet of their own after SHARED_SPLIT_DELAY */
+static shared_reading_pkt_t split_pkt;
+static struct ctimer split_timer;
+
+/* the process readings for subscriptions we do not hold are delivered to,
+   if we are a sink for other owners */
+static struct process *sink_process;
+
+/* This structure holds our answer to a query, sent after a random delay of
+   up to SNAPSHOT_JITTER so the answers of a region do not collide. Stored
+   readings and raw history samples go out one after the other from the
+   same slot, KNN_REPLY_GAP apart. A slot is in use while its timer runs. */
+struct answer {
+  struct ctimer timer;
+
+  union {
+    reading_pkt_t reading;
+    knn_reply_pkt_t knn;
+  } pkt;
+
+  /* the stream we are sending: the sensor and the key or aggregate asked
+     for, the time range in our clock and the next one to send */
+  sensor_t type;
+  uint8_t key;
+  uint8_t aggr;
+  uint32_t from;
+  uint32_t to;
+  uint16_t next;
+};
+
+/* one slot per query we are answering */
+static struct answer answers[ANSWER_MAX];
+
+/* The snapshot queries we sent, with the process the answers go to. */
+static struct {
+  sid_t qID;
+  struct process *proc;
+  uint32_t timestamp;
+} snapshots[SNAPSHOT_MAX];
+
+/* The kNN query we are the home of, one at a time: the ring being flooded
+   and the nearest answers so far, nearest first. pkt.k is 0 when idle. */
+static struct {
+  knn_pkt_t pkt;
+  uint8_t found;
+  uint8_t sent;
+  knn_reply_pkt_t best[KNN_MAX];
+  struct ctimer timer;
+} knn_query;
+
+
+/* This structure holds a flood we are backing off to rebroadcast, and counts
+   how many times we heard neighbors rebroadcast it meanwhile. */
+struct flood {
+  /* The ->next pointer is needed since we are placing these on a
+     Contiki list. */
+  struct flood *next;
+
+  /* The ->timer fires at the end of the backoff */
+  struct ctimer timer;
+
+  uint8_t type;
+  sid_t sID;
+  uint8_t heard;
+  uint8_t len;
+
+  union {
+    geoware_hdr_t hdr;
+    subscription_pkt_t sub;
+    unsubscription_pkt_t unsub;
+    owner_update_pkt_t update;
+    refresh_pkt_t refresh;
+    subscription_update_pkt_t sub_update;
+    subscription_batch_pkt_t batch;
+    snapshot_pkt_t snapshot;
+    knn_pkt_t knn;
+    history_pkt_t history;
+  } pkt;
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   the floods waiting to be rebroadcast. */
+MEMB(floods_memb, struct flood, FLOOD_QUEUE);
+
+/* The floods_list holds the floods we are backing off to rebroadcast, so
+   floods arriving meanwhile are not lost. */
+LIST(floods_list);
+
 /*---------------------------------------------------------------------------*/
 
 /* processes */
@@ -92,12 +255,116 @@ PROCESS(boot_process, "Boot process");
 /* events */
 process_event_t broadcast_subscription_event;
 process_event_t broadcast_unsubscription_event;
+process_event_t broadcast_owner_update_event;
+process_event_t broadcast_refresh_event;
+process_event_t broadcast_subscription_update_event;
+process_event_t broadcast_subscription_batch_event;
+process_event_t broadcast_snapshot_event;
+process_event_t broadcast_knn_event;
+process_event_t broadcast_ght_event;
+process_event_t broadcast_history_event;
+process_event_t beacon_event;
 process_event_t broadcast_sid_discovery_event;
 process_event_t subscribe_event;
 process_event_t unsubscribe_event;
 process_event_t publish_event;
 process_event_t geoware_reading_event;
 process_event_t sid_discovery_reply_event;
+process_event_t reroute_event;
+process_event_t owner_update_event;
+process_event_t refresh_event;
+process_event_t subscription_update_event;
+process_event_t snapshot_event;
+process_event_t knn_event;
+process_event_t ght_query_event;
+process_event_t history_event;
+process_event_t outbox_event;
+
+/*---------------------------------------------------------------------------*/
+
+/* This structure holds a copy of a unicast handed to the MAC layer, together
+   with the multihop attributes needed to send it again in case the chosen
+   next hop does not acknowledge it. */
+struct inflight {
+  /* The ->next pointer is needed since we are placing these on a
+     Contiki list. */
+  struct inflight *next;
+
+  uint8_t data[PACKETBUF_SIZE];
+  uint16_t len;
+
+  rimeaddr_t originator;
+  rimeaddr_t dest;
+  rimeaddr_t prevhop;
+  rimeaddr_t nexthop;
+  uint8_t hops;
+
+  /* The ->reroutes field counts how many times this packet has already been
+     re-routed around a failed neighbor */
+  uint8_t reroutes;
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   the copies of the unicasts the MAC layer has not reported on yet. */
+MEMB(inflight_memb, struct inflight, INFLIGHT_MAX);
+
+/* The inflight_list holds them in the order they were sent. The MAC layer
+   sends the packets for the same next hop in that order, so the report for
+   a next hop belongs to the oldest packet for it. */
+LIST(inflight_list);
+
+/* set while forward() is called to re-route a packet, which was already
+   re-routed reroutes times */
+static uint8_t rerouting;
+static uint8_t reroutes;
+
+/* set while forward() is called for a reading taken out of the outbox */
+static uint8_t draining;
+
+/* set while forward() calls itself for a reading failing over to the next
+   sink, the packet was already looked at on the way in */
+static uint8_t failing_over;
+
+/* paces the readings sent on from the outbox */
+static struct ctimer outbox_timer;
+
+/* number of packets relayed for others since our last beacon */
+static uint8_t relayed;
+
+/* set while a packet received by broadcast is processed, as opposed to one
+   delivered to us by the multihop layer */
+static uint8_t via_broadcast;
+
+/* the publish slot we picked, see pick_slot() */
+static uint8_t slot;
+
+/*---------------------------------------------------------------------------*/
+
+#if GEOWARE_LOW_POWER
+/* This structure holds a reading waiting to be sent in the next packet
+   train. */
+struct train_entry {
+  /* The ->next pointer is needed since we are placing these
+     on a Contiki list. */
+  struct train_entry *next;
+
+  reading_pkt_t pkt;
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   train entries. */
+MEMB(train_memb, struct train_entry, TRAIN_MAX);
+
+/* The train_list is a Contiki list that holds the readings to be sent
+   back-to-back, so the MAC layer can send them all within one wake-up
+   of the next hop. */
+LIST(train_list);
+
+/* The train_timer bounds how long a reading waits for the train to fill */
+static struct ctimer train_timer;
+
+process_event_t train_event;
+#endif /* GEOWARE_LOW_POWER */
 
 /*---------------------------------------------------------------------------*/
 
@@ -124,6 +391,26 @@ print_neighbors() {
   }
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * This function returns where the neighbor is now, extrapolated from the
+ * position it last reported and its estimated velocity.
+ */
+pos_t
+neighbor_pos(struct neighbor *n)
+{
+  pos_t pos = n->pos[0];
+  uint32_t age = clock_seconds() - n->timestamp;
+
+  if(age > EXTRAPOLATION_LIMIT) {
+    age = EXTRAPOLATION_LIMIT;
+  }
+
+  pos.x += n->vx * age;
+  pos.y += n->vy * age;
+
+  return pos;
+}
+/*---------------------------------------------------------------------------*/
 /*
  * This function is called by the ctimer present in each neighbor
  * table entry. The function removes the neighbor from the table
@@ -139,6 +426,72 @@ remove_neighbor(void *n)
   list_remove(neighbors_list, tmp);
   memb_free(&neighbors_memb, tmp);
 }
+/*---------------------------------------------------------------------------*/
+/*
+ * This function evicts a neighbor straight away, without waiting for its
+ * ctimer to expire. Used when the link layer tells us the neighbor did not
+ * acknowledge a packet. If it is still alive its next beacon adds it back.
+ */
+static void
+evict_neighbor(const rimeaddr_t *addr)
+{
+  struct neighbor *n;
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    if(rimeaddr_cmp(&n->addr, addr)) {
+      break;
+    }
+  }
+
+  if(n != NULL) {
+    printf("evicting neighbor %d.%d\n", n->addr.u8[0], n->addr.u8[1]);
+
+    ctimer_stop(&n->ctimer);
+    remove_neighbor(n);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function picks the lowest cc2420 power level that still reaches the
+ * neighbor, given the path loss of the link and the current fade margin.
+ */
+static void
+update_txpower(struct neighbor *n)
+{
+  int16_t needed = CC2420_SENSITIVITY + n->pathloss + n->txmargin;
+  uint8_t i;
+
+  for(i = 0; i < sizeof(txpower_dbm) - 1; i++) {
+    if(txpower_dbm[i] >= needed) {
+      break;
+    }
+  }
+
+  n->txpower = 4*i + 3;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function estimates the path loss to a neighbor from the RSSI of a
+ * beacon it sent with the given power level.
+ */
+static void
+estimate_link(struct neighbor *n, uint8_t level)
+{
+  /* the cc2420 reports RSSI with an offset of 45 dB */
+  int16_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI) - 45;
+  int16_t loss;
+
+  if(level > CC2420_TXPOWER_MAX) {
+    level = CC2420_TXPOWER_MAX;
+  }
+
+  loss = txpower_dbm[level/4] - rssi;
+  n->pathloss = loss < 0 ? 0 : loss;
+
+  update_txpower(n);
+}
 
 /*---------------------------------------------------------------------------*/
 
@@ -174,11 +527,38 @@ add_neighbor(pos_t pos, rimeaddr_t *addr)
 
     /* Initialize the fields. */
     rimeaddr_copy(&n->addr, addr);
+    n->pos[0] = pos;
+    n->timestamp = clock_seconds();
+    n->vx = 0;
+    n->vy = 0;
+    n->txmargin = TXPOWER_MARGIN;
+    n->txpower = 0;
+    n->phase = PHASE_UNKNOWN;
+    n->energy = 100;
+    n->load = 0;
+    n->marked = 0;
+    n->slot = PUBLISH_SLOTS;
 
     /* Place the neighbor on the neighbor list. */
     list_add(neighbors_list, n);
   }
 
+  /* update the velocity estimate, smoothing out the error of the whole
+     second timestamps. a neighbor reporting the same position again has
+     stopped */
+  if(clock_seconds() > n->timestamp) {
+    uint32_t dt = clock_seconds() - n->timestamp;
+
+    if(pos_cmp(pos, n->pos[0])) {
+      n->vx = 0;
+      n->vy = 0;
+    }
+    else {
+      n->vx = (n->vx + (pos.x - n->pos[0].x) / dt) / 2;
+      n->vy = (n->vy + (pos.y - n->pos[0].y) / dt) / 2;
+    }
+  }
+
   /* update the broadcast timestamp */
   n->timestamp = clock_seconds();
 
@@ -192,6 +572,20 @@ add_neighbor(pos_t pos, rimeaddr_t *addr)
   return n;
 };
 
+/*---------------------------------------------------------------------------*/
+/*
+ * This function sets the radio power level of the packet in the packet
+ * buffer. The radio driver restores its own setting after the packet is
+ * sent. Level 0 leaves the radio setting untouched.
+ */
+static void
+set_txpower(uint8_t level)
+{
+  if(level > 0) {
+    packetbuf_set_attr(PACKETBUF_ATTR_RADIO_TXPOWER, level + 1);
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 /* This function is called whenever a broadcast message is received. */
 static void
@@ -246,19 +640,110 @@ broadcast_recv(struct broadcast_conn *c, const rimeaddr_t *from)
   	  n->pos[i+1] = broadcast_pkt.npos[i];
   	}
 
+    /* learn how much power we need to reach it */
+    estimate_link(n, broadcast_pkt.txpower);
+
+    n->energy = broadcast_pkt.energy;
+    n->load = broadcast_pkt.load;
+    n->marked = broadcast_pkt.marked;
+    n->slot = broadcast_pkt.slot;
+
+    timesync_heard(&broadcast_pkt.sync);
+
   	// debug_printf("updated neighbor: %d.%d, ", n->addr.u8[0], n->addr.u8[1]);
   	// print_pos(n->pos[0]);
   }
 
   else if (broadcast_hdr.type == GEOWARE_SUBSCRIPTION) {
     memcpy(&subscription_pkt, packetbuf_dataptr(), sizeof(subscription_pkt_t));
+    /* readings go back the way the subscription came, if it came from the
+       owner and not from a node answering a SID discovery */
+    if(broadcast_hdr.firewrk) {
+      route_add(subscription_pkt.subscription.subscription_hdr.sID, from);
+    }
+    via_broadcast = 1;
     process_subscription(&subscription_pkt);
+    via_broadcast = 0;
   }
   else if (broadcast_hdr.type == GEOWARE_UNSUBSCRIPTION) {
     memcpy(&unsubscription_pkt, packetbuf_dataptr(), sizeof(unsubscription_pkt_t));
+    via_broadcast = 1;
     process_unsubscription(&unsubscription_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_OWNER_UPDATE) {
+    memcpy(&owner_update_pkt, packetbuf_dataptr(), sizeof(owner_update_pkt_t));
+    via_broadcast = 1;
+    process_owner_update(&owner_update_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_REFRESH) {
+    memcpy(&refresh_pkt, packetbuf_dataptr(), sizeof(refresh_pkt_t));
+    /* the refresh takes the same way back, keep the reverse path alive */
+    route_add(refresh_pkt.sID, from);
+    via_broadcast = 1;
+    process_refresh(&refresh_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_SUBSCRIPTION_UPDATE) {
+    memcpy(&subscription_update_pkt, packetbuf_dataptr(), \
+      sizeof(subscription_update_pkt_t));
+    route_add(subscription_update_pkt.subscription.subscription_hdr.sID, from);
+    via_broadcast = 1;
+    process_subscription_update(&subscription_update_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_SNAPSHOT) {
+    memcpy(&snapshot_pkt, packetbuf_dataptr(), sizeof(snapshot_pkt_t));
+    /* the answers go back the way the query came */
+    route_add(snapshot_pkt.query_hdr.sID, from);
+    via_broadcast = 1;
+    process_snapshot(&snapshot_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_HISTORY) {
+    memcpy(&history_pkt, packetbuf_dataptr(), sizeof(history_pkt_t));
+    /* the answers go back the way the query came */
+    route_add(history_pkt.query_hdr.sID, from);
+    via_broadcast = 1;
+    process_history(&history_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_GHT_REPLICA) {
+    memcpy(&ght_pkt, packetbuf_dataptr(), sizeof(ght_pkt_t));
+    /* the neighbors of the home around the point keep a copy */
+    if(distance(own_pos, ght_pkt.point) <= GHT_REPLICA_RADIUS) {
+      ght_store(ght_pkt.type, ght_pkt.key, &ght_pkt.source, &ght_pkt.value);
+    }
+  }
+  else if (broadcast_hdr.type == GEOWARE_KNN) {
+    memcpy(&knn_pkt, packetbuf_dataptr(), sizeof(knn_pkt_t));
+    /* the answers go back to the home the way the ring came */
+    route_add(knn_pkt.home_hdr.sID, from);
+    via_broadcast = 1;
+    process_knn(&knn_pkt);
+    via_broadcast = 0;
+  }
+  else if (broadcast_hdr.type == GEOWARE_SUBSCRIPTION_BATCH) {
+    memcpy(&subscription_batch_pkt, packetbuf_dataptr(), \
+      MIN(packetbuf_datalen(), sizeof(subscription_batch_pkt_t)));
+    for(i = 0; broadcast_hdr.firewrk && \
+        i < subscription_batch_pkt.hdr.len && \
+        i < SUBSCRIPTION_BATCH_MAX; i++) {
+      route_add(subscription_batch_pkt.subs[i].subscription_hdr.sID, from);
+    }
+    via_broadcast = 1;
+    process_subscription_batch(&subscription_batch_pkt);
+    via_broadcast = 0;
   }
   else if(broadcast_hdr.type == GEOWARE_SID_DISCOVERY) {
+#if GEOWARE_CDS_RELAY
+    /* every node has a backbone neighbor, leave the reply to them */
+    if(!is_backbone()) {
+      return;
+    }
+#endif
+
     printf("received sid discovery request\n");
     static pos_t requester;
 
@@ -268,6 +753,202 @@ broadcast_recv(struct broadcast_conn *c, const rimeaddr_t *from)
   }
 
 }
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called when a flood packet we already processed is
+ * received again. If it is the one we are about to rebroadcast, one more
+ * neighbor has covered (part of) our area.
+ */
+void
+flood_heard(uint8_t type, sid_t sID)
+{
+  struct flood *f;
+
+  for(f = list_head(floods_list); f != NULL; f = list_item_next(f)) {
+    if(f->sID == sID && f->type == type && f->heard < UINT8_MAX) {
+      f->heard++;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function copies a flood packet to be rebroadcast and starts counting
+ * the copies we hear from neighbors. A newer packet of a flood already
+ * waiting takes its place. Returns NULL if too many floods are waiting.
+ */
+static struct flood *
+flood_prepare(void *pkt)
+{
+  struct flood *f;
+  uint8_t type = ((geoware_hdr_t*)pkt)->type;
+  uint8_t len;
+  sid_t sID;
+
+  switch(type) {
+    case GEOWARE_SUBSCRIPTION:
+      len = sizeof(subscription_pkt_t);
+      sID = ((subscription_pkt_t*)pkt)->subscription.subscription_hdr.sID;
+      break;
+    case GEOWARE_UNSUBSCRIPTION:
+      len = sizeof(unsubscription_pkt_t);
+      sID = ((unsubscription_pkt_t*)pkt)->sID;
+      break;
+    case GEOWARE_REFRESH:
+      len = sizeof(refresh_pkt_t);
+      sID = ((refresh_pkt_t*)pkt)->sID;
+      break;
+    case GEOWARE_SNAPSHOT:
+      len = sizeof(snapshot_pkt_t);
+      sID = ((snapshot_pkt_t*)pkt)->query_hdr.sID;
+      break;
+    case GEOWARE_HISTORY:
+      len = sizeof(history_pkt_t);
+      sID = ((history_pkt_t*)pkt)->query_hdr.sID;
+      break;
+    case GEOWARE_KNN:
+      len = sizeof(knn_pkt_t);
+      sID = ((knn_pkt_t*)pkt)->home_hdr.sID;
+      break;
+    case GEOWARE_SUBSCRIPTION_BATCH:
+      len = SUBSCRIPTION_BATCH_LEN(((geoware_hdr_t*)pkt)->len);
+      sID = ((subscription_batch_pkt_t*)pkt)->subs[0].subscription_hdr.sID;
+      break;
+    case GEOWARE_SUBSCRIPTION_UPDATE:
+      len = sizeof(subscription_update_pkt_t);
+      sID = ((subscription_update_pkt_t*)pkt)-> \
+        subscription.subscription_hdr.sID;
+      break;
+    default:
+      len = sizeof(owner_update_pkt_t);
+      sID = ((owner_update_pkt_t*)pkt)->sID;
+      break;
+  }
+
+  for(f = list_head(floods_list); f != NULL; f = list_item_next(f)) {
+    if(f->sID == sID && f->type == type) {
+      break;
+    }
+  }
+
+  if(f == NULL) {
+    f = memb_alloc(&floods_memb);
+    if(f == NULL) {
+      return NULL;
+    }
+    list_add(floods_list, f);
+  }
+
+  memcpy(&f->pkt, pkt, len);
+  f->type = type;
+  f->sID = sID;
+  f->len = len;
+  f->heard = 0;
+
+  return f;
+}
+
+/*---------------------------------------------------------------------------*/
+#if GEOWARE_CDS_RELAY
+/*
+ * This function returns the region a flood packet is for. Rings and
+ * subscription updates reach further than a region of the packet, their
+ * circle is set up in reach.
+ */
+static const region_t *
+flood_region(void *pkt, region_t *reach)
+{
+  switch(((geoware_hdr_t*)pkt)->type) {
+    case GEOWARE_SUBSCRIPTION:
+      return &((subscription_pkt_t*)pkt)->subscription.region;
+    case GEOWARE_UNSUBSCRIPTION:
+      return &((unsubscription_pkt_t*)pkt)->region;
+    case GEOWARE_OWNER_UPDATE:
+      return &((owner_update_pkt_t*)pkt)->region;
+    case GEOWARE_REFRESH:
+      return &((refresh_pkt_t*)pkt)->region;
+    case GEOWARE_SNAPSHOT:
+      return &((snapshot_pkt_t*)pkt)->region;
+    case GEOWARE_HISTORY:
+      return &((history_pkt_t*)pkt)->region;
+    case GEOWARE_SUBSCRIPTION_BATCH:
+      return &((subscription_batch_pkt_t*)pkt)->subs[0].region;
+    case GEOWARE_SUBSCRIPTION_UPDATE:
+      region_circle(reach, ((subscription_update_pkt_t*)pkt)->reach_center, \
+        ((subscription_update_pkt_t*)pkt)->reach_radius);
+      return reach;
+    case GEOWARE_KNN:
+      region_circle(reach, ((knn_pkt_t*)pkt)->point, \
+        ((knn_pkt_t*)pkt)->outer);
+      return reach;
+  }
+
+  return NULL;
+}
+#endif /* GEOWARE_CDS_RELAY */
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function returns how long to wait before rebroadcasting a flood
+ * received from a neighbor at the given position. The further away the
+ * sender, the more new area we cover and the earlier we go, so nodes at
+ * the edge of the sender's range rebroadcast first and the ones close to
+ * it are likely to hear enough copies to stay quiet. The range is taken as
+ * the distance to our furthest neighbor.
+ */
+static clock_time_t
+flood_backoff(pos_t sender)
+{
+  struct neighbor *n;
+  float range = 0;
+  float closeness = 0;
+  float d;
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    d = distance(own_pos, n->pos[0]);
+    if(d > range) {
+      range = d;
+    }
+  }
+
+  d = distance(own_pos, sender);
+  if(d < range) {
+    closeness = 1 - d/range;
+  }
+
+  return FLOOD_BACKOFF_MIN + (clock_time_t)(closeness*FLOOD_BACKOFF_SPAN) + \
+    random_rand()%FLOOD_JITTER;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function picks our publish slot, the lowest one none of the
+ * neighbors with a lower address advertised. Going up the addresses this
+ * gives neighbors distinct slots, as long as there are enough of them.
+ */
+static uint8_t
+pick_slot()
+{
+  struct neighbor *n;
+  uint16_t used = 0;
+  uint8_t i;
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    if(n->slot < PUBLISH_SLOTS && \
+        memcmp(&n->addr, &rimeaddr_node_addr, sizeof(rimeaddr_t)) < 0) {
+      used |= 1 << n->slot;
+    }
+  }
+
+  for(i = 0; i < PUBLISH_SLOTS; i++) {
+    if(!(used & (1 << i))) {
+      return i;
+    }
+  }
+
+  return rimeaddr_node_addr.u8[1] % PUBLISH_SLOTS;
+}
+
 /*---------------------------------------------------------------------------*/
 /* Declare the broadcast  structures */
 static struct broadcast_conn broadcast;
@@ -277,6 +958,35 @@ static struct broadcast_conn broadcast;
    broadcast_open() call below. */
 static const struct broadcast_callbacks broadcast_call = {broadcast_recv};
 /*---------------------------------------------------------------------------*/
+/*
+ * This function is called by the ctimer of a flood once its backoff is
+ * over. It rebroadcasts the flood unless enough neighbors already covered
+ * the area around us.
+ */
+static void
+flood_send(void *ptr)
+{
+  struct flood *f = ptr;
+
+  list_remove(floods_list, f);
+
+  if(f->heard >= FLOOD_SUPPRESS_COUNT) {
+    debug_printf("suppressed, heard %d times\n", f->heard);
+    memb_free(&floods_memb, f);
+    return;
+  }
+
+  /* need to clear any previous (multihop) attributes to be able to send
+     broadcast */
+  // packetbuf_attr_clear();
+  f->pkt.hdr.pos = own_pos;
+  packetbuf_copyfrom(&f->pkt, f->len);
+  set_txpower(flood_txpower);
+
+  broadcast_send(&broadcast);
+  memb_free(&floods_memb, f);
+}
+/*---------------------------------------------------------------------------*/
 PROCESS_THREAD(broadcast_process, ev, data)
 {
   PROCESS_EXITHANDLER(broadcast_close(&broadcast);)
@@ -284,15 +994,29 @@ PROCESS_THREAD(broadcast_process, ev, data)
   PROCESS_BEGIN();
 
   static struct etimer et;
-  static struct etimer sub_et;
-  static void* packet_ptr;
 
   struct neighbor *n;
+  struct flood *f;
+#if GEOWARE_CDS_RELAY
+  region_t reach;
+#endif
 
   broadcast_subscription_event = process_alloc_event();
   broadcast_unsubscription_event = process_alloc_event();
+  broadcast_owner_update_event = process_alloc_event();
+  broadcast_refresh_event = process_alloc_event();
+  broadcast_subscription_update_event = process_alloc_event();
+  broadcast_subscription_batch_event = process_alloc_event();
+  broadcast_snapshot_event = process_alloc_event();
+  broadcast_knn_event = process_alloc_event();
+  broadcast_ght_event = process_alloc_event();
+  broadcast_history_event = process_alloc_event();
+  beacon_event = process_alloc_event();
   broadcast_sid_discovery_event = process_alloc_event();
 
+  memb_init(&floods_memb);
+  list_init(floods_list);
+
   broadcast_open(&broadcast, BROADCAST_CHANNEL, &broadcast_call);
 
   /* Send a broadcast every BROADCAST_PERIOD with a jitter of half of 
@@ -302,7 +1026,8 @@ PROCESS_THREAD(broadcast_process, ev, data)
   while(1) {
     PROCESS_WAIT_EVENT();
     // uint16_t period = clock_seconds() < BOOTSTRAP_TIME ? BROADCAST_PERIOD : 2*BROADCAST_PERIOD;
-    if(etimer_expired(&et)) {
+    /* beacon_event asks for a beacon right away, after we moved */
+    if(etimer_expired(&et) || ev == beacon_event) {
       /* Send a broadcast every BROADCAST_PERIOD with a jitter of half of 
          BROADCAST_PERIOD */
       // etimer_set(&et, CLOCK_SECOND*period/2 + random_rand()%(period+period*CLOCK_SECOND));
@@ -335,56 +1060,80 @@ PROCESS_THREAD(broadcast_process, ev, data)
       /* log the time of the broadcast */
       // debug_printf("[BC] @%lu\n", clock_seconds());
 
-      packetbuf_copyfrom(&broadcast_pkt, \
-        sizeof(geoware_hdr_t)+(1+broadcast_pkt.hdr.len)*sizeof(pos_t));
-
-      broadcast_send(&broadcast);
-
-      
-    }
-
-    if (ev == broadcast_subscription_event) {
-      /* sanity check */
-      if(data == NULL) {
-        continue;
-      }
+      /* advertise how much energy we have left and how busy we are, so
+         neighbors can spread their traffic */
+      broadcast_pkt.energy = energy_residual();
+      broadcast_pkt.load = relayed;
+#if GEOWARE_LOW_POWER
+      broadcast_pkt.load += list_length(train_list);
+#endif
+      relayed = 0;
 
-      packet_ptr = data;
+#if GEOWARE_CDS_RELAY
+      /* advertise whether we connect neighbors that cannot hear each other */
+      backbone_update();
+#endif
+      broadcast_pkt.marked = backbone_marked();
 
-      debug_printf("rebroadcasting subscription\n");
-      // print_subscription(&subscription_pkt.subscription);
+      /* advertise the power level so neighbors can estimate the path loss */
+      broadcast_pkt.txpower = beacon_txpower ? beacon_txpower : \
+        cc2420_get_txpower();
 
-      // TODO: make this dependent on the number of neighbors
-      etimer_set(&sub_et, CLOCK_SECOND/2 + random_rand()%(CLOCK_SECOND*2));
+      /* advertise our publish slot, picked after the neighbors' */
+      broadcast_pkt.slot = slot = pick_slot();
 
-      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&sub_et));
+      /* pass on the network time, as late as we can */
+      timesync_beacon(&broadcast_pkt.sync);
 
-      /* need to clear any previous (multihop) attributes to be able to send
-         broadcast */
-      // packetbuf_attr_clear();
-      packetbuf_copyfrom(packet_ptr, sizeof(subscription_pkt_t));
+      packetbuf_copyfrom(&broadcast_pkt, offsetof(broadcast_pkt_t, npos) + \
+        broadcast_pkt.hdr.len*sizeof(pos_t));
+      set_txpower(beacon_txpower);
 
       broadcast_send(&broadcast);
+
+      
     }
-    else if (ev == broadcast_unsubscription_event) {
+
+    if (ev == broadcast_subscription_event || \
+        ev == broadcast_unsubscription_event || \
+        ev == broadcast_owner_update_event || \
+        ev == broadcast_refresh_event || \
+        ev == broadcast_subscription_update_event || \
+        ev == broadcast_subscription_batch_event || \
+        ev == broadcast_snapshot_event || \
+        ev == broadcast_knn_event || \
+        ev == broadcast_history_event) {
       /* sanity check */
       if(data == NULL) {
         continue;
       }
 
-      packet_ptr = data;
-
-      debug_printf("rebroadcasting unsubscription\n");
-
-      // print_unsubscription(&unsubscription_pkt);
+#if GEOWARE_CDS_RELAY
+      /* the node the flood was delivered to starts it, after that the
+         backbone passes it on, and the nodes of its region that have no
+         backbone neighbor there */
+      if(via_broadcast && !backbone_relays(flood_region(data, &reach))) {
+        continue;
+      }
+#endif
 
-      // TODO: make this dependent on the number of neighbors
-      etimer_set(&sub_et, CLOCK_SECOND/2 + random_rand()%CLOCK_SECOND);
+      /* keep our own copy, the packet we were given can be overwritten
+         by the next one received while we back off */
+      f = flood_prepare(data);
+      if(f == NULL) {
+        printf("too many floods waiting, dropping one\n");
+        continue;
+      }
 
-      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&sub_et));
+      debug_printf("rebroadcasting flood type %d of sID %u\n", \
+        f->type, f->sID);
 
-      /* Copy the reading to the packet buffer. */
-      packetbuf_copyfrom(packet_ptr, sizeof(unsubscription_pkt_t));
+      /* the process goes on handling events while we back off */
+      ctimer_set(&f->timer, flood_backoff(f->pkt.hdr.pos), flood_send, f);
+    }
+    else if (ev == broadcast_ght_event) {
+      packetbuf_copyfrom(data, sizeof(ght_pkt_t));
+      set_txpower(flood_txpower);
 
       broadcast_send(&broadcast);
     }
@@ -395,6 +1144,7 @@ PROCESS_THREAD(broadcast_process, ev, data)
       broadcast_pkt.hdr.pos = own_pos;
 
       packetbuf_copyfrom(&broadcast_pkt, sizeof(geoware_hdr_t));
+      set_txpower(flood_txpower);
 
       broadcast_send(&broadcast);
     }
@@ -405,440 +1155,2494 @@ PROCESS_THREAD(broadcast_process, ev, data)
 
 /*---------------------------------------------------------------------------*/
 /*
- * This function is called at the final recepient of the message.
+ * This function finds a free slot for our answer to query qID. Returns NULL
+ * if we are answering qID already or all the slots are in use.
  */
-static void
-recv(struct multihop_conn *c, const rimeaddr_t *sender,
-     const rimeaddr_t *prevhop,
-     uint8_t hops)
+static struct answer *
+answer_slot(sid_t qID)
 {
-  geoware_hdr_t *multihop_hdr;
-
-  debug_printf("multihop message received. originator: %d.%d hops: %d\n", \
-  	sender->u8[0], sender->u8[1], hops);
-
-  multihop_hdr = packetbuf_dataptr();
+  struct answer *free = NULL;
+  uint8_t i;
 
-  if(multihop_hdr->ver != GEOWARE_VERSION) {
-    return;
+  for(i = 0; i < ANSWER_MAX; i++) {
+    if(ctimer_expired(&answers[i].timer)) {
+      if(free == NULL) {
+        free = &answers[i];
+      }
+    }
+    else if(answers[i].pkt.reading.reading_hdr.subscription_hdr.sID == qID) {
+      return NULL;
+    }
   }
 
-  /* update neighbor neighbor, because why not. only if the firework flag is
-     set because otherwise the position field is the destination */
-  if(multihop_hdr->firewrk) {
-    add_neighbor(multihop_hdr->pos, (rimeaddr_t*)prevhop);
+  if(free == NULL) {
+    printf("answer to query %u dropped, busy\n", qID);
   }
 
-  if(multihop_hdr->type == GEOWARE_SUBSCRIPTION) {
-    memcpy(&subscription_pkt, packetbuf_dataptr(), sizeof(subscription_pkt_t));
+  return free;
+}
 
-    debug_printf("subscription packet received.\n");
-
-    // print_subscription(&subscription_pkt->subscription);
+/*---------------------------------------------------------------------------*/
+/*
+ * This function finds the process waiting for the answers to our snapshot
+ * qID. Answers arriving more than SNAPSHOT_LEASE seconds late, and readings
+ * of no snapshot of ours, go to the sink process if there is one.
+ */
+static struct process *
+snapshot_owner(sid_t qID)
+{
+  uint8_t i;
 
-    process_subscription(&subscription_pkt);
+  for(i = 0; i < SNAPSHOT_MAX; i++) {
+    if(snapshots[i].qID == qID && \
+        clock_seconds() - snapshots[i].timestamp <= SNAPSHOT_LEASE) {
+      return snapshots[i].proc;
+    }
   }
-  else if(multihop_hdr->type == GEOWARE_UNSUBSCRIPTION) {
-    memcpy(&unsubscription_pkt, packetbuf_dataptr(), \
-      sizeof(unsubscription_pkt_t));
 
-    debug_printf("unsubscription packet received.\n");
+  return sink_process;
+}
 
-    process_unsubscription(&unsubscription_pkt);
+/*---------------------------------------------------------------------------*/
+/* This function hands a kNN result to the process waiting for it. */
+static void
+knn_deliver(knn_reply_pkt_t *reply)
+{
+  sid_t *qID = &reply->reading_hdr.subscription_hdr.sID;
+  struct process *proc = snapshot_owner(*qID);
+
+  if(proc == NULL) {
+    return;
   }
-  else if(multihop_hdr->type == GEOWARE_READING) {
-    debug_printf("reading packet received.\n");
-    memcpy(&reading_pkt_in, packetbuf_dataptr(), sizeof(reading_pkt_t));
-    
-    struct process *proc = get_subscription_struct( \
-      reading_pkt_in.reading_hdr.subscription_hdr.sID)->proc;
 
-    /* add the reading to local, gateway buffer */
-    reading_add(reading_pkt_in.reading_hdr.subscription_hdr.sID, \
-      (rimeaddr_t*)sender, &reading_pkt_in.value);
+  reading_add(*qID, 0, &reply->node, &reply->value, timesync_time());
+  process_post(proc, geoware_reading_event, (void*) qID);
+}
 
-    /* notify the application process we have new reading */
-    process_post(proc, geoware_reading_event, \
-      (void*) &reading_pkt_in.reading_hdr.subscription_hdr.sID);
+/*---------------------------------------------------------------------------*/
+/*
+ * This function keeps an answer to the kNN query we are the home of if it
+ * is among the k nearest so far.
+ */
+static void
+knn_add(knn_reply_pkt_t *reply)
+{
+  float dist = distance(reply->pos, knn_query.pkt.point);
+  uint8_t i;
+
+  for(i = knn_query.found; i > 0 && \
+      distance(knn_query.best[i-1].pos, knn_query.pkt.point) > dist; i--) {
+    if(i < knn_query.pkt.k) {
+      knn_query.best[i] = knn_query.best[i-1];
+    }
+  }
+
+  if(i < knn_query.pkt.k) {
+    knn_query.best[i] = *reply;
+    if(knn_query.found < knn_query.pkt.k) {
+      knn_query.found++;
+    }
   }
 }
+
 /*---------------------------------------------------------------------------*/
 /*
- * This function is called to forward a packet. The function picks the
- * neighbor closest to the destination from the neighbor list and returns
- * its address. If no neighbor is closer than ourselfes, choose from neighbor's
- * neighbors. The multihop layer sends the packet to this address. If no
- * neighbor is found, the function returns NULL to signal to the multihop layer
- * that the packet should be dropped.
+ * This function is called by the kNN ctimer to send the results to the
+ * querier, KNN_REPLY_GAP apart, nearest first.
  */
-static rimeaddr_t *
-forward(struct multihop_conn *c,
-	const rimeaddr_t *originator, const rimeaddr_t *dest,
-	const rimeaddr_t *prevhop, uint8_t hops)
+static void
+knn_result_send(void *ptr)
 {
-  /* Find neighbor closer to the destination to forward to. */
-  struct neighbor *n;
-  struct neighbor *closest = NULL;
-	geoware_hdr_t *multihop_hdr;
-	reading_hdr_t *reading_hdr;
-  pos_t destination;
-  float proximity = EPSILON;
-	uint8_t i;
-
-	float min_dist = FLT_MAX;
+  knn_reply_pkt_t *result;
 
-  /* The packetbuf_dataptr() returns a pointer to the first data byte
-     in the received packet. */
-  multihop_hdr = packetbuf_dataptr();
+  if(knn_query.sent < knn_query.found) {
+    result = &knn_query.best[knn_query.sent++];
+    result->reading_hdr.subscription_hdr = knn_query.pkt.query_hdr;
 
-  // debug_printf("%d.%d: dest - %d.%d\n", \
-  //   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
-  //   dest->u8[0], dest->u8[1]);
+    if(rimeaddr_cmp(&knn_query.pkt.query_hdr.owner, &rimeaddr_node_addr)) {
+      knn_deliver(result);
+      knn_result_send(NULL);
+      return;
+    }
 
-  if(multihop_hdr->ver != GEOWARE_VERSION || list_length(neighbors_list)==0 \
-      || rimeaddr_cmp(&rimeaddr_node_addr, dest)) {
-  	return NULL;
+    process_post(&multihop_process, publish_event, (void*) result);
+    ctimer_set(&knn_query.timer, KNN_REPLY_GAP, knn_result_send, NULL);
+    return;
   }
 
-  /* update neighbor if we havent originated the packet,
-     because why not */
-  if(!rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
-    add_neighbor(multihop_hdr->pos, (rimeaddr_t*)prevhop);
-  }
+  /* ready for the next query */
+  knn_query.pkt.k = 0;
+}
 
-	if(multihop_hdr->type == GEOWARE_READING) {
-		reading_hdr = (reading_hdr_t*) multihop_hdr;
-    destination = reading_hdr->subscription_hdr.owner_pos;
-  }
-  else if (multihop_hdr->type == GEOWARE_SUBSCRIPTION) {
-    subscription_pkt = *((subscription_pkt_t*)multihop_hdr);
-    if(multihop_hdr->firewrk) {
-      destination = subscription_pkt.subscription.center;
-      proximity = subscription_pkt.subscription.radius;
+/*---------------------------------------------------------------------------*/
+/*
+ * Guess the radius around point that holds k nodes, from the positions of
+ * our neighbors and of their neighbors. Nodes at the same distance count
+ * once. If we know of fewer, assume the density stays the same further out.
+ */
+static float
+knn_radius(pos_t point, uint8_t k)
+{
+  struct neighbor *n;
+  float last = -1;
+  float next, dist;
+  uint8_t known;
+  uint8_t i;
+
+  for(known = 0; known < k; known++) {
+    next = FLT_MAX;
+
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      for(i = 0; i <= n->neighbors; i++) {
+        dist = distance(i == 0 ? neighbor_pos(n) : n->pos[i], point);
+        if(dist > last && dist < next) {
+          next = dist;
+        }
+      }
     }
-    else {
-      destination = multihop_hdr->pos;
-      printf("destination: ");
-      print_pos(destination);
+
+    if(next == FLT_MAX) {
+      break;
     }
+    last = next;
   }
-  else if (multihop_hdr->type == GEOWARE_UNSUBSCRIPTION) {
-    unsubscription_pkt = *((unsubscription_pkt_t*)multihop_hdr);
-    destination = unsubscription_pkt.center;
-    proximity = unsubscription_pkt.radius;
+
+  if(known == 0) {
+    return 0;
   }
 
-  /* update the position in the header */
-  multihop_hdr->pos = own_pos;
+  return known < k ? last * sqrt((float)k / known) : last;
+}
 
-	/* Find distance to destination */
-	min_dist = distance(own_pos, destination);
-	// printf("min_dist s: "PRINTFLOAT"\n", (long)min_dist, decimals(min_dist));
+/*---------------------------------------------------------------------------*/
+/* This function floods the next ring of the kNN query we are the home of. */
+static void
+knn_ring(void)
+{
+  knn_pkt_t *q = &knn_query.pkt;
 
-	/* check if we know a closer neighbor */
-	for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
-		/* prevent passing back and forth, turns out that prevhop == 1.0
-		   for the first hop, also hops is undefined.. */
-		if(rimeaddr_cmp(&n->addr, prevhop) && \
-        (packetbuf_attr(PACKETBUF_ATTR_HOPS) != 1)) {
-			continue;
-		}
+  q->ring++;
+  q->hdr.pos = own_pos;
+  q->hdr.firewrk = 1;
 
-    /* find the distance to the center of interest for current neighbor */
-  	float tmp_dist = distance(n->pos[0], destination);
-		
-		// printf("%d.%d: ", n->addr.u8[0], n->addr.u8[1]);
-		// print_pos(n->pos[0]);
-		// printf("tmp_dist: "PRINTFLOAT"\n", (long)tmp_dist, decimals(tmp_dist));
-  	
-    /* if the distance is less than some small value EPSILON it means we
-       found the destination/subscription owner, set it as packet destination */
-    if(tmp_dist < proximity) {
-      packetbuf_set_addr(PACKETBUF_ADDR_ERECEIVER, &n->addr);
-      closest = n;
-      break;
-    }
+  /* do not take part when the ring floods back past us */
+  if(!was_seen(q->home_hdr.sID)) {
+    add_seen_sub(q->home_hdr.sID, SNAPSHOT_LEASE);
+  }
+  subscription_update_is_new(q->home_hdr.sID, q->ring);
 
-  	if(tmp_dist < min_dist) {
-  		min_dist = tmp_dist;
-  		closest = n;
-  		// printf("min_dist t: "PRINTFLOAT"\n", (long)min_dist, decimals(min_dist));
-  	}
-	}
+  debug_printf("kNN ring %d: "PRINTFLOAT" to "PRINTFLOAT"\n", q->ring, \
+    (long)q->inner, decimals(q->inner), (long)q->outer, decimals(q->outer));
 
-	if(closest == NULL) {
-		/* we didn't find a closer neighbor, check neighbor's neighbors */
-	  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
-  		/* prevent passing back and forth: */
-  		if(rimeaddr_cmp(&n->addr, prevhop)) {
-  			continue;
-  		}
-    	for(i=1; i<=n->neighbors; i++){
-    		/* dont consider ourselves */
-    		if(pos_cmp(own_pos, n->pos[i])) {
-    			continue;
-    		}
+  process_post(&multihop_process, knn_event, (void*) q);
+}
 
-	    	float tmp_dist = distance(n->pos[i], destination);
-	    	
-	      // print_pos(n->pos[i]);
-				// printf("tmp_dist: "PRINTFLOAT"\n", (long)tmp_dist, decimals(tmp_dist));
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called by the kNN ctimer once the answers to a ring are
+ * in. Every node up to the outer radius has answered, so if we have k of
+ * them no nearer one is left and the results go to the querier. Otherwise
+ * the next ring grows the area by as much as it fell short.
+ */
+static void
+knn_timeout(void *ptr)
+{
+  knn_pkt_t *q = &knn_query.pkt;
+  float grow;
 
-	    	if(tmp_dist < min_dist) {
-	    		min_dist = tmp_dist;
-	    		closest = n;
-	    	}
-	    }
-  	}	
-	}
+  if(knn_query.found < q->k && q->ring < KNN_MAX_RINGS && q->outer > 0) {
+    grow = knn_query.found > 0 ? sqrt((float)q->k / knn_query.found) : 2;
+    q->inner = q->outer;
+    q->outer *= MIN(grow, 2);
 
-	if(closest != NULL) {
-	  printf("%d.%d: Forwarding packet to %d.%d (still "PRINTFLOAT" away), \
-	  	hops %d\n", rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
-	     closest->addr.u8[0], closest->addr.u8[1], (long)min_dist, \
-	     decimals(min_dist), packetbuf_attr(PACKETBUF_ATTR_HOPS));
-	  return &closest->addr;
-	}
+    knn_ring();
+    ctimer_set(&knn_query.timer, KNN_RING_WAIT, knn_timeout, NULL);
+    return;
+  }
 
-  // printf("%d.%d: did not find a neighbor to foward to\n",
-	 // rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1]);
-  // return NULL;
+  knn_query.sent = 0;
+  knn_result_send(NULL);
+}
 
-  /* didnt find anyone closer, nor anyone that knows someone closer
-     but we are in a dense network, so lets just try our luck
-     and forward to someone different than from whom we received */
-  do {
-    int num = random_rand() % list_length(neighbors_list);
-    i = 0;
-    for(n = list_head(neighbors_list); n != NULL && i != num; \
-      n = list_item_next(n)) i++;
+/*---------------------------------------------------------------------------*/
+/*
+ * Become the home of a kNN query, as the node nearest to its point. The
+ * first ring covers the k nearest nodes we know of, we answer ourselves.
+ */
+void
+knn_home(knn_pkt_t *pkt)
+{
+  static knn_reply_pkt_t own;
+
+  if(knn_query.pkt.k != 0) {
+    printf("kNN query %u dropped, still serving %u\n", pkt->query_hdr.sID, \
+      knn_query.pkt.query_hdr.sID);
+    return;
   }
-  while(rimeaddr_cmp(&n->addr, prevhop));
 
-  printf("%d.%d: Randomly forwarding packet to %d.%d, hops %d\n", \
-  	rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
-    n->addr.u8[0], n->addr.u8[1], packetbuf_attr(PACKETBUF_ATTR_HOPS));
-  return &n->addr;
+  if(pkt->k == 0) {
+    return;
+  }
+
+  knn_query.pkt = *pkt;
+  knn_query.pkt.k = MIN(pkt->k, KNN_MAX);
+  knn_query.pkt.home_hdr.sID = 1 + random_rand() % UINT16_MAX;
+  knn_query.pkt.home_hdr.owner_pos = own_pos;
+  rimeaddr_copy(&knn_query.pkt.home_hdr.owner, &rimeaddr_node_addr);
+  knn_query.pkt.ring = 0;
+  /* a node right at the point answers as well */
+  knn_query.pkt.inner = -1;
+  knn_query.pkt.outer = knn_radius(pkt->point, knn_query.pkt.k);
+  knn_query.found = 0;
+
+  if(sensor_sample(pkt->type, &own.value)) {
+    rimeaddr_copy(&own.node, &rimeaddr_node_addr);
+    own.pos = own_pos;
+    knn_add(&own);
+  }
+
+  knn_ring();
+  ctimer_set(&knn_query.timer, KNN_RING_WAIT, knn_timeout, NULL);
 }
+
 /*---------------------------------------------------------------------------*/
-/* Declare multihop structures */
-static const struct multihop_callbacks multihop_call = {recv, forward};
-static struct multihop_conn multihop;
+/*
+ * Store a reading as the home of its key, the node nearest to the point it
+ * hashes to, and hand a copy to our neighbors around that point.
+ */
+static void
+ght_home(ght_pkt_t *pkt)
+{
+  ght_store(pkt->type, pkt->key, &pkt->source, &pkt->value);
+
+  ght_replica_pkt = *pkt;
+  ght_replica_pkt.hdr.type = GEOWARE_GHT_REPLICA;
+  ght_replica_pkt.hdr.pos = own_pos;
+  process_post(&broadcast_process, broadcast_ght_event, \
+    (void*) &ght_replica_pkt);
+}
+
 /*---------------------------------------------------------------------------*/
-PROCESS_THREAD(multihop_process, ev, data)
+/*
+ * This function is called by the GHT ctimer to send the next reading stored
+ * under the key being queried, KNN_REPLY_GAP apart.
+ */
+static void
+ght_answer_send(void *ptr)
 {
-  PROCESS_EXITHANDLER(multihop_close(&multihop);)
+  struct answer *a = ptr;
+  knn_reply_pkt_t *reply = &a->pkt.knn;
 
-  PROCESS_BEGIN();
+  if(!ght_lookup(a->type, a->key, a->next++, &reply->node, &reply->value)) {
+    return;
+  }
 
-  static reading_hdr_t reading_hdr;
-  static rimeaddr_t to;
-  static struct etimer et;
-  pos_t owner_pos = {0.0, 0.0};
-  
-  etimer_stop(&et);
+  if(rimeaddr_cmp(&reply->reading_hdr.subscription_hdr.owner, \
+      &rimeaddr_node_addr)) {
+    knn_deliver(reply);
+  }
+  else {
+    process_post_synch(&multihop_process, publish_event, (void*) reply);
+  }
 
-  subscribe_event = process_alloc_event();
-  unsubscribe_event = process_alloc_event();
-  publish_event = process_alloc_event();
-  sid_discovery_reply_event = process_alloc_event();
+  ctimer_set(&a->timer, KNN_REPLY_GAP, ght_answer_send, a);
+}
 
-  /* Activate the button sensor. We use the button to drive traffic -
-     when the button is pressed, a packet is sent. */
-  SENSORS_ACTIVATE(button_sensor);
-  
-	/* Open a multihop connection on Rime channel MULTIHOP_CHANNEL. */
-  multihop_open(&multihop, MULTIHOP_CHANNEL, &multihop_call);
+/*---------------------------------------------------------------------------*/
+/* Answer a query for stored readings, as the node nearest to its point. */
+static void
+ght_answer(ght_query_pkt_t *pkt)
+{
+  struct answer *a;
 
-  /* Set the Rime address of the final receiver of the packet to
-     254.254 as we rely on the x,y coordinates to deliver the packet.
-     once the recipient (distance to node is less then EPSILON)
-     the address of the destination is updated. */
-  to.u8[0] = 254;
-  to.u8[1] = 254;
+  if((a = answer_slot(pkt->query_hdr.sID)) == NULL) {
+    return;
+  }
 
-  /* Loop forever, send a packet when the button is pressed. */
-  while(1) {
-    /* Wait until we get a sensor event with the button sensor as data. */
-    PROCESS_WAIT_EVENT();
-    if (ev == sensors_event && data == &button_sensor) {
-      /* this event is just for debug */
-      printf("Creating multihop packet\n");
+  a->pkt.knn.reading_hdr.hdr.ver = GEOWARE_VERSION;
+  a->pkt.knn.reading_hdr.hdr.type = GEOWARE_KNN_REPLY;
+  a->pkt.knn.reading_hdr.hdr.len = 0;
+  a->pkt.knn.reading_hdr.hdr.pos = own_pos;
+  a->pkt.knn.reading_hdr.subscription_hdr = pkt->query_hdr;
+  a->pkt.knn.pos = own_pos;
+  a->type = pkt->type;
+  a->key = pkt->key;
+  a->next = 0;
+
+  /* we are inside forward(), the first one goes out from the ctimer too */
+  ctimer_set(&a->timer, KNN_REPLY_GAP, ght_answer_send, a);
+}
 
-      /* prepare the multihop packet */
-    	reading_hdr.hdr.ver = GEOWARE_VERSION;
+/*---------------------------------------------------------------------------*/
+/* This function is called by the blob ctimer to send the next fragment of
+   our blob still to go. */
+static void
+blob_frag_send(void *ptr)
+{
+  subscription_t *s;
+  uint8_t frag;
+
+  for(frag = 0; frag < 32 && !(blob_todo & (1UL << frag)); frag++);
+
+  if(frag == 32 || (s = get_subscription(blob_sID)) == NULL) {
+    blob_todo = 0;
+    return;
+  }
+  blob_todo &= ~(1UL << frag);
+
+  if(!blob_fragment(frag, &blob_frag_out)) {
+    return;
+  }
+
+  blob_frag_out.reading_hdr.hdr.ver = GEOWARE_VERSION;
+  blob_frag_out.reading_hdr.hdr.type = GEOWARE_BLOB_FRAGMENT;
+  blob_frag_out.reading_hdr.hdr.len = 0;
+  blob_frag_out.reading_hdr.hdr.pos = own_pos;
+  blob_frag_out.reading_hdr.subscription_hdr = s->subscription_hdr;
+  blob_frag_out.source_pos = own_pos;
+
+  process_post(&multihop_process, publish_event, (void*) &blob_frag_out);
+
+  if(blob_todo != 0) {
+    ctimer_set(&blob_timer, BLOB_FRAG_GAP, blob_frag_send, NULL);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function is called by the blob NACK ctimer to ask the sources of
+   stalled blobs for their missing fragments, one at a time. */
+static void
+blob_nack_check(void *ptr)
+{
+  if(blob_stalled(&blob_nack_out)) {
+    blob_nack_out.hdr.ver = GEOWARE_VERSION;
+    blob_nack_out.hdr.type = GEOWARE_BLOB_NACK;
+    blob_nack_out.hdr.len = 0;
+    blob_nack_out.hdr.pos = own_pos;
+    blob_nack_out.hdr.firewrk = 0;
+
+    debug_printf("asking %d.%d for fragments 0x%lx\n", \
+      blob_nack_out.source_hdr.owner.u8[0], \
+      blob_nack_out.source_hdr.owner.u8[1], blob_nack_out.missing);
+
+    process_post(&multihop_process, publish_event, (void*) &blob_nack_out);
+  }
+
+  if(blob_incomplete()) {
+    ctimer_set(&blob_nack_timer, BLOB_NACK_WAIT, blob_nack_check, NULL);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function returns 1 if the position in the header of a multihop packet
+ * is where the node that sent it on is. Subscriptions sent to a single node,
+ * without the firework flag, carry that node's position there instead.
+ */
+static uint8_t
+pos_is_sender(geoware_hdr_t *hdr)
+{
+  return hdr->firewrk || (hdr->type != GEOWARE_SUBSCRIPTION && \
+    hdr->type != GEOWARE_SUBSCRIPTION_BATCH);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called at the final recepient of the message.
+ */
+static void
+recv(struct multihop_conn *c, const rimeaddr_t *sender,
+     const rimeaddr_t *prevhop,
+     uint8_t hops)
+{
+  geoware_hdr_t *multihop_hdr;
+  uint8_t i;
+
+  debug_printf("multihop message received. originator: %d.%d hops: %d\n", \
+  	sender->u8[0], sender->u8[1], hops);
+
+  multihop_hdr = packetbuf_dataptr();
+
+  if(multihop_hdr->ver != GEOWARE_VERSION) {
+    return;
+  }
+
+  /* update neighbor neighbor, because why not. only if the position field
+     is not the destination */
+  if(pos_is_sender(multihop_hdr)) {
+    add_neighbor(multihop_hdr->pos, (rimeaddr_t*)prevhop);
+  }
+
+  if(multihop_hdr->type == GEOWARE_SUBSCRIPTION) {
+    memcpy(&subscription_pkt, packetbuf_dataptr(), sizeof(subscription_pkt_t));
+
+    debug_printf("subscription packet received.\n");
+
+    /* readings go back the way the subscription came, unless it is a
+       SID discovery reply from a node other than the owner */
+    if(multihop_hdr->firewrk) {
+      route_add(subscription_pkt.subscription.subscription_hdr.sID, prevhop);
+    }
+
+    // print_subscription(&subscription_pkt->subscription);
+
+    process_subscription(&subscription_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_UNSUBSCRIPTION) {
+    memcpy(&unsubscription_pkt, packetbuf_dataptr(), \
+      sizeof(unsubscription_pkt_t));
+
+    debug_printf("unsubscription packet received.\n");
+
+    process_unsubscription(&unsubscription_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_OWNER_UPDATE) {
+    memcpy(&owner_update_pkt, packetbuf_dataptr(), \
+      sizeof(owner_update_pkt_t));
+
+    debug_printf("owner update packet received.\n");
+
+    process_owner_update(&owner_update_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_REFRESH) {
+    memcpy(&refresh_pkt, packetbuf_dataptr(), sizeof(refresh_pkt_t));
+
+    debug_printf("refresh packet received.\n");
+
+    route_add(refresh_pkt.sID, prevhop);
+    process_refresh(&refresh_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_SUBSCRIPTION_UPDATE) {
+    memcpy(&subscription_update_pkt, packetbuf_dataptr(), \
+      sizeof(subscription_update_pkt_t));
+
+    debug_printf("subscription update packet received.\n");
+
+    route_add(subscription_update_pkt.subscription.subscription_hdr.sID, \
+      prevhop);
+    process_subscription_update(&subscription_update_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_SNAPSHOT) {
+    memcpy(&snapshot_pkt, packetbuf_dataptr(), sizeof(snapshot_pkt_t));
+
+    debug_printf("snapshot packet received.\n");
+
+    route_add(snapshot_pkt.query_hdr.sID, prevhop);
+    process_snapshot(&snapshot_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_HISTORY) {
+    memcpy(&history_pkt, packetbuf_dataptr(), sizeof(history_pkt_t));
+
+    debug_printf("history packet received.\n");
+
+    route_add(history_pkt.query_hdr.sID, prevhop);
+    process_history(&history_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_GHT_STORE) {
+    memcpy(&ght_pkt, packetbuf_dataptr(), sizeof(ght_pkt_t));
+
+    debug_printf("stored reading received.\n");
+
+    ght_home(&ght_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_GHT_QUERY) {
+    memcpy(&ght_query_pkt, packetbuf_dataptr(), sizeof(ght_query_pkt_t));
+
+    debug_printf("stored readings query received.\n");
+
+    ght_answer(&ght_query_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_KNN) {
+    memcpy(&knn_pkt, packetbuf_dataptr(), sizeof(knn_pkt_t));
+
+    debug_printf("kNN packet received.\n");
+
+    if(knn_pkt.hdr.firewrk) {
+      route_add(knn_pkt.home_hdr.sID, prevhop);
+    }
+    process_knn(&knn_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_KNN_REPLY) {
+    memcpy(&knn_reply_in, packetbuf_dataptr(), sizeof(knn_reply_pkt_t));
+
+    debug_printf("kNN reply packet received.\n");
+
+    /* an answer to the query we are the home of, or a result */
+    if(knn_query.pkt.k != 0 && knn_query.pkt.home_hdr.sID == \
+        knn_reply_in.reading_hdr.subscription_hdr.sID) {
+      knn_add(&knn_reply_in);
+    }
+    else {
+      knn_deliver(&knn_reply_in);
+    }
+  }
+  else if(multihop_hdr->type == GEOWARE_SUBSCRIPTION_BATCH) {
+    memcpy(&subscription_batch_pkt, packetbuf_dataptr(), \
+      MIN(packetbuf_datalen(), sizeof(subscription_batch_pkt_t)));
+
+    debug_printf("subscription batch packet received.\n");
+
+    for(i = 0; multihop_hdr->firewrk && \
+        i < subscription_batch_pkt.hdr.len && \
+        i < SUBSCRIPTION_BATCH_MAX; i++) {
+      route_add(subscription_batch_pkt.subs[i].subscription_hdr.sID, prevhop);
+    }
+    process_subscription_batch(&subscription_batch_pkt);
+  }
+  else if(multihop_hdr->type == GEOWARE_SHARED_READING) {
+    struct subscription *s;
+
+    debug_printf("shared reading packet received.\n");
+    memcpy(&shared_reading_pkt_in, packetbuf_dataptr(), \
+      MIN(packetbuf_datalen(), sizeof(shared_reading_pkt_t)));
+
+    /* deliver to our subscriptions among the destinations */
+    for(i = 0; i < shared_reading_pkt_in.hdr.len && \
+        i < SHARED_READING_MAX; i++) {
+      if(!rimeaddr_cmp(&shared_reading_pkt_in.dests[i].owner, \
+          &rimeaddr_node_addr) || (s = get_subscription_struct( \
+          shared_reading_pkt_in.dests[i].sID)) == NULL) {
+        continue;
+      }
+
+      reading_add(shared_reading_pkt_in.dests[i].sID, 0, \
+        &shared_reading_pkt_in.source, &shared_reading_pkt_in.value, \
+        READING_TIME(shared_reading_pkt_in));
+
+      process_post(s->proc, geoware_reading_event, \
+        (void*) &shared_reading_pkt_in.dests[i].sID);
+    }
+  }
+  else if(multihop_hdr->type == GEOWARE_BLOB_FRAGMENT) {
+    struct subscription *s;
+    reading_val size;
+
+    memcpy(&blob_frag_in, packetbuf_dataptr(), \
+      MIN(packetbuf_datalen(), sizeof(blob_frag_pkt_t)));
+
+    if(packetbuf_datalen() < BLOB_FRAG_LEN(0) || \
+        (s = get_subscription_struct(blob_frag_in.reading_hdr. \
+        subscription_hdr.sID)) == NULL) {
+      return;
+    }
+
+    if(blob_reassemble((rimeaddr_t*)sender, &blob_frag_in, \
+        packetbuf_datalen() - BLOB_FRAG_LEN(0))) {
+      debug_printf("blob of %u bytes complete\n", blob_frag_in.size);
+
+      /* the reading tells the application the size, it takes the blob
+         with blob_get() */
+      size.ui32 = 0;
+      size.ui16 = blob_frag_in.size;
+      reading_add(blob_frag_in.reading_hdr.subscription_hdr.sID, 0, \
+        (rimeaddr_t*)sender, &size, READING_TIME(blob_frag_in));
+
+      process_post(s->proc, geoware_reading_event, \
+        (void*) &blob_frag_in.reading_hdr.subscription_hdr.sID);
+    }
+    else if(blob_incomplete() && ctimer_expired(&blob_nack_timer)) {
+      ctimer_set(&blob_nack_timer, BLOB_NACK_WAIT, blob_nack_check, NULL);
+    }
+  }
+  else if(multihop_hdr->type == GEOWARE_BLOB_NACK) {
+    uint8_t frags;
+
+    memcpy(&blob_nack_in, packetbuf_dataptr(), sizeof(blob_nack_pkt_t));
+
+    /* only the last blob is kept, the owner gives up on older ones */
+    frags = blob_outgoing(blob_nack_in.source_hdr.sID, blob_nack_in.blob);
+    if(frags == 0) {
+      return;
+    }
+
+    debug_printf("resending fragments 0x%lx\n", blob_nack_in.missing);
+
+    blob_todo |= blob_nack_in.missing & \
+      (frags >= 32 ? 0xffffffffUL : (1UL << frags) - 1);
+    if(ctimer_expired(&blob_timer)) {
+      ctimer_set(&blob_timer, BLOB_FRAG_GAP, blob_frag_send, NULL);
+    }
+  }
+  else if(multihop_hdr->type == GEOWARE_VECTOR_READING) {
+    struct subscription *s;
+    sensor_t type;
+    reading_val value;
+
+    debug_printf("vector reading packet received.\n");
+    memcpy(&vector_reading_pkt_in, packetbuf_dataptr(), \
+      MIN(packetbuf_datalen(), sizeof(vector_reading_pkt_t)));
+
+    if((s = get_subscription_struct(vector_reading_pkt_in.reading_hdr. \
+        subscription_hdr.sID)) == NULL) {
+      return;
+    }
+
+    /* one reading for every sensor, all sampled at the same time */
+    for(i = 0; vector_get(&vector_reading_pkt_in, i, &type, &value); i++) {
+      reading_add(vector_reading_pkt_in.reading_hdr.subscription_hdr.sID, \
+        type, (rimeaddr_t*)sender, &value, \
+        READING_TIME(vector_reading_pkt_in));
+    }
+
+    process_post(s->proc, geoware_reading_event, \
+      (void*) &vector_reading_pkt_in.reading_hdr.subscription_hdr.sID);
+  }
+  else if(multihop_hdr->type == GEOWARE_READING) {
+    debug_printf("reading packet received.\n");
+    memcpy(&reading_pkt_in, packetbuf_dataptr(), sizeof(reading_pkt_t));
+    
+    struct subscription *sub = get_subscription_struct( \
+      reading_pkt_in.reading_hdr.subscription_hdr.sID);
+
+    /* answers to our snapshots, and readings for a sink other than the
+       owner, are for subscriptions we do not hold */
+    struct process *proc = sub != NULL ? sub->proc : \
+      snapshot_owner(reading_pkt_in.reading_hdr.subscription_hdr.sID);
+
+    if(proc == NULL) {
+      return;
+    }
+
+    /* add the reading to local, gateway buffer */
+    reading_add(reading_pkt_in.reading_hdr.subscription_hdr.sID, 0, \
+      (rimeaddr_t*)sender, &reading_pkt_in.value, READING_TIME(reading_pkt_in));
+
+    /* notify the application process we have new reading */
+    process_post(proc, geoware_reading_event, \
+      (void*) &reading_pkt_in.reading_hdr.subscription_hdr.sID);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function keeps a copy of the packet in the packet buffer before it is
+ * handed to the unicast layer, so that it can be re-routed if the next hop
+ * turns out to be dead.
+ */
+static void
+inflight_save(const rimeaddr_t *originator, const rimeaddr_t *prevhop,
+              uint8_t hops, const rimeaddr_t *nexthop)
+{
+  struct inflight *e;
+
+  /* if the MAC layer has more packets than we keep copies of, the oldest
+     cannot be re-routed anymore. copies waiting to be re-routed are off
+     the list, if they hold every entry this packet goes without one */
+  e = memb_alloc(&inflight_memb);
+  if(e == NULL) {
+    e = list_pop(inflight_list);
+  }
+  if(e == NULL) {
+    return;
+  }
+
+  e->len = packetbuf_datalen();
+  memcpy(e->data, packetbuf_dataptr(), e->len);
+
+  rimeaddr_copy(&e->originator, originator);
+  rimeaddr_copy(&e->dest, packetbuf_addr(PACKETBUF_ADDR_ERECEIVER));
+  rimeaddr_copy(&e->prevhop, prevhop);
+  rimeaddr_copy(&e->nexthop, nexthop);
+  e->hops = hops;
+
+  /* a fresh packet, or one we are re-routing */
+  e->reroutes = rerouting ? reroutes : 0;
+
+  list_add(inflight_list, e);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function takes the copy of the oldest packet sent to nexthop off the
+ * list, the one the MAC layer just reported on. Returns NULL if we have no
+ * copy of it.
+ */
+static struct inflight *
+inflight_take(const rimeaddr_t *nexthop)
+{
+  struct inflight *e;
+
+  for(e = list_head(inflight_list); e != NULL; e = list_item_next(e)) {
+    if(rimeaddr_cmp(&e->nexthop, nexthop)) {
+      list_remove(inflight_list, e);
+      return e;
+    }
+  }
+
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+#if GEOWARE_LOW_POWER
+/*
+ * This function returns how long (in clock ticks) until the neighbor's radio
+ * wakes up next. If we have not learned its phase yet, we expect to wait
+ * half a wake-up interval.
+ */
+static clock_time_t
+next_wakeup(struct neighbor *n, clock_time_t now)
+{
+  if(n->phase == PHASE_UNKNOWN) {
+    return WAKEUP_INTERVAL/2;
+  }
+
+  return (n->phase + WAKEUP_INTERVAL - now % WAKEUP_INTERVAL) % \
+    WAKEUP_INTERVAL;
+}
+#endif /* GEOWARE_LOW_POWER */
+/*---------------------------------------------------------------------------*/
+/*
+ * This function returns the cost of using a neighbor as the next hop. It
+ * weighs the progress it gives up compared to the best neighbor against its
+ * residual energy, its load and, on a duty cycled MAC, how long until it
+ * wakes up. The best neighbor with a full battery and no load costs 0.
+ */
+static float
+next_hop_cost(struct neighbor *n, float dist, float best)
+{
+  float cost;
+
+  cost = (dist - best) / PROGRESS_SLACK;
+  cost += ENERGY_WEIGHT * (100 - n->energy) / 100.0;
+  cost += LOAD_WEIGHT * n->load / LOAD_SCALE;
+#if GEOWARE_LOW_POWER
+  cost += WAKEUP_WEIGHT * next_wakeup(n, clock_time()) / WAKEUP_INTERVAL;
+#endif
+
+  return cost;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function picks the next hop among the neighbors that get within
+ * PROGRESS_SLACK of the best distance to the destination, and closer than
+ * we are. best is the distance of the closest neighbor, which is always a
+ * candidate. Without this the same few relays carry all traffic towards a
+ * destination and run out of battery first.
+ */
+static struct neighbor *
+choose_next_hop(pos_t destination, float best, float own_dist,
+                const rimeaddr_t *prevhop)
+{
+  struct neighbor *n;
+  struct neighbor *choice = NULL;
+  float dist;
+  float cost;
+  float min_cost = FLT_MAX;
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    /* same rule as in forward() */
+    if(rimeaddr_cmp(&n->addr, prevhop) && \
+        (packetbuf_attr(PACKETBUF_ATTR_HOPS) != 1)) {
+      continue;
+    }
+
+    dist = distance(neighbor_pos(n), destination);
+    if(dist >= own_dist || dist > best + PROGRESS_SLACK) {
+      continue;
+    }
+
+    cost = next_hop_cost(n, dist, best);
+    if(cost < min_cost) {
+      min_cost = cost;
+      choice = n;
+    }
+  }
+
+  return choice;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function finds the next hop of a reading for the subscription in
+ * hdr. If the owner is our neighbor we know better where it is now and
+ * correct the destination in flight. Otherwise, if use_route is set, the
+ * reading follows the path the subscription came in on while that neighbor
+ * is still around and is not prevhop. Returns NULL if greedy forwarding has
+ * to decide.
+ */
+static struct neighbor *
+reading_route(subscription_hdr_t *hdr, const rimeaddr_t *prevhop,
+              uint8_t use_route)
+{
+  struct neighbor *n;
+  rimeaddr_t *route;
+
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    if(rimeaddr_cmp(&n->addr, &hdr->owner)) {
+      hdr->owner_pos = neighbor_pos(n);
+      return NULL;
+    }
+  }
+
+  route = use_route ? route_lookup(hdr->sID) : NULL;
+
+  for(n = list_head(neighbors_list); route != NULL && n != NULL; \
+      n = list_item_next(n)) {
+    if(rimeaddr_cmp(&n->addr, route) && !rimeaddr_cmp(route, prevhop)) {
+      return n;
+    }
+  }
+
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function is called by the split ctimer to send the destinations
+   split off a shared reading. */
+static void
+split_send(void *ptr)
+{
+  process_post(&multihop_process, publish_event, (void*) &split_pkt);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * The shared reading in the packet buffer goes to next. Keep the
+ * destinations that are on their way through next and move the others to a
+ * packet of their own: the ones whose owner is another neighbor, whose
+ * reverse path goes through another neighbor or for which next makes no
+ * progress. If next is where the packet is delivered, only the subscriptions
+ * owned by next stay.
+ */
+static void
+shared_split(struct neighbor *next, const rimeaddr_t *prevhop)
+{
+  shared_reading_pkt_t *pkt = packetbuf_dataptr();
+  subscription_hdr_t *dest;
+  struct neighbor *n;
+  uint8_t delivered;
+  uint8_t keep;
+  uint8_t kept = 1;
+  uint8_t i;
+
+  delivered = rimeaddr_cmp(packetbuf_addr(PACKETBUF_ADDR_ERECEIVER), \
+    &next->addr);
+
+  for(i = 1; i < pkt->hdr.len && i < SHARED_READING_MAX; i++) {
+    dest = &pkt->dests[i];
+
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      if(rimeaddr_cmp(&n->addr, &dest->owner)) {
+        break;
+      }
+    }
+
+    if(delivered || n != NULL) {
+      keep = rimeaddr_cmp(&dest->owner, &next->addr);
+    }
+    else if((n = reading_route(dest, prevhop, 1)) != NULL) {
+      keep = n == next;
+    }
+    else {
+      keep = distance(neighbor_pos(next), dest->owner_pos) < \
+        distance(own_pos, dest->owner_pos);
+    }
+
+    if(keep) {
+      pkt->dests[kept++] = *dest;
+    }
+    else if(split_pkt.hdr.len < SHARED_READING_MAX) {
+      /* the packet we split off before is still waiting, it goes in there
+         if it is the same reading */
+      if(split_pkt.hdr.len == 0) {
+        split_pkt.hdr = pkt->hdr;
+        split_pkt.hdr.len = 0;
+        split_pkt.value = pkt->value;
+#if GEOWARE_TIMESTAMPS
+        split_pkt.stamp = pkt->stamp;
+#endif
+        rimeaddr_copy(&split_pkt.source, &pkt->source);
+        ctimer_set(&split_timer, SHARED_SPLIT_DELAY, split_send, NULL);
+      }
+      else if(memcmp(&split_pkt.value, &pkt->value, sizeof(reading_val)) || \
+          !rimeaddr_cmp(&split_pkt.source, &pkt->source)) {
+        printf("split buffer busy, dropping reading for %u\n", dest->sID);
+        continue;
+      }
+
+      split_pkt.dests[split_pkt.hdr.len++] = *dest;
+    }
+    else {
+      printf("split buffer full, dropping reading for %u\n", dest->sID);
+    }
+  }
+
+  if(kept < pkt->hdr.len) {
+    debug_printf("shared reading split, %d of %d go on\n", kept, \
+      pkt->hdr.len);
+    pkt->hdr.len = kept;
+    packetbuf_set_datalen(SHARED_READING_LEN(kept));
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* This function is called by the outbox ctimer to try the held readings
+   again. */
+static void
+outbox_drain(void *ptr)
+{
+  process_post(&multihop_process, outbox_event, NULL);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function holds a reading we found no way to pass on, it is sent on
+ * once a route reappears.
+ */
+static void
+outbox_hold(const void *pkt, uint8_t len, const rimeaddr_t *originator)
+{
+  if(draining || !outbox_add(pkt, len, originator)) {
+    return;
+  }
+
+  if(ctimer_expired(&outbox_timer)) {
+    ctimer_set(&outbox_timer, OUTBOX_RETRY, outbox_drain, NULL);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called to forward a packet. The function picks the
+ * neighbor closest to the destination from the neighbor list and returns
+ * its address. If no neighbor is closer than ourselfes, choose from neighbor's
+ * neighbors. The multihop layer sends the packet to this address. If no
+ * neighbor is found, the function returns NULL to signal to the multihop layer
+ * that the packet should be dropped.
+ */
+static rimeaddr_t *
+forward(struct multihop_conn *c,
+	const rimeaddr_t *originator, const rimeaddr_t *dest,
+	const rimeaddr_t *prevhop, uint8_t hops)
+{
+  /* Find neighbor closer to the destination to forward to. */
+  struct neighbor *n;
+  struct neighbor *closest = NULL;
+	geoware_hdr_t *multihop_hdr;
+	subscription_hdr_t *dest_hdr;
+  reading_pkt_t *reading = NULL;
+  pos_t destination;
+  /* the region a flooded packet is for, delivered to a neighbor inside */
+  const region_t *region = NULL;
+  region_t reach;
+	uint8_t i;
+  uint8_t found = 0;
+
+	float min_dist = FLT_MAX;
+  float own_dist;
+
+  /* The packetbuf_dataptr() returns a pointer to the first data byte
+     in the received packet. */
+  multihop_hdr = packetbuf_dataptr();
+
+  /* packets we originate come without a previous hop */
+  if(prevhop == NULL) {
+    prevhop = &rimeaddr_node_addr;
+  }
+
+  // debug_printf("%d.%d: dest - %d.%d\n", \
+  //   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
+  //   dest->u8[0], dest->u8[1]);
+
+  if(multihop_hdr->ver != GEOWARE_VERSION || \
+      rimeaddr_cmp(&rimeaddr_node_addr, dest)) {
+  	return NULL;
+  }
+
+  /* nobody around, hold on to readings until someone shows up */
+  if(list_length(neighbors_list) == 0) {
+    outbox_hold(multihop_hdr, packetbuf_datalen(), originator);
+    return NULL;
+  }
+
+  /* update neighbor if we havent originated the packet,
+     because why not. not when re-routing or failing over, the position in
+     the header is already our own, nor if it is the destination */
+  if(!rerouting && !failing_over && \
+      !rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+    if(pos_is_sender(multihop_hdr)) {
+      add_neighbor(multihop_hdr->pos, (rimeaddr_t*)prevhop);
+    }
+
+    if(relayed < UINT8_MAX) {
+      relayed++;
+    }
+  }
+
+	if(multihop_hdr->type == GEOWARE_READING || \
+      multihop_hdr->type == GEOWARE_SHARED_READING || \
+      multihop_hdr->type == GEOWARE_KNN_REPLY || \
+      multihop_hdr->type == GEOWARE_VECTOR_READING || \
+      multihop_hdr->type == GEOWARE_BLOB_FRAGMENT) {
+    /* a shared reading follows its first destination, the others split off
+       where their way parts */
+    if(multihop_hdr->type == GEOWARE_READING) {
+      dest_hdr = &((reading_hdr_t*) multihop_hdr)->subscription_hdr;
+
+      /* the button test packet is only a header */
+      if(packetbuf_datalen() >= sizeof(reading_pkt_t)) {
+        reading = (reading_pkt_t*) multihop_hdr;
+      }
+    }
+    else if(multihop_hdr->type == GEOWARE_SHARED_READING) {
+      dest_hdr = &((shared_reading_pkt_t*) multihop_hdr)->dests[0];
+    }
+    else {
+      dest_hdr = &((reading_hdr_t*) multihop_hdr)->subscription_hdr;
+    }
+
+    /* the reverse path leads to the owner only, a reading that may go to
+       another sink is forwarded greedily */
+    closest = reading_route(dest_hdr, prevhop, \
+      reading == NULL || reading->sinks_num == 0);
+    found = closest != NULL;
+    destination = dest_hdr->owner_pos;
+  }
+  else if(multihop_hdr->type == GEOWARE_BLOB_NACK) {
+    /* there is no reverse path to the source, it is found greedily */
+    dest_hdr = &((blob_nack_pkt_t*) multihop_hdr)->source_hdr;
+    reading_route(dest_hdr, prevhop, 0);
+    destination = dest_hdr->owner_pos;
+  }
+  else if (multihop_hdr->type == GEOWARE_SUBSCRIPTION) {
+    subscription_pkt = *((subscription_pkt_t*)multihop_hdr);
+
+    /* remember where the subscription came from for the readings. a SID
+       discovery reply, sent without the firework flag, comes from a node
+       that need not be the owner */
+    if(multihop_hdr->firewrk && \
+        !rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+      route_add(subscription_pkt.subscription.subscription_hdr.sID, prevhop);
+    }
+    if(multihop_hdr->firewrk) {
+      region = &subscription_pkt.subscription.region;
+    }
+    else {
+      destination = multihop_hdr->pos;
+      printf("destination: ");
+      print_pos(destination);
+    }
+  }
+  else if (multihop_hdr->type == GEOWARE_UNSUBSCRIPTION) {
+    unsubscription_pkt = *((unsubscription_pkt_t*)multihop_hdr);
+    region = &unsubscription_pkt.region;
+  }
+  else if (multihop_hdr->type == GEOWARE_OWNER_UPDATE) {
+    owner_update_pkt = *((owner_update_pkt_t*)multihop_hdr);
+    region = &owner_update_pkt.region;
+  }
+  else if (multihop_hdr->type == GEOWARE_REFRESH) {
+    refresh_pkt = *((refresh_pkt_t*)multihop_hdr);
+    region = &refresh_pkt.region;
+
+    /* every relay is on the way back to the owner */
+    if(!rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+      route_add(refresh_pkt.sID, prevhop);
+    }
+  }
+  else if (multihop_hdr->type == GEOWARE_SUBSCRIPTION_UPDATE) {
+    subscription_update_pkt = *((subscription_update_pkt_t*)multihop_hdr);
+    /* nodes leaving a shrunk region have to hear it as well */
+    region_circle(&reach, subscription_update_pkt.reach_center, \
+      subscription_update_pkt.reach_radius);
+    region = &reach;
+
+    if(!rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+      route_add(subscription_update_pkt.subscription.subscription_hdr.sID, \
+        prevhop);
+    }
+  }
+  else if (multihop_hdr->type == GEOWARE_SNAPSHOT) {
+    snapshot_pkt = *((snapshot_pkt_t*)multihop_hdr);
+    region = &snapshot_pkt.region;
+
+    if(!rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+      route_add(snapshot_pkt.query_hdr.sID, prevhop);
+    }
+  }
+  else if (multihop_hdr->type == GEOWARE_HISTORY) {
+    history_pkt = *((history_pkt_t*)multihop_hdr);
+    region = &history_pkt.region;
+
+    if(!rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+      route_add(history_pkt.query_hdr.sID, prevhop);
+    }
+  }
+  else if (multihop_hdr->type == GEOWARE_GHT_STORE) {
+    ght_pkt = *((ght_pkt_t*)multihop_hdr);
+    destination = ght_pkt.point;
+  }
+  else if (multihop_hdr->type == GEOWARE_GHT_QUERY) {
+    ght_query_pkt = *((ght_query_pkt_t*)multihop_hdr);
+    destination = ght_query_pkt.point;
+  }
+  else if (multihop_hdr->type == GEOWARE_KNN) {
+    knn_pkt = *((knn_pkt_t*)multihop_hdr);
+
+    /* a ring floods around the point, the query is on its way there */
+    if(multihop_hdr->firewrk) {
+      region_circle(&reach, knn_pkt.point, knn_pkt.outer);
+      region = &reach;
+
+      if(!rimeaddr_cmp(&rimeaddr_node_addr, originator)) {
+        route_add(knn_pkt.home_hdr.sID, prevhop);
+      }
+    }
+    else {
+      destination = knn_pkt.point;
+    }
+  }
+  else if (multihop_hdr->type == GEOWARE_SUBSCRIPTION_BATCH) {
+    memcpy(&subscription_batch_pkt, multihop_hdr, \
+      MIN(packetbuf_datalen(), sizeof(subscription_batch_pkt_t)));
+
+    for(i = 0; multihop_hdr->firewrk && \
+        !rimeaddr_cmp(&rimeaddr_node_addr, originator) && \
+        i < subscription_batch_pkt.hdr.len && i < SUBSCRIPTION_BATCH_MAX; \
+        i++) {
+      route_add(subscription_batch_pkt.subs[i].subscription_hdr.sID, prevhop);
+    }
+    if(multihop_hdr->firewrk) {
+      region = &subscription_batch_pkt.subs[0].region;
+    }
+    else {
+      destination = multihop_hdr->pos;
+    }
+  }
+
+  /* head for the nearest part of the region, one we can work with */
+  if(region != NULL && !region_valid(region)) {
+    return NULL;
+  }
+  if(region != NULL) {
+    destination = region_target(region, own_pos);
+  }
+
+  /* update the position in the header, unless the next hop still needs
+     the destination there */
+  if(pos_is_sender(multihop_hdr)) {
+    multihop_hdr->pos = own_pos;
+  }
+
+	/* Find distance to destination */
+	own_dist = distance(own_pos, destination);
+	min_dist = own_dist;
+	// printf("min_dist s: "PRINTFLOAT"\n", (long)min_dist, decimals(min_dist));
+
+	/* check if we know a closer neighbor */
+	for(n = list_head(neighbors_list); n != NULL && !found; \
+      n = list_item_next(n)) {
+		/* prevent passing back and forth, turns out that prevhop == 1.0
+		   for the first hop, also hops is undefined.. */
+		if(rimeaddr_cmp(&n->addr, prevhop) && \
+        (packetbuf_attr(PACKETBUF_ATTR_HOPS) != 1)) {
+			continue;
+		}
+
+    /* find the distance to the center of interest for current neighbor */
+  	float tmp_dist = distance(neighbor_pos(n), destination);
+		
+		// printf("%d.%d: ", n->addr.u8[0], n->addr.u8[1]);
+		// print_pos(n->pos[0]);
+		// printf("tmp_dist: "PRINTFLOAT"\n", (long)tmp_dist, decimals(tmp_dist));
+  	
+    /* if the distance is less than some small value EPSILON it means we
+       found the destination/subscription owner, set it as packet destination.
+       a flooded packet is delivered to the first neighbor in its region */
+    if(region != NULL ? region_contains(region, neighbor_pos(n)) : \
+        tmp_dist < EPSILON) {
+      packetbuf_set_addr(PACKETBUF_ADDR_ERECEIVER, &n->addr);
+      closest = n;
+      found = 1;
+      break;
+    }
+
+  	if(tmp_dist < min_dist) {
+  		min_dist = tmp_dist;
+  		closest = n;
+  		// printf("min_dist t: "PRINTFLOAT"\n", (long)min_dist, decimals(min_dist));
+  	}
+	}
+
+  /* among the neighbors making about as much progress as the closest one,
+     take the cheapest */
+  if(closest != NULL && !found) {
+    closest = choose_next_hop(destination, min_dist, own_dist, prevhop);
+  }
+
+	if(closest == NULL) {
+		/* we didn't find a closer neighbor, check neighbor's neighbors */
+	  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+  		/* prevent passing back and forth: */
+  		if(rimeaddr_cmp(&n->addr, prevhop)) {
+  			continue;
+  		}
+    	for(i=1; i<=n->neighbors; i++){
+    		/* dont consider ourselves */
+    		if(pos_cmp(own_pos, n->pos[i])) {
+    			continue;
+    		}
+
+	    	float tmp_dist = distance(n->pos[i], destination);
+	    	
+	      // print_pos(n->pos[i]);
+				// printf("tmp_dist: "PRINTFLOAT"\n", (long)tmp_dist, decimals(tmp_dist));
+
+	    	if(tmp_dist < min_dist) {
+	    		min_dist = tmp_dist;
+	    		closest = n;
+	    	}
+	    }
+  	}	
+	}
+
+  /* no one we know of is nearer to the point of a kNN query or of a stored
+     reading's key, we are its home */
+  if(closest == NULL && !multihop_hdr->firewrk) {
+    if(multihop_hdr->type == GEOWARE_KNN) {
+      knn_home(&knn_pkt);
+      return NULL;
+    }
+    if(multihop_hdr->type == GEOWARE_GHT_STORE) {
+      ght_home(&ght_pkt);
+      return NULL;
+    }
+    if(multihop_hdr->type == GEOWARE_GHT_QUERY) {
+      ght_answer(&ght_query_pkt);
+      return NULL;
+    }
+  }
+
+	if(closest != NULL) {
+	  min_dist = distance(neighbor_pos(closest), destination);
+	  printf("%d.%d: Forwarding packet to %d.%d (still "PRINTFLOAT" away), \
+	  	hops %d\n", rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
+	     closest->addr.u8[0], closest->addr.u8[1], (long)min_dist, \
+	     decimals(min_dist), packetbuf_attr(PACKETBUF_ATTR_HOPS));
+	  if(multihop_hdr->type == GEOWARE_SHARED_READING) {
+	    shared_split(closest, prevhop);
+	  }
+	  set_txpower(closest->txpower);
+	  inflight_save(originator, prevhop, hops, &closest->addr);
+	  return &closest->addr;
+	}
+
+  /* the sink cannot be reached from here, try the next nearest one */
+  if(reading != NULL && reading->sink_next < reading->sinks_num) {
+    rimeaddr_t *nexthop;
+
+    dest_hdr->owner = reading->sinks[reading->sink_next].addr;
+    dest_hdr->owner_pos = reading->sinks[reading->sink_next].pos;
+    reading->sink_next++;
+
+    printf("sink unreachable, failing over to %d.%d\n", \
+      dest_hdr->owner.u8[0], dest_hdr->owner.u8[1]);
+
+    failing_over = 1;
+    nexthop = forward(c, originator, dest, prevhop, hops);
+    failing_over = 0;
+
+    return nexthop;
+  }
+
+  // printf("%d.%d: did not find a neighbor to foward to\n",
+	 // rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1]);
+  // return NULL;
+
+  /* didnt find anyone closer, nor anyone that knows someone closer
+     but we are in a dense network, so lets just try our luck
+     and forward to someone different than from whom we received */
+  if(list_length(neighbors_list) == 1 && \
+      rimeaddr_cmp(&((struct neighbor*)list_head(neighbors_list))->addr, \
+      prevhop)) {
+    /* the only neighbor left is the one we got the packet from */
+    outbox_hold(multihop_hdr, packetbuf_datalen(), originator);
+    return NULL;
+  }
+
+  do {
+    int num = random_rand() % list_length(neighbors_list);
+    i = 0;
+    for(n = list_head(neighbors_list); n != NULL && i != num; \
+      n = list_item_next(n)) i++;
+  }
+  while(rimeaddr_cmp(&n->addr, prevhop));
+
+  printf("%d.%d: Randomly forwarding packet to %d.%d, hops %d\n", \
+  	rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
+    n->addr.u8[0], n->addr.u8[1], packetbuf_attr(PACKETBUF_ATTR_HOPS));
+  if(multihop_hdr->type == GEOWARE_SHARED_READING) {
+    shared_split(n, prevhop);
+  }
+  set_txpower(n->txpower);
+  inflight_save(originator, prevhop, hops, &n->addr);
+  return &n->addr;
+}
+/*---------------------------------------------------------------------------*/
+/* Declare multihop structures */
+static const struct multihop_callbacks multihop_call = {recv, forward};
+static struct multihop_conn multihop;
+
+/* The multihop layer does not pass the link layer transmission status up, so
+   we sit between it and its unicast connection. The original unicast
+   callbacks of the multihop connection are kept here. */
+static const struct unicast_callbacks *multihop_unicast_call;
+/*---------------------------------------------------------------------------*/
+static void
+unicast_recv(struct unicast_conn *c, const rimeaddr_t *from)
+{
+  multihop_unicast_call->recv(c, from);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called by the unicast layer once the MAC layer is done
+ * with a packet. If the next hop did not acknowledge it after all the MAC
+ * retransmissions it is evicted and the packet is re-routed to the next best
+ * neighbor.
+ */
+static void
+unicast_sent(struct unicast_conn *c, int status, int num_tx)
+{
+  struct neighbor *n;
+  struct inflight *e;
+
+  if(multihop_unicast_call->sent != NULL) {
+    multihop_unicast_call->sent(c, status, num_tx);
+  }
+
+  /* the packet buffer still holds the packet the report is for */
+  e = inflight_take(packetbuf_addr(PACKETBUF_ADDR_RECEIVER));
+  if(e == NULL) {
+    return;
+  }
+
+  if(status == MAC_TX_OK) {
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      if(rimeaddr_cmp(&n->addr, &e->nexthop)) {
+        break;
+      }
+    }
+    memb_free(&inflight_memb, e);
+
+    if(n == NULL) {
+      return;
+    }
+
+#if GEOWARE_LOW_POWER
+    /* the ack came right after the neighbor woke up, remember when that
+       was within the wake-up interval */
+    n->phase = clock_time() % WAKEUP_INTERVAL;
+#endif
+
+    if(n->txpower > 0) {
+      /* retransmissions mean the link is weaker than estimated, widen the
+         margin. slowly shrink it back while it goes through first time */
+      if(num_tx > 1 && n->txmargin < TXPOWER_MARGIN_MAX) {
+        n->txmargin += TXPOWER_MARGIN_STEP;
+      }
+      else if(num_tx == 1 && n->txmargin > TXPOWER_MARGIN) {
+        n->txmargin--;
+      }
+      update_txpower(n);
+    }
+    return;
+  }
+
+  if(status != MAC_TX_NOACK) {
+    memb_free(&inflight_memb, e);
+    return;
+  }
+
+  printf("%d.%d: no ack from %d.%d after %d transmissions\n", \
+    rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], \
+    e->nexthop.u8[0], e->nexthop.u8[1], num_tx);
+
+  evict_neighbor(&e->nexthop);
+
+  if(e->reroutes < MAX_REROUTES && \
+      process_post(&multihop_process, reroute_event, e) == PROCESS_ERR_OK) {
+    /* the copy is freed once it is re-routed */
+    e->reroutes++;
+    return;
+  }
+
+  outbox_hold(e->data, e->len, &e->originator);
+  memb_free(&inflight_memb, e);
+}
+/*---------------------------------------------------------------------------*/
+static const struct unicast_callbacks unicast_call = {unicast_recv, unicast_sent};
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/* This function is called by the batch ctimer to send the subscriptions
+   waiting to go out. */
+static void
+send_pending_subs(void *ptr)
+{
+  process_post(&multihop_process, subscribe_event, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Take the next batch of pending subscriptions: the first one waiting and
+ * the others whose region lies within its region, so flooding the first
+ * region reaches them all. Returns the number of subscriptions in batch.
+ */
+static uint8_t
+next_sub_batch(subscription_batch_pkt_t *batch)
+{
+  subscription_t *first = NULL;
+  subscription_t *sub;
+  uint8_t i;
+  uint8_t kept = 0;
+
+  prepare_sub_batch_pkt(batch);
+
+  for(i = 0; i < pending_subs_num; i++) {
+    sub = get_subscription(pending_subs[i]);
+
+    /* unsubscribed meanwhile */
+    if(sub == NULL) {
+      continue;
+    }
+
+    if(first == NULL) {
+      first = sub;
+    }
+
+    if((sub == first || region_covers(&first->region, &sub->region)) && \
+        sub_batch_add(batch, pending_subs[i])) {
+      continue;
+    }
+
+    pending_subs[kept++] = pending_subs[i];
+  }
+
+  pending_subs_num = kept;
+
+  return batch->hdr.len;
+}
+
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(multihop_process, ev, data)
+{
+  PROCESS_EXITHANDLER(multihop_close(&multihop);)
+
+  PROCESS_BEGIN();
+
+  static reading_hdr_t reading_hdr;
+  static rimeaddr_t to;
+  static struct etimer et;
+  pos_t owner_pos = {0.0, 0.0};
+  
+  etimer_stop(&et);
+
+  subscribe_event = process_alloc_event();
+  unsubscribe_event = process_alloc_event();
+  publish_event = process_alloc_event();
+  sid_discovery_reply_event = process_alloc_event();
+  reroute_event = process_alloc_event();
+  owner_update_event = process_alloc_event();
+  refresh_event = process_alloc_event();
+  subscription_update_event = process_alloc_event();
+  snapshot_event = process_alloc_event();
+  knn_event = process_alloc_event();
+  ght_query_event = process_alloc_event();
+  history_event = process_alloc_event();
+  outbox_event = process_alloc_event();
+
+  memb_init(&inflight_memb);
+  list_init(inflight_list);
+
+#if GEOWARE_LOW_POWER
+  train_event = process_alloc_event();
+  memb_init(&train_memb);
+  list_init(train_list);
+#endif
+
+  /* Activate the button sensor. We use the button to drive traffic -
+     when the button is pressed, a packet is sent. */
+  SENSORS_ACTIVATE(button_sensor);
+  
+	/* Open a multihop connection on Rime channel MULTIHOP_CHANNEL. */
+  multihop_open(&multihop, MULTIHOP_CHANNEL, &multihop_call);
+
+  /* hook into the unicast callbacks to get the transmission status */
+  multihop_unicast_call = multihop.c.u;
+  multihop.c.u = &unicast_call;
+
+  /* Set the Rime address of the final receiver of the packet to
+     254.254 as we rely on the x,y coordinates to deliver the packet.
+     once the recipient (distance to node is less then EPSILON)
+     the address of the destination is updated. */
+  to.u8[0] = 254;
+  to.u8[1] = 254;
+
+  /* Loop forever, send a packet when the button is pressed. */
+  while(1) {
+    /* Wait until we get a sensor event with the button sensor as data. */
+    PROCESS_WAIT_EVENT();
+    if (ev == sensors_event && data == &button_sensor) {
+      /* this event is just for debug */
+      printf("Creating multihop packet\n");
+
+      /* prepare the multihop packet */
+    	reading_hdr.hdr.ver = GEOWARE_VERSION;
     	reading_hdr.hdr.type = GEOWARE_READING;
     	reading_hdr.hdr.len = 0;
     	reading_hdr.subscription_hdr.owner_pos = owner_pos;
 
-      /* Copy the reading to the packet buffer. */
-      packetbuf_copyfrom(&reading_hdr, sizeof(reading_hdr_t));
+      /* Copy the reading to the packet buffer. */
+      packetbuf_copyfrom(&reading_hdr, sizeof(reading_hdr_t));
+
+  		print_neighbors();
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == subscribe_event) {
+      uint8_t num = next_sub_batch(&subscription_batch_pkt);
+
+      /* send the rest after a short gap, the next hop has to acknowledge
+         this one first */
+      if(pending_subs_num > 0) {
+        ctimer_set(&batch_timer, SUBSCRIPTION_BATCH_GAP, send_pending_subs, \
+          NULL);
+      }
+
+      if(num == 0) {
+        continue;
+      }
+      else if(num == 1) {
+        /* prepare the subscription packet */
+        prepare_sub_pkt(&subscription_pkt, \
+          subscription_batch_pkt.subs[0].subscription_hdr.sID);
+
+        /* Copy the subscription to the packet buffer. */
+        packetbuf_copyfrom(&subscription_pkt, sizeof(subscription_pkt_t));
+      }
+      else {
+        packetbuf_copyfrom(&subscription_batch_pkt, \
+          SUBSCRIPTION_BATCH_LEN(num));
+      }
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == unsubscribe_event) {
+      sid_t sID = *(sid_t*) data;
+
+      prepare_unsub_pkt(&unsubscription_pkt, sID);
+
+      /* Remove the subscription */
+      remove_subscription(sID);
+
+      /* Copy the unsubscription packet to the packet buffer. */
+      packetbuf_copyfrom(&unsubscription_pkt, sizeof(unsubscription_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == owner_update_event) {
+      sid_t sID = *(sid_t*) data;
+
+      if(!prepare_owner_update_pkt(&owner_update_pkt, sID, owner_seq)) {
+        continue;
+      }
+
+      packetbuf_copyfrom(&owner_update_pkt, sizeof(owner_update_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == refresh_event) {
+      sid_t sID = *(sid_t*) data;
+
+      if(!prepare_refresh_pkt(&refresh_pkt, sID)) {
+        continue;
+      }
+
+      packetbuf_copyfrom(&refresh_pkt, sizeof(refresh_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == history_event) {
+      packetbuf_copyfrom(&history_out_pkt, sizeof(history_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == ght_query_event) {
+      packetbuf_copyfrom(&ght_query_out_pkt, sizeof(ght_query_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == knn_event) {
+      packetbuf_copyfrom(data, sizeof(knn_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == snapshot_event) {
+      packetbuf_copyfrom(&snapshot_out_pkt, sizeof(snapshot_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == subscription_update_event) {
+      struct pending_update *u = (struct pending_update*) data;
+
+      if(!prepare_subscription_update_pkt(&subscription_update_pkt, u->sID, \
+          u->changes, u->reach_center, u->reach_radius)) {
+        continue;
+      }
+
+      packetbuf_copyfrom(&subscription_update_pkt, \
+        sizeof(subscription_update_pkt_t));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == publish_event) {
+      if(data == NULL) {
+        continue;
+      }
+
+      /* Copy the reading packet to the packet buffer. */
+      if(((geoware_hdr_t*)data)->type == GEOWARE_SHARED_READING) {
+        packetbuf_copyfrom(data, \
+          SHARED_READING_LEN(((geoware_hdr_t*)data)->len));
+
+        /* the split buffer can take the next split */
+        if(data == &split_pkt) {
+          split_pkt.hdr.len = 0;
+        }
+      }
+      else if(((geoware_hdr_t*)data)->type == GEOWARE_KNN_REPLY) {
+        packetbuf_copyfrom(data, sizeof(knn_reply_pkt_t));
+      }
+      else if(((geoware_hdr_t*)data)->type == GEOWARE_GHT_STORE) {
+        packetbuf_copyfrom(data, sizeof(ght_pkt_t));
+      }
+      else if(((geoware_hdr_t*)data)->type == GEOWARE_VECTOR_READING) {
+        packetbuf_copyfrom(data, vector_len(data));
+      }
+      else if(((geoware_hdr_t*)data)->type == GEOWARE_BLOB_FRAGMENT) {
+        packetbuf_copyfrom(data, blob_frag_len(data));
+      }
+      else if(((geoware_hdr_t*)data)->type == GEOWARE_BLOB_NACK) {
+        packetbuf_copyfrom(data, sizeof(blob_nack_pkt_t));
+      }
+      else {
+        packetbuf_copyfrom(data, sizeof(reading_pkt_t));
+      }
+
+       /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+    else if (ev == sid_discovery_reply_event) {
+      static struct subscription *s;
+      static pos_t pos;
+
+      /* check if we have any active subscriptions */
+      if(list_length(active_subscriptions) == 0) {
+        continue;
+      }
+
+      /* data is not null if we just received a request. save the position of
+         requesting node and add initial jitter */
+      if(data != NULL){
+        pos = *(pos_t*)data;
+        s = list_head(active_subscriptions);
+        etimer_set(&et, random_rand()%CLOCK_SECOND);
+        printf("preparing reply for ");
+        print_pos(pos);
+        continue;
+      }
+
+      /* pack as many of the subscriptions covering the requester as fit in
+         one packet */
+      prepare_sub_batch_pkt(&subscription_batch_pkt);
+
+      for(; s != NULL; s = list_item_next(s)) {
+        // TODO: check if it supports the subscription sensor type
+        if(region_contains(&s->sub.region, pos) && \
+            !sub_batch_add(&subscription_batch_pkt, \
+              s->sub.subscription_hdr.sID)) {
+          break;
+        }
+      }
+
+      /* if we have more subscriptions set the event timer to send them
+         after a short gap */
+      if(s != NULL) {
+        etimer_set(&et, SUBSCRIPTION_BATCH_GAP);
+        printf("found more subscriptions, sending next at %lu\n", \
+          etimer_expiration_time(&et));
+      }
+
+      if(subscription_batch_pkt.hdr.len == 0) {
+        continue;
+      }
+
+      /* clear the firework flag so that when the packet doesnt spread further
+         via broadcasts */
+      subscription_batch_pkt.hdr.firewrk = 0;
+
+      /* set the position in the header to know where to forward */
+      subscription_batch_pkt.hdr.pos = pos;
+
+      printf("sending %d subscriptions to: ", subscription_batch_pkt.hdr.len);
+      print_pos(subscription_batch_pkt.hdr.pos);
+
+      /* Copy the subscriptions to the packet buffer. */
+      packetbuf_copyfrom(&subscription_batch_pkt, \
+        SUBSCRIPTION_BATCH_LEN(subscription_batch_pkt.hdr.len));
+
+      /* Send the packet. */ 
+      multihop_send(&multihop, &to);
+    }
+#if GEOWARE_LOW_POWER
+    else if (ev == train_event) {
+      struct train_entry *e;
+
+      /* hand all the queued readings to the MAC layer at once. it keeps a
+         queue per neighbor and sends the ones for the same next hop as a
+         burst after a single wake-up */
+      while((e = list_pop(train_list)) != NULL) {
+        packetbuf_copyfrom(&e->pkt, sizeof(reading_pkt_t));
+        multihop_send(&multihop, &to);
+        memb_free(&train_memb, e);
+      }
+    }
+#endif
+    else if (ev == reroute_event) {
+      struct inflight *e = data;
+      rimeaddr_t *nexthop;
+      rimeaddr_t originator, dest, prevhop;
+      uint8_t hops;
+
+      /* restore the packet and its multihop attributes */
+      packetbuf_copyfrom(e->data, e->len);
+      rimeaddr_copy(&originator, &e->originator);
+      rimeaddr_copy(&dest, &e->dest);
+      rimeaddr_copy(&prevhop, &e->prevhop);
+      hops = e->hops;
+      reroutes = e->reroutes;
+
+      /* the copy is done with, forward() keeps a new one */
+      memb_free(&inflight_memb, e);
+
+      packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &originator);
+      packetbuf_set_addr(PACKETBUF_ADDR_ERECEIVER, &dest);
+      packetbuf_set_attr(PACKETBUF_ATTR_HOPS, hops + 1);
+
+      /* pick a new next hop, the failed one is no longer a neighbor */
+      rerouting = 1;
+      nexthop = forward(&multihop, &originator, &dest, &prevhop, hops);
+      rerouting = 0;
+
+      if(nexthop != NULL) {
+        printf("re-routing packet via %d.%d\n", \
+          nexthop->u8[0], nexthop->u8[1]);
+        multihop_resend(&multihop, nexthop);
+      }
+    }
+    else if (ev == outbox_event) {
+      rimeaddr_t *nexthop;
+      rimeaddr_t originator;
+
+      /* the oldest held reading goes first */
+      if(!outbox_peek(&originator)) {
+        continue;
+      }
+      packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &originator);
+      packetbuf_set_addr(PACKETBUF_ADDR_ERECEIVER, &to);
+      packetbuf_set_attr(PACKETBUF_ATTR_HOPS, 1);
+
+      /* the position in the header is already our own, and the reading
+         stays in the outbox if there is still no way on */
+      reroutes = 0;
+      draining = 1;
+      rerouting = 1;
+      nexthop = forward(&multihop, &originator, &to, &rimeaddr_node_addr, 0);
+      rerouting = 0;
+      draining = 0;
+
+      if(nexthop == NULL) {
+        ctimer_set(&outbox_timer, OUTBOX_RETRY, outbox_drain, NULL);
+        continue;
+      }
+
+      printf("sending held reading via %d.%d\n", \
+        nexthop->u8[0], nexthop->u8[1]);
+      multihop_resend(&multihop, nexthop);
+      outbox_pop();
+
+      /* a route is back, send the rest on one at a time so we do not swamp
+         it */
+      if(!outbox_empty()) {
+        ctimer_set(&outbox_timer, OUTBOX_DRAIN_GAP, outbox_drain, NULL);
+      }
+    }
+    else if(etimer_expired(&et) && ev == PROCESS_EVENT_TIMER) {
+      printf("etimer_expired\n");
+      printf("event %d\n", ev);
+      /* just call the discovery reply event again */
+      process_post(&multihop_process, sid_discovery_reply_event, NULL);
+    }
+  }
+
+  PROCESS_END();
+}
+
+/*---------------------------------------------------------------------------*/
+
+sid_t
+subscribe(sensor_t type, uint32_t period, \
+    uint8_t aggr_type, uint8_t aggr_num, pos_t center, \
+    float radius) {
+  region_t region;
+
+  region_circle(&region, center, radius);
+  return subscribe_anycast(type, period, aggr_type, aggr_num, &region, \
+    NULL, 0);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Subscribe to any region shape with readings going to the nearest of us and
+ * the given sinks, up to MAX_SINKS other gateways that registered with
+ * geoware_sink(). Readings fail over to the next nearest sink if one cannot
+ * be reached.
+ */
+sid_t
+subscribe_anycast(sensor_t type, uint32_t period, \
+    uint8_t aggr_type, uint8_t aggr_num, const region_t *region, \
+    const sink_t *sinks, uint8_t sinks_num) {
+
+  subscription_t* active_sub;
+  uint8_t i;
+  
+  /* create and fill the subscription structure */
+  subscription_t new_sub;
+  new_sub.subscription_hdr.sID = 1 + random_rand() % UINT16_MAX;
+  new_sub.subscription_hdr.owner_pos = own_pos;
+  rimeaddr_copy(&new_sub.subscription_hdr.owner, &rimeaddr_node_addr);
+  new_sub.type = type;
+  new_sub.period = period;
+  new_sub.aggr_type = aggr_type;
+  new_sub.aggr_num = aggr_num;
+  new_sub.region = *region;
+  new_sub.lease = SUBSCRIPTION_LEASE;
+  new_sub.store_key = 0;
+  new_sub.more = 0;
+  new_sub.sinks_num = 0;
+  for(i = 0; i < sinks_num && i < MAX_SINKS; i++) {
+    new_sub.sinks[new_sub.sinks_num++] = sinks[i];
+  }
+
+  /* add to the active subscriptions list */
+  if ((active_sub = add_subscription(&new_sub)) != NULL) {
+    // print_subscription(active_sub);
+
+    /* send out the news, together with the subscriptions issued shortly
+       before or after this one */
+    if(pending_subs_num < MAX_ACTIVE_SUBSCRIPTIONS) {
+      pending_subs[pending_subs_num++] = active_sub->subscription_hdr.sID;
+    }
+    if(pending_subs_num == 1) {
+      ctimer_set(&batch_timer, SUBSCRIPTION_BATCH_WINDOW, send_pending_subs, \
+        NULL);
+    }
+
+    return active_sub->subscription_hdr.sID;
+  }
+  else {
+    return 0;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Receive the readings other owners' subscriptions deliver to us as one of
+ * their sinks, posted to process p as geoware_reading_event.
+ */
+void
+geoware_sink(struct process *p) {
+  sink_process = p;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function remembers that the answers to query qID go to the calling
+   process, in a free entry or the oldest one. */
+static void
+snapshot_register(sid_t qID)
+{
+  uint8_t i;
+  uint8_t oldest = 0;
+
+  for(i = 0; i < SNAPSHOT_MAX; i++) {
+    if(snapshots[i].qID == 0) {
+      oldest = i;
+      break;
+    }
+    if(snapshots[i].timestamp < snapshots[oldest].timestamp) {
+      oldest = i;
+    }
+  }
+
+  snapshots[oldest].qID = qID;
+  snapshots[oldest].proc = PROCESS_CURRENT();
+  snapshots[oldest].timestamp = clock_seconds();
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Ask the nodes in the region for one reading of sensor type each, without
+ * subscribing. The answers are posted to the calling process as
+ * geoware_reading_event for the returned query ID, like readings, for
+ * SNAPSHOT_LEASE seconds.
+ */
+sid_t
+snapshot(sensor_t type, const region_t *region) {
+
+  snapshot_out_pkt.hdr.ver = GEOWARE_VERSION;
+  snapshot_out_pkt.hdr.type = GEOWARE_SNAPSHOT;
+  snapshot_out_pkt.hdr.len = 0;
+  snapshot_out_pkt.hdr.pos = own_pos;
+  snapshot_out_pkt.hdr.firewrk = 1;
+  snapshot_out_pkt.query_hdr.sID = 1 + random_rand() % UINT16_MAX;
+  snapshot_out_pkt.query_hdr.owner_pos = own_pos;
+  rimeaddr_copy(&snapshot_out_pkt.query_hdr.owner, &rimeaddr_node_addr);
+  snapshot_out_pkt.type = type;
+  snapshot_out_pkt.region = *region;
+
+  snapshot_register(snapshot_out_pkt.query_hdr.sID);
+
+  /* do not take part when the query floods back past us */
+  add_seen_sub(snapshot_out_pkt.query_hdr.sID, SNAPSHOT_LEASE);
+
+  /* send it right away, the next query reuses the packet */
+  process_post_synch(&multihop_process, snapshot_event, NULL);
+
+  return snapshot_out_pkt.query_hdr.sID;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function is called by the ctimer of an answer to send it, the
+   slot is free again right after. */
+static void
+answer_send(void *ptr)
+{
+  struct answer *a = ptr;
+
+  process_post_synch(&multihop_process, publish_event, (void*) &a->pkt);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Answer a snapshot query with one reading of the sensor it asks for. The
+ * answer goes back the way the query came, after a random delay.
+ */
+void
+answer_snapshot(snapshot_pkt_t *snapshot_pkt)
+{
+  struct answer *a;
+  reading_pkt_t *reply;
+
+  if((a = answer_slot(snapshot_pkt->query_hdr.sID)) == NULL) {
+    return;
+  }
+  reply = &a->pkt.reading;
+
+  if(!sensor_sample(snapshot_pkt->type, &reply->value)) {
+    return;
+  }
+
+  reply->reading_hdr.hdr.ver = GEOWARE_VERSION;
+  reply->reading_hdr.hdr.type = GEOWARE_READING;
+  reply->reading_hdr.hdr.len = READING_ANSWER;
+  reply->reading_hdr.hdr.pos = own_pos;
+  reply->reading_hdr.subscription_hdr = snapshot_pkt->query_hdr;
+  reply->sinks_num = 0;
+  reply->sink_next = 0;
+#if GEOWARE_TIMESTAMPS
+  reply->stamp = timesync_stamp(timesync_time());
+#endif
+
+  ctimer_set(&a->timer, 1 + random_rand() % SNAPSHOT_JITTER, answer_send, a);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Ask for one reading of sensor type from each of the k nodes nearest to
+ * point that carry it, at most KNN_MAX. The query goes to the node nearest
+ * to point, which searches outwards from there. The results are posted to
+ * the calling process like the answers to a snapshot, nearest first.
+ */
+sid_t
+knn(sensor_t type, pos_t point, uint8_t k) {
+  knn_out_pkt.hdr.ver = GEOWARE_VERSION;
+  knn_out_pkt.hdr.type = GEOWARE_KNN;
+  knn_out_pkt.hdr.len = 0;
+  knn_out_pkt.hdr.pos = own_pos;
+  knn_out_pkt.hdr.firewrk = 0;
+  knn_out_pkt.query_hdr.sID = 1 + random_rand() % UINT16_MAX;
+  knn_out_pkt.query_hdr.owner_pos = own_pos;
+  rimeaddr_copy(&knn_out_pkt.query_hdr.owner, &rimeaddr_node_addr);
+  knn_out_pkt.type = type;
+  knn_out_pkt.k = k;
+  knn_out_pkt.ring = 0;
+  knn_out_pkt.point = point;
+  knn_out_pkt.inner = 0;
+  knn_out_pkt.outer = 0;
+
+  snapshot_register(knn_out_pkt.query_hdr.sID);
+
+  /* send it right away, the next query reuses the packet */
+  process_post_synch(&multihop_process, knn_event, (void*) &knn_out_pkt);
+
+  return knn_out_pkt.query_hdr.sID;
+}
+
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Answer a kNN ring with one reading of the sensor it asks for and our
+ * position. The answer goes back to the home the way the ring came, after
+ * a random delay.
+ */
+void
+answer_knn(knn_pkt_t *knn_pkt)
+{
+  struct answer *a;
+  knn_reply_pkt_t *reply;
+
+  if((a = answer_slot(knn_pkt->home_hdr.sID)) == NULL) {
+    return;
+  }
+  reply = &a->pkt.knn;
+
+  if(!sensor_sample(knn_pkt->type, &reply->value)) {
+    return;
+  }
+
+  reply->reading_hdr.hdr.ver = GEOWARE_VERSION;
+  reply->reading_hdr.hdr.type = GEOWARE_KNN_REPLY;
+  reply->reading_hdr.hdr.len = 0;
+  reply->reading_hdr.hdr.pos = own_pos;
+  reply->reading_hdr.subscription_hdr = knn_pkt->home_hdr;
+  rimeaddr_copy(&reply->node, &rimeaddr_node_addr);
+  reply->pos = own_pos;
+
+  ctimer_set(&a->timer, 1 + random_rand() % SNAPSHOT_JITTER, answer_send, a);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Subscribe with the readings stored in the field under key instead of
+ * delivered to us, at the node nearest to the point type and key hash to
+ * and replicated around it. Any node reads them with query_stored().
+ */
+sid_t
+subscribe_stored(sensor_t type, uint32_t period, \
+    uint8_t aggr_type, uint8_t aggr_num, const region_t *region, \
+    uint8_t key) {
+  sid_t sID;
+  subscription_t *s;
+
+  sID = subscribe_anycast(type, period, aggr_type, aggr_num, region, NULL, 0);
+
+  /* it is still waiting to be sent out with the next batch */
+  if(sID != 0 && (s = get_subscription(sID)) != NULL) {
+    s->store_key = key;
+  }
+
+  return sID;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Subscribe to sensor type and the sensors in more (bit t for sensor type
+ * t) over region. The nodes read them all at once and publish the readings
+ * in one packet, each is posted to the calling process with its sensor
+ * type. Only the readings of type are aggregated.
+ */
+sid_t
+subscribe_vector(sensor_t type, uint16_t more, uint32_t period, \
+    uint8_t aggr_type, uint8_t aggr_num, const region_t *region) {
+  sid_t sID;
+  subscription_t *s;
+
+  sID = subscribe_anycast(type, period, aggr_type, aggr_num, region, NULL, 0);
+
+  /* it is still waiting to be sent out with the next batch */
+  if(sID != 0 && (s = get_subscription(sID)) != NULL) {
+    s->more = more;
+  }
+
+  return sID;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Ask for the readings stored under sensor type and key, one from every
+ * source. They are posted to the calling process like the answers to a
+ * snapshot.
+ */
+sid_t
+query_stored(sensor_t type, uint8_t key) {
+  ght_query_out_pkt.hdr.ver = GEOWARE_VERSION;
+  ght_query_out_pkt.hdr.type = GEOWARE_GHT_QUERY;
+  ght_query_out_pkt.hdr.len = 0;
+  ght_query_out_pkt.hdr.pos = own_pos;
+  ght_query_out_pkt.hdr.firewrk = 0;
+  ght_query_out_pkt.query_hdr.sID = 1 + random_rand() % UINT16_MAX;
+  ght_query_out_pkt.query_hdr.owner_pos = own_pos;
+  rimeaddr_copy(&ght_query_out_pkt.query_hdr.owner, &rimeaddr_node_addr);
+  ght_query_out_pkt.type = type;
+  ght_query_out_pkt.key = key;
+  ght_query_out_pkt.point = ght_point(type, key);
+
+  snapshot_register(ght_query_out_pkt.query_hdr.sID);
+
+  /* send it right away, the next query reuses the packet */
+  process_post_synch(&multihop_process, ght_query_event, NULL);
+
+  return ght_query_out_pkt.query_hdr.sID;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Ask the nodes in the region for the minimum, maximum or average of the
+ * samples of sensor type they took between since and until seconds ago,
+ * or for the samples themselves with HISTORY_RAW. Only nodes keeping a
+ * flash log answer. The answers are posted to the calling process like
+ * the answers to a snapshot. Raw samples carry when they were taken, so
+ * they need GEOWARE_TIMESTAMPS and cannot be older than
+ * TIMESYNC_STAMP_SPAN seconds.
+ */
+sid_t
+history(sensor_t type, const region_t *region, uint32_t since, \
+    uint32_t until, uint8_t aggr) {
+  history_out_pkt.hdr.ver = GEOWARE_VERSION;
+  history_out_pkt.hdr.type = GEOWARE_HISTORY;
+  history_out_pkt.hdr.len = 0;
+  history_out_pkt.hdr.pos = own_pos;
+  history_out_pkt.hdr.firewrk = 1;
+  history_out_pkt.query_hdr.sID = 1 + random_rand() % UINT16_MAX;
+  history_out_pkt.query_hdr.owner_pos = own_pos;
+  rimeaddr_copy(&history_out_pkt.query_hdr.owner, &rimeaddr_node_addr);
+  history_out_pkt.type = type;
+  history_out_pkt.aggr = aggr;
+  history_out_pkt.since = since;
+  history_out_pkt.until = until;
+  history_out_pkt.region = *region;
+
+  snapshot_register(history_out_pkt.query_hdr.sID);
+
+  /* do not take part when the query floods back past us */
+  add_seen_sub(history_out_pkt.query_hdr.sID, SNAPSHOT_LEASE);
+
+  /* send it right away, the next query reuses the packet */
+  process_post_synch(&multihop_process, history_event, NULL);
+
+  return history_out_pkt.query_hdr.sID;
+}
+
+/*---------------------------------------------------------------------------*/
+#if GEOWARE_TIMESTAMPS
+/*
+ * This function fetches the i-th raw sample of answer a into its reply,
+ * stamped with the network time it was taken at. Returns 0 if there are
+ * not that many.
+ */
+static uint8_t
+history_raw(struct answer *a, uint16_t i)
+{
+  uint32_t time;
 
-  		print_neighbors();
+  if(!history_get(a->type, a->from, a->to, i, &a->pkt.reading.value, \
+      &time)) {
+    return 0;
+  }
 
-      /* Send the packet. */ 
-      multihop_send(&multihop, &to);
-    }
-    else if (ev == subscribe_event) {
-      /* prepare the subscription packet */
-      prepare_sub_pkt(&subscription_pkt, *(sid_t*)data);
+  a->pkt.reading.stamp = timesync_stamp(timesync_time() - \
+    (clock_seconds() - time) * CLOCK_SECOND);
+  return 1;
+}
+#endif /* GEOWARE_TIMESTAMPS */
 
-      /* Copy the subscription to the packet buffer. */
-      packetbuf_copyfrom(&subscription_pkt, sizeof(subscription_pkt_t));
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called by the history ctimer to send our answer, raw
+ * samples one after the other KNN_REPLY_GAP apart.
+ */
+static void
+history_send(void *ptr)
+{
+  struct answer *a = ptr;
 
-      /* Send the packet. */ 
-      multihop_send(&multihop, &to);
+#if GEOWARE_TIMESTAMPS
+  if(a->aggr == HISTORY_RAW) {
+    if(a->next >= HISTORY_RAW_MAX || !history_raw(a, a->next++)) {
+      return;
     }
-    else if (ev == unsubscribe_event) {
-      sid_t sID = *(sid_t*) data;
 
-      prepare_unsub_pkt(&unsubscription_pkt, sID);
+    ctimer_set(&a->timer, KNN_REPLY_GAP, history_send, a);
+  }
+#endif /* GEOWARE_TIMESTAMPS */
 
-      /* Remove the subscription */
-      remove_subscription(sID);
+  process_post_synch(&multihop_process, publish_event, \
+    (void*) &a->pkt.reading);
+}
 
-      /* Copy the unsubscription packet to the packet buffer. */
-      packetbuf_copyfrom(&unsubscription_pkt, sizeof(unsubscription_pkt_t));
+/*---------------------------------------------------------------------------*/
+/*
+ * Answer a history query from our flash log, after a random delay like the
+ * answer to a snapshot. Nothing is sent if we have no samples in its range,
+ * nor raw samples we could not stamp with when they were taken.
+ */
+void
+answer_history(history_pkt_t *history_pkt)
+{
+  uint32_t now = clock_seconds();
+  struct answer *a;
+  reading_pkt_t *reply;
 
-      /* Send the packet. */ 
-      multihop_send(&multihop, &to);
+  if((a = answer_slot(history_pkt->query_hdr.sID)) == NULL) {
+    return;
+  }
+  reply = &a->pkt.reading;
+
+  a->type = history_pkt->type;
+  a->aggr = history_pkt->aggr;
+  a->from = now > history_pkt->since ? now - history_pkt->since : 0;
+  a->to = now > history_pkt->until ? now - history_pkt->until : 0;
+  a->next = 0;
+
+  if(a->aggr == HISTORY_RAW) {
+#if GEOWARE_TIMESTAMPS
+    /* older stamps would wrap and place the sample later than it was */
+    if(now - a->from > TIMESYNC_STAMP_SPAN) {
+      a->from = now - TIMESYNC_STAMP_SPAN;
     }
-    else if (ev == publish_event) {
-      if(data == NULL) {
-        continue;
-      }
-
-      // TODO: add jitter
+    if(a->from > a->to || !history_raw(a, 0)) {
+      return;
+    }
+#else
+    return;
+#endif /* GEOWARE_TIMESTAMPS */
+  }
+  else {
+    if(history_aggregate(a->type, a->from, a->to, a->aggr, \
+        &reply->value) == 0) {
+      return;
+    }
+#if GEOWARE_TIMESTAMPS
+    reply->stamp = timesync_stamp(timesync_time());
+#endif
+  }
 
-      /* Copy the reading packet to the packet buffer. */
-      packetbuf_copyfrom(data, sizeof(reading_pkt_t));
+  reply->reading_hdr.hdr.ver = GEOWARE_VERSION;
+  reply->reading_hdr.hdr.type = GEOWARE_READING;
+  reply->reading_hdr.hdr.len = READING_ANSWER;
+  reply->reading_hdr.hdr.pos = own_pos;
+  reply->reading_hdr.subscription_hdr = history_pkt->query_hdr;
+  reply->sinks_num = 0;
+  reply->sink_next = 0;
 
-       /* Send the packet. */ 
-      multihop_send(&multihop, &to);
-    }
-    else if (ev == sid_discovery_reply_event) {
-      static struct subscription *s;
-      static pos_t pos;
+  ctimer_set(&a->timer, 1 + random_rand() % SNAPSHOT_JITTER, history_send, a);
+}
 
-      /* check if we have any active subscriptions */
-      if(list_length(active_subscriptions) == 0) {
-        continue;
-      }
+/*---------------------------------------------------------------------------*/
 
-      /* data is not null if we just received a request. save the position of
-         requesting node and add initial jitter */
-      if(data != NULL){
-        pos = *(pos_t*)data;
-        etimer_set(&et, random_rand()%CLOCK_SECOND);
-        printf("preparing reply for ");
-        print_pos(pos);
-        continue;
-      }
+void
+unsubscribe(sid_t sID) {
+  static sid_t id;
+  id = sID;
 
-      /* iterate over the active subscriptions */
-      if(s == NULL) {
-        s = list_head(active_subscriptions);
-      }
-      else {
-        s = list_item_next(s);
-      }
+  process_post(&multihop_process, unsubscribe_event, (void*) &id);
+  /* removal from active subscriptions is handled in the multihop process since
+     it cant be done until the subsctiption info is copied to the packet */
+}
 
-      /* if we have more active subscriptions set the event timer to process
-         them after a little jitter */
-      if(s->next != NULL) {
-        etimer_set(&et, CLOCK_SECOND/2 + random_rand()%CLOCK_SECOND);
-        printf("found more subscriptions, sending next at %lu\n", \
-          etimer_expiration_time(&et));
-      }
+/*---------------------------------------------------------------------------*/
+/*
+ * Change the sampling period, the aggregate and the region of our
+ * subscription sID without unsubscribing. Nodes apply the changes in place
+ * and keep the readings collected so far, nodes that are no longer in the
+ * region leave and the ones the new region covers join. Returns 0 if
+ * sID is not a subscription of ours.
+ */
+uint8_t
+update_subscription(sid_t sID, uint32_t period, uint8_t aggr_type, \
+    uint8_t aggr_num, const region_t *region) {
+  struct pending_update update;
+  struct subscription *s;
+  subscription_t new_sub;
+  pos_t min, max, new_min, new_max;
 
-      /* check if the requester is within the subscription area */
-      if (distance(pos, s->sub.center) <= s->sub.radius) {
-        printf("requester within distance, preparing subscription packet\n");
-        // TODO: check if it supports the subscription sensor type
+  if((s = get_subscription_struct(sID)) == NULL || !is_owner(&s->sub)) {
+    return 0;
+  }
 
-        /* prepare the subscription packet */
-        prepare_sub_pkt(&subscription_pkt, s->sub.subscription_hdr.sID);
+  new_sub = s->sub;
+  new_sub.period = period;
+  new_sub.aggr_type = aggr_type;
+  new_sub.aggr_num = aggr_num;
+  new_sub.region = *region;
+
+  /* the update has to reach both the old and the new region, flood the
+     circle around their bounding boxes */
+  region_box(&s->sub.region, &min, &max);
+  region_box(region, &new_min, &new_max);
+  min.x = MIN(min.x, new_min.x);
+  min.y = MIN(min.y, new_min.y);
+  max.x = MAX(max.x, new_max.x);
+  max.y = MAX(max.y, new_max.y);
+
+  update.sID = sID;
+  update.changes = 0;
+  update.reach_center.x = (min.x + max.x) / 2;
+  update.reach_center.y = (min.y + max.y) / 2;
+  update.reach_radius = distance(min, max) / 2;
+
+  if(period != s->sub.period) {
+    update.changes |= SUB_UPDATE_PERIOD;
+  }
+  if(aggr_type != s->sub.aggr_type || aggr_num != s->sub.aggr_num) {
+    update.changes |= SUB_UPDATE_AGGR;
+  }
+  if(!region_equal(region, &s->sub.region)) {
+    update.changes |= SUB_UPDATE_REGION;
+  }
 
-        /* clear the firework flag so that when the packet doesnt spread further
-           via broadcasts */
-        subscription_pkt.hdr.firewrk = 0;
+  if(update.changes == 0) {
+    return 1;
+  }
 
-        /* set the position in the header to know where to forward */
-        subscription_pkt.hdr.pos = pos;
+  modify_subscription(&new_sub, update.changes);
+  s->version++;
 
-        printf("sending to: ");
-        print_pos(subscription_pkt.hdr.pos);
+  /* send it right away, the update lives on our stack */
+  process_post_synch(&multihop_process, subscription_update_event, \
+    (void*) &update);
 
-        /* Copy the subscription to the packet buffer. */
-        packetbuf_copyfrom(&subscription_pkt, sizeof(subscription_pkt_t));
+  return 1;
+}
 
-        /* Send the packet. */ 
-        multihop_send(&multihop, &to);
-      }
-    }
-    else if(etimer_expired(&et) && ev == PROCESS_EVENT_TIMER) {
-      printf("etimer_expired\n");
-      printf("event %d\n", ev);
-      /* just call the discovery reply event again */
-      process_post(&multihop_process, sid_discovery_reply_event, NULL);
-    }
-  }
+/*---------------------------------------------------------------------------*/
+/*
+ * Renew the lease of our subscription sID in its region. Called periodically
+ * by the lease timer on the owner, nodes that stop hearing the refreshes
+ * drop the subscription once the lease runs out.
+ */
+void
+refresh(sid_t sID) {
+  static sid_t id;
+  id = sID;
 
-  PROCESS_END();
+  process_post_synch(&multihop_process, refresh_event, (void*) &id);
 }
 
 /*---------------------------------------------------------------------------*/
 
-sid_t
-subscribe(sensor_t type, uint32_t period, \
-    uint8_t aggr_type, uint8_t aggr_num, pos_t center, \
-    float radius) {
+#if GEOWARE_LOW_POWER
+static void
+train_flush(void *ptr)
+{
+  process_post(&multihop_process, train_event, NULL);
+}
 
-  subscription_t* active_sub;
-  
-  /* create and fill the subscription structure */
-  subscription_t new_sub;
-  new_sub.subscription_hdr.sID = 1 + random_rand() % UINT16_MAX;
-  new_sub.subscription_hdr.owner_pos = own_pos;
-  new_sub.type = type;
-  new_sub.period = period;
-  new_sub.aggr_type = aggr_type;
-  new_sub.aggr_num = aggr_num;
-  new_sub.center = center;
-  new_sub.radius = radius;
+/*---------------------------------------------------------------------------*/
+/*
+ * This function queues a reading for the next packet train. The train
+ * leaves when it is full or TRAIN_HOLD seconds after its first reading.
+ */
+static void
+train_add(reading_pkt_t *pkt)
+{
+  struct train_entry *e;
 
-  /* add to the active subscriptions list */
-  if ((active_sub = add_subscription(&new_sub)) != NULL) {
-    // print_subscription(active_sub);
+  e = memb_alloc(&train_memb);
+
+  /* the train leaves as soon as it is full, so this only happens if the
+     multihop process did not get to it yet */
+  if(e == NULL) {
+    debug_printf("train full, dropping reading\n");
+    return;
+  }
 
-    /* send out the news */
-    process_post(&multihop_process, subscribe_event, (void*) &active_sub->subscription_hdr.sID);
+  e->pkt = *pkt;
 
-    return active_sub->subscription_hdr.sID;
+  if(list_length(train_list) == 0) {
+    ctimer_set(&train_timer, CLOCK_SECOND*TRAIN_HOLD, train_flush, NULL);
   }
-  else {
-    return 0;
+
+  list_add(train_list, e);
+
+  if(list_length(train_list) == TRAIN_MAX) {
+    ctimer_stop(&train_timer);
+    train_flush(NULL);
   }
 }
+#endif /* GEOWARE_LOW_POWER */
 
 /*---------------------------------------------------------------------------*/
+/*
+ * This function sends the reading to the nearest of the owner and the other
+ * sinks of subscription s, and lists the rest nearest first to fail over to
+ * if it cannot be reached.
+ */
+static void
+order_sinks(reading_pkt_t *pkt, subscription_t *s)
+{
+  sink_t sinks[MAX_SINKS + 1];
+  sink_t tmp;
+  uint8_t num = 0;
+  uint8_t best;
+  uint8_t i, j;
 
-void
-unsubscribe(sid_t sID) {
-  static sid_t id;
-  id = sID;
+  sinks[num].addr = s->subscription_hdr.owner;
+  sinks[num++].pos = s->subscription_hdr.owner_pos;
 
-  process_post(&multihop_process, unsubscribe_event, (void*) &id);
-  /* removal from active subscriptions is handled in the multihop process since
-     it cant be done until the subsctiption info is copied to the packet */
+  for(i = 0; i < s->sinks_num && i < MAX_SINKS; i++) {
+    sinks[num++] = s->sinks[i];
+  }
+
+  for(i = 0; i < num; i++) {
+    best = i;
+    for(j = i + 1; j < num; j++) {
+      if(distance(own_pos, sinks[j].pos) < distance(own_pos, sinks[best].pos)) {
+        best = j;
+      }
+    }
+    tmp = sinks[i];
+    sinks[i] = sinks[best];
+    sinks[best] = tmp;
+  }
+
+  pkt->reading_hdr.subscription_hdr.owner = sinks[0].addr;
+  pkt->reading_hdr.subscription_hdr.owner_pos = sinks[0].pos;
+  pkt->sinks_num = num - 1;
+  pkt->sink_next = 0;
+
+  for(i = 1; i < num; i++) {
+    pkt->sinks[i - 1] = sinks[i];
+  }
 }
 
 /*---------------------------------------------------------------------------*/
 
 /* send an updated value to the subscription owner */
-void
-publish(sid_t sID, reading_val value) {
+/*
+ * This function sends the readings pending for subscription sub to its
+ * owner, its sinks, or the home of its key.
+ */
+static void
+publish_send(struct subscription *sub) {
+  sid_t sID = sub->sub.subscription_hdr.sID;
+  reading_val value = sub->pending[0];
   subscription_t *s;
+  struct subscription *lead;
+  struct subscription *f;
+  sensor_t t;
+  uint8_t i;
 
   printf("publishing subscription: %u\n", sID);
 
@@ -851,16 +3655,211 @@ publish(sid_t sID, reading_val value) {
     return;
   }
 
+  /* the readings of a stored subscription go to the home of its key */
+  if(s != NULL && s->store_key != 0) {
+    ght_out_pkt.hdr.ver = GEOWARE_VERSION;
+    ght_out_pkt.hdr.type = GEOWARE_GHT_STORE;
+    ght_out_pkt.hdr.len = 0;
+    ght_out_pkt.hdr.pos = own_pos;
+    ght_out_pkt.hdr.firewrk = 0;
+    ght_out_pkt.type = s->type;
+    ght_out_pkt.key = s->store_key;
+    rimeaddr_copy(&ght_out_pkt.source, &rimeaddr_node_addr);
+    ght_out_pkt.point = ght_point(s->type, s->store_key);
+    ght_out_pkt.value = value;
+
+    process_post(&multihop_process, publish_event, (void*) &ght_out_pkt);
+    return;
+  }
+
+  /* the readings of all the sensors of the subscription go in one packet */
+  if(s != NULL && s->more != 0) {
+    vector_reading_pkt_out.reading_hdr.hdr.ver = GEOWARE_VERSION;
+    vector_reading_pkt_out.reading_hdr.hdr.type = GEOWARE_VECTOR_READING;
+    vector_reading_pkt_out.reading_hdr.hdr.len = 0;
+    vector_reading_pkt_out.reading_hdr.hdr.pos = own_pos;
+    vector_reading_pkt_out.reading_hdr.subscription_hdr = s->subscription_hdr;
+#if GEOWARE_TIMESTAMPS
+    vector_reading_pkt_out.stamp = timesync_stamp(sub->pending_time);
+#endif
+
+    vector_add(&vector_reading_pkt_out, s->type, &value);
+    for(t = 1, i = 1; t < 16 && i < SUB_MAX_SENSORS; t++) {
+      if((s->more & (1 << t)) && t != s->type) {
+        if(sub->pending[i].fl != FLT_MAX) {
+          vector_add(&vector_reading_pkt_out, t, &sub->pending[i]);
+        }
+        i++;
+      }
+    }
+
+    process_post(&multihop_process, publish_event, \
+      (void*) &vector_reading_pkt_out);
+    return;
+  }
+
+  /* subscriptions of other owners asking for the same samples get this
+     reading in the same packet */
+  if((lead = get_subscription_struct(sID)) != NULL && \
+      shared_leader(lead) == lead) {
+    shared_reading_pkt_out.hdr.len = 0;
+
+    for(f = list_head(active_subscriptions); f != NULL; \
+        f = list_item_next(f)) {
+      if(shared_leader(f) == lead) {
+        shared_reading_pkt_out.dests[shared_reading_pkt_out.hdr.len++] = \
+          f->sub.subscription_hdr;
+      }
+    }
+
+    if(shared_reading_pkt_out.hdr.len > 1) {
+      shared_reading_pkt_out.hdr.ver = GEOWARE_VERSION;
+      shared_reading_pkt_out.hdr.type = GEOWARE_SHARED_READING;
+      shared_reading_pkt_out.hdr.pos = own_pos;
+      shared_reading_pkt_out.value = value;
+#if GEOWARE_TIMESTAMPS
+      shared_reading_pkt_out.stamp = timesync_stamp(sub->pending_time);
+#endif
+      rimeaddr_copy(&shared_reading_pkt_out.source, &rimeaddr_node_addr);
+
+      /* not put on the train, it has room for single readings only */
+      process_post(&multihop_process, publish_event, \
+        (void*) &shared_reading_pkt_out);
+      return;
+    }
+  }
+
   // TODO: move to prepare_reading_pkt
   reading_pkt_out.reading_hdr.hdr.ver = GEOWARE_VERSION;
   reading_pkt_out.reading_hdr.hdr.type = GEOWARE_READING;
   reading_pkt_out.reading_hdr.hdr.len = 0;
   reading_pkt_out.reading_hdr.hdr.pos = own_pos;
   reading_pkt_out.reading_hdr.subscription_hdr.sID = sID;
-  reading_pkt_out.reading_hdr.subscription_hdr.owner_pos = \
-    s->subscription_hdr.owner_pos;
+  reading_pkt_out.reading_hdr.subscription_hdr = s->subscription_hdr;
+  order_sinks(&reading_pkt_out, s);
+#if GEOWARE_TIMESTAMPS
+  reading_pkt_out.stamp = timesync_stamp(sub->pending_time);
+#endif
   
+#if GEOWARE_LOW_POWER
+  train_add(&reading_pkt_out);
+#else
   process_post(&multihop_process, publish_event, (void*) &reading_pkt_out);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function is called by the publish ctimer of a subscription in our
+   slot. */
+static void
+publish_slot(void *ptr)
+{
+  publish_send((struct subscription*) ptr);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Clock ticks until our publish slot for subscription s. Nodes sample on
+ * the same epochs, so the readings wait for our slot in the period: the
+ * slot we picked shifted by the subscription, so that neighbors send in
+ * distinct slots and every subscription starts at a different one.
+ */
+static clock_time_t
+slot_delay(struct subscription *s)
+{
+  clock_time_t len;
+
+  len = MIN(s->sub.period * CLOCK_SECOND / 1000 / PUBLISH_SLOTS, \
+    PUBLISH_SLOT_LEN);
+
+  return 1 + (slot + s->sub.subscription_hdr.sID) % PUBLISH_SLOTS * len;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Publish a reading for subscription sID, it is sent in our slot. */
+void
+publish(sid_t sID, reading_val value) {
+  struct subscription *s;
+  sensor_t t;
+  uint8_t i;
+
+  if((s = get_subscription_struct(sID)) == NULL) {
+    return;
+  }
+
+  s->pending[0] = value;
+  s->pending_time = timesync_time();
+
+  /* the other sensors of the subscription are read along with it */
+  for(t = 1, i = 1; t < 16 && i < SUB_MAX_SENSORS; t++) {
+    if((s->sub.more & (1 << t)) && t != s->sub.type) {
+      s->pending[i].ui32 = 0;
+      if(!sensor_sample(t, &s->pending[i])) {
+        s->pending[i].fl = FLT_MAX;
+      }
+      i++;
+    }
+  }
+
+  ctimer_set(&s->publish_timer, slot_delay(s), publish_slot, s);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Read the blob sensor of subscription sID and send it to the owner in
+ * fragments, starting in our slot. A blob still being sent is given up.
+ */
+void
+publish_blob(sid_t sID) {
+  struct subscription *s;
+  uint8_t frags;
+
+  if((s = get_subscription_struct(sID)) == NULL || \
+      (frags = blob_read(s->sub.type, sID)) == 0) {
+    return;
+  }
+
+  blob_sID = sID;
+  blob_todo = frags >= 32 ? 0xffffffffUL : (1UL << frags) - 1;
+  ctimer_set(&blob_timer, slot_delay(s), blob_frag_send, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function updates the position of the node at runtime, for mobile
+ * nodes. It can be called by any localization code, or through the pos shell
+ * command. Neighbors learn the new position from a beacon sent right away.
+ * Once we moved OWNER_UPDATE_DISTANCE away from the last announced position,
+ * the regions of our subscriptions are told where to send the readings now.
+ */
+void
+geoware_set_position(pos_t pos) {
+  struct subscription *s;
+  uint8_t announce;
+
+  own_pos = pos;
+  process_post(&broadcast_process, beacon_event, NULL);
+
+  announce = distance(announced_pos, pos) >= OWNER_UPDATE_DISTANCE;
+  if(announce) {
+    announced_pos = pos;
+    owner_seq++;
+  }
+
+  for(s = list_head(active_subscriptions); s != NULL; s = list_item_next(s)) {
+    if(!is_owner(&s->sub)) {
+      continue;
+    }
+
+    s->sub.subscription_hdr.owner_pos = pos;
+
+    if(announce) {
+      /* so we do not pass our own update on when it comes back */
+      s->owner_seq = owner_seq;
+      process_post(&multihop_process, owner_update_event, \
+        (void*) &s->sub.subscription_hdr.sID);
+    }
+  }
 }
 
 /*---------------------------------------------------------------------------*/
@@ -887,6 +3886,7 @@ PROCESS_THREAD(boot_process, ev, data)
   own_pos.x = stof((char *)data);
   PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
   own_pos.y = stof((char *)data);
+  announced_pos = own_pos;
   
   print_pos(own_pos);
 
@@ -906,6 +3906,20 @@ PROCESS_THREAD(boot_process, ev, data)
   memb_init(&neighbors_memb);
   /* Initialize the list used for the neighbor table. */
   list_init(neighbors_list);
+  /* Start accounting for the energy we use. */
+  energy_init();
+  /* Initialize the reverse path table. */
+  routes_init();
+  /* Initialize the table of stored readings. */
+  ght_init();
+  /* Start the flash log of our samples. */
+  history_init();
+  /* Follow our own time until we hear a beacon. */
+  timesync_init();
+  /* Initialize the blob reassembly buffers. */
+  blob_init();
+  /* Initialize the outbox, readings spilled to flash are kept. */
+  outbox_init();
 
   /* start broadcast process */
   process_start(&broadcast_process, NULL);
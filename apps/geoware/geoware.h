@@ -13,9 +13,22 @@
 #include "geoware_sensors.h"
 #include "packets.h"
 #include "helpers.h"
+#include "energy.h"
+#include "backbone.h"
+#include "routes.h"
+#include "ght.h"
+#include "history.h"
+#include "outbox.h"
+#include "timesync.h"
+#include "blob.h"
 
 #define GEOWARE_VERSION 1
 
+#define PHASE_UNKNOWN ((clock_time_t)-1)
+
+/* length of the radio duty cycle, in clock ticks */
+#define WAKEUP_INTERVAL (CLOCK_SECOND / NETSTACK_RDC_CHANNEL_CHECK_RATE)
+
 #define MEMB_GLOBAL(name, structure, num) \
         char CC_CONCAT(name,_memb_count)[num]; \
         structure CC_CONCAT(name,_memb_mem)[num]; \
@@ -48,6 +61,42 @@ struct neighbor {
      this neighbour */
   uint32_t timestamp;
 
+  /* The ->vx and ->vy fields hold the estimated velocity of the neighbor
+     (in position units per second), used to extrapolate where it is now */
+  float vx;
+  float vy;
+
+  /* The ->pathloss holds the attenuation (in dB) of the link to this
+     neighbor, as estimated from its last beacon */
+  uint8_t pathloss;
+
+  /* The ->txmargin holds the fade margin (in dB) on top of the path loss,
+     raised when the MAC layer has to retransmit to this neighbor */
+  uint8_t txmargin;
+
+  /* The ->txpower holds the lowest radio power level we expect to reach
+     this neighbor with, 0 if not known yet */
+  uint8_t txpower;
+
+  /* The ->energy holds the residual energy (in percent) and ->load the
+     number of packets queued or relayed in the last beacon period, both as
+     advertised in the neighbor's beacons */
+  uint8_t energy;
+  uint8_t load;
+
+  /* The ->marked flags hold the neighbor's backbone marker, as advertised
+     in its beacons */
+  uint8_t marked;
+
+  /* The ->slot holds the publish slot the neighbor picked, as advertised in
+     its beacons, PUBLISH_SLOTS if not known yet */
+  uint8_t slot;
+
+  /* The ->phase holds when, within the wake-up interval of a duty cycled
+     MAC, the neighbor's radio wakes up. PHASE_UNKNOWN until we learn it from
+     an acknowledged unicast */
+  clock_time_t phase;
+
   /* The ->ctimer is used to remove old neighbors */
   struct ctimer ctimer;
 };
@@ -56,9 +105,19 @@ extern list_t neighbors_list;
 
 extern process_event_t geoware_reading_event;
 extern pos_t own_pos;
+extern uint8_t beacon_txpower;
+extern uint8_t flood_txpower;
 
 extern process_event_t broadcast_subscription_event;
 extern process_event_t broadcast_unsubscription_event;
+extern process_event_t broadcast_owner_update_event;
+extern process_event_t broadcast_refresh_event;
+extern process_event_t broadcast_subscription_update_event;
+extern process_event_t broadcast_subscription_batch_event;
+extern process_event_t broadcast_snapshot_event;
+extern process_event_t broadcast_knn_event;
+extern process_event_t broadcast_ght_event;
+extern process_event_t broadcast_history_event;
 
 
 PROCESS_NAME(broadcast_process);
@@ -68,9 +127,36 @@ void geoware_init();
 sid_t subscribe(sensor_t type, uint32_t period, \
                 uint8_t aggr_type, uint8_t aggr_num, pos_t center, \
                 float radius);
+sid_t subscribe_anycast(sensor_t type, uint32_t period, \
+                        uint8_t aggr_type, uint8_t aggr_num, \
+                        const region_t *region, const sink_t *sinks, \
+                        uint8_t sinks_num);
+sid_t subscribe_stored(sensor_t type, uint32_t period, \
+                       uint8_t aggr_type, uint8_t aggr_num, \
+                       const region_t *region, uint8_t key);
+sid_t query_stored(sensor_t type, uint8_t key);
+sid_t subscribe_vector(sensor_t type, uint16_t more, uint32_t period, \
+                       uint8_t aggr_type, uint8_t aggr_num, \
+                       const region_t *region);
+sid_t history(sensor_t type, const region_t *region, uint32_t since, \
+              uint32_t until, uint8_t aggr);
+void answer_history(history_pkt_t *history_pkt);
+void geoware_sink(struct process *p);
+sid_t snapshot(sensor_t type, const region_t *region);
+void answer_snapshot(snapshot_pkt_t *snapshot_pkt);
+sid_t knn(sensor_t type, pos_t point, uint8_t k);
+void knn_home(knn_pkt_t *pkt);
+void answer_knn(knn_pkt_t *knn_pkt);
 void unsubscribe(sid_t sID);
+uint8_t update_subscription(sid_t sID, uint32_t period, uint8_t aggr_type, \
+                            uint8_t aggr_num, const region_t *region);
+void refresh(sid_t sID);
 void publish(sid_t sID, reading_val value);
+void publish_blob(sid_t sID);
 void print_neighbors();
+pos_t neighbor_pos(struct neighbor *n);
+void flood_heard(uint8_t type, sid_t sID);
+void geoware_set_position(pos_t pos);
 
 
 #endif
\ No newline at end of file
@@ -28,6 +28,10 @@ struct reading {
 
   /* The ->value field (union) holds the actual reading value */
   reading_val value;
+
+  /* The ->time field holds the network time (in clock ticks) the reading
+     was sampled at */
+  uint32_t time;
 };
 
 /*---------------------------------------------------------------------------*/
@@ -42,6 +46,23 @@ MEMB(sensors_memb, struct sensor, MAX_SENSORS);
 
 LIST(sensors_list);
 
+/* This structure holds the sampling schedule of one sensor type, shared by
+   all the subscriptions on it. */
+struct sampler {
+  struct sampler *next;
+
+  sensor_t type;
+
+  /* -> tick is the interval (in ms) the sensor is read at */
+  uint32_t tick;
+
+  struct ctimer timer;
+};
+
+MEMB(samplers_memb, struct sampler, MAX_SENSORS);
+
+LIST(samplers_list);
+
 void
 remove_reading_type(sensor_t t)
 {
@@ -67,32 +88,42 @@ remove_reading_type(sensor_t t)
 }
 
 /*---------------------------------------------------------------------------*/
-
-void
-sensor_read(void *s)
+/* Sampling period of a subscription, aligned to SAMPLING_QUANTUM so the
+   subscriptions on a sensor share as many reads as possible. */
+static uint32_t
+sampling_period(subscription_t *sub)
 {
-  struct subscription *sub;
-  struct reading *new_reading;
-  mapping_t *mapping;
-  reading_val value;
-  sid_t sID;
+  uint32_t period = (sub->period + SAMPLING_QUANTUM / 2) / SAMPLING_QUANTUM;
 
-  sub = (struct subscription*) s;
-  mapping = get_mapping(sub->sub.type);
-  sID = sub->sub.subscription_hdr.sID;
+  return (period > 0 ? period : 1) * SAMPLING_QUANTUM;
+}
 
-  if(mapping == NULL) {
-    printf("sensor not registered.\n");
-    return;
-  }
+/*---------------------------------------------------------------------------*/
 
-  if(mapping->read == NULL) {
-    printf("sensor not supproted.\n");
-    return;
+static uint32_t
+gcd(uint32_t a, uint32_t b)
+{
+  uint32_t t;
+
+  while(b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
   }
 
-  // fire repeatedly
-  ctimer_reset(&sub->callback);
+  return a;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Store a sample taken for subscription sub and publish once the subscription
+ * collected aggr_num of them.
+ */
+static void
+sample_add(struct subscription *sub, mapping_t *mapping, reading_val value)
+{
+  struct reading *new_reading;
+  sid_t sID = sub->sub.subscription_hdr.sID;
 
   /* allocate space for the new reading */
   new_reading = memb_alloc(&readings_memb);
@@ -118,25 +149,9 @@ sensor_read(void *s)
   new_reading->type = mapping->s;
   new_reading->sID = sID;
 
-  printf("new %s reading: ", mapping->strname);
-  // get the reading
-  switch(mapping->r) {
-    case UINT8:
-      value.ui8 = ((uint8_t (*)())mapping->read)();
-      printf("%u\n", value.ui8);
-      break;
-    case UINT16:
-      value.ui16 = ((uint16_t (*)())mapping->read)();
-      printf("%u\n", value.ui16);
-      break;
-    case FLOAT:
-      value.fl = ((float (*)())mapping->read)();
-      printf(PRINTFLOAT"\n", (long)value.fl, decimals(value.fl));
-      break;
-  }
-
   // add the new reading to the reading list
   new_reading->value = value;
+  new_reading->time = timesync_time();
 
   /* Place the new reading on the readings list. */
   list_add(readings_list, new_reading);
@@ -158,6 +173,451 @@ sensor_read(void *s)
 
 /*---------------------------------------------------------------------------*/
 
+static struct sensor *
+get_sensor(sensor_t type)
+{
+  struct sensor *s;
+
+  for(s = list_head(sensors_list); s != NULL; s = list_item_next(s)) {
+    if(s->mapping->s == type) {
+      return s;
+    }
+  }
+
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function is called by the timeout ctimer of a split-phase sensor
+   whose driver did not finish the conversion in time. */
+static void
+sensor_timeout(void *ptr)
+{
+  struct sensor *s = ptr;
+
+  printf("%s conversion timed out\n", s->mapping->strname);
+  sensor_failed(s->mapping->s);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Start a conversion of split-phase sensor s, unless one is running. */
+static void
+sensor_start(struct sensor *s)
+{
+  if(s->busy) {
+    return;
+  }
+
+  /* the driver may be done before start() returns */
+  s->busy = 1;
+  ctimer_set(&s->timeout, SENSOR_TIMEOUT, sensor_timeout, s);
+  s->mapping->start(s->mapping->s);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * How old (in clock ticks) the last value of split-phase sensor type may be
+ * when it is read: the shortest sampling period of the subscriptions reading
+ * it, or SENSOR_MAX_AGE if none does.
+ */
+static clock_time_t
+sensor_max_age(sensor_t type)
+{
+  struct subscription *sub;
+  uint32_t period = 0;
+
+  for(sub = list_head(active_subscriptions); sub != NULL; \
+      sub = list_item_next(sub)) {
+    if(is_owner(&sub->sub) || (sub->sub.type != type && \
+        !(sub->sub.more & (1 << type)))) {
+      continue;
+    }
+
+    if(period == 0 || sampling_period(&sub->sub) < period) {
+      period = sampling_period(&sub->sub);
+    }
+  }
+
+  return period > 0 ? period * CLOCK_SECOND / 1000 : SENSOR_MAX_AGE;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Read sensor type once into value. Returns 0 if we cannot read it. A
+ * split-phase sensor gives the value of its last conversion and starts the
+ * next one, or 0 if that value is older than its sampling period.
+ */
+uint8_t
+sensor_sample(sensor_t type, reading_val *value)
+{
+  mapping_t *mapping;
+  struct sensor *s;
+
+  mapping = get_mapping(type);
+
+  if(mapping == NULL) {
+    printf("sensor not registered.\n");
+    return 0;
+  }
+
+  if(mapping->start != NULL) {
+    s = get_sensor(type);
+    sensor_start(s);
+
+    if(!s->valid) {
+      printf("no %s reading yet.\n", mapping->strname);
+      return 0;
+    }
+
+    if(clock_time() - s->time > sensor_max_age(type)) {
+      printf("last %s reading too old.\n", mapping->strname);
+      return 0;
+    }
+
+    *value = s->last;
+    return 1;
+  }
+
+  if(mapping->read == NULL) {
+    printf("sensor not supproted.\n");
+    return 0;
+  }
+
+  /* a blob does not fit a reading_val */
+  if(mapping->r == BLOB) {
+    printf("%s is a blob sensor.\n", mapping->strname);
+    return 0;
+  }
+
+  printf("new %s reading: ", mapping->strname);
+  // get the reading
+  switch(mapping->r) {
+    case UINT8:
+      value->ui8 = ((uint8_t (*)())mapping->read)();
+      printf("%u\n", value->ui8);
+      break;
+    case UINT16:
+      value->ui16 = ((uint16_t (*)())mapping->read)();
+      printf("%u\n", value->ui16);
+      break;
+    case FLOAT:
+      value->fl = ((float (*)())mapping->read)();
+      printf(PRINTFLOAT"\n", (long)value->fl, decimals(value->fl));
+      break;
+  }
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Clock ticks until the next multiple of tick ms in network time, so that
+ * all nodes sample on the same epochs. A timer that fired a little early
+ * waits for the epoch after.
+ */
+static clock_time_t
+epoch_delay(uint32_t tick, uint8_t fired)
+{
+  uint32_t period = tick * CLOCK_SECOND / 1000;
+  uint32_t delay;
+
+  if(period == 0) {
+    return 1;
+  }
+
+  delay = period - timesync_time() % period;
+  if(fired && delay < period / 2) {
+    delay += period;
+  }
+
+  return delay;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Count subscription sub down by a tick of its sampler. Returns 1 if it is
+ * due now, it then starts over from its sampling period.
+ */
+static uint8_t
+sample_due(struct sampler *sampler, struct subscription *sub)
+{
+  if(sub->due <= sampler->tick) {
+    sub->due = sampling_period(&sub->sub);
+    return 1;
+  }
+
+  sub->due -= sampler->tick;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Count down the subscriptions on the sensor of sampler for a tick without
+ * a sample, the ones due miss theirs.
+ */
+static void
+sample_skip(struct sampler *sampler)
+{
+  struct subscription *sub;
+
+  for(sub = list_head(active_subscriptions); sub != NULL; \
+      sub = list_item_next(sub)) {
+    if(sub->sub.type == sampler->type && !is_owner(&sub->sub)) {
+      sample_due(sampler, sub);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Hand a sample to the subscriptions on its sensor that are due, and count
+ * down the others.
+ */
+static void
+sample_dispatch(struct sampler *sampler, mapping_t *mapping, reading_val value)
+{
+  struct subscription *sub;
+  struct subscription *next;
+
+#if GEOWARE_FLASH_LOG
+  /* every sample goes to the log for history queries, the sensors no
+     subscription reads are never sampled and have no history */
+  if(mapping->r != BLOB) {
+    history_append(sampler->type, &value);
+  }
+#endif /* GEOWARE_FLASH_LOG */
+
+  /* hand the sample to the subscriptions due, publishing may remove a
+     subscription so take the next one first */
+  for(sub = list_head(active_subscriptions); sub != NULL; sub = next) {
+    next = list_item_next(sub);
+
+    if(sub->sub.type != sampler->type || is_owner(&sub->sub)) {
+      continue;
+    }
+
+    if(sample_due(sampler, sub)) {
+      /* a subscription shared with another owner gets its readings from
+         the one sampling for both */
+      if(mapping->r == BLOB) {
+        publish_blob(sub->sub.subscription_hdr.sID);
+      }
+      else if(shared_leader(sub) == sub) {
+        sample_add(sub, mapping, value);
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called by the ctimer of a sampler every tick. The sensor
+ * is read at most once and the sample goes to every subscription due, for a
+ * split-phase sensor once its conversion is done.
+ */
+static void
+sensor_read(void *ptr)
+{
+  struct sampler *sampler = ptr;
+  struct subscription *sub;
+  struct sensor *s;
+  mapping_t *mapping;
+  reading_val value;
+  uint8_t due = 0;
+
+  // fire repeatedly, following the network time as it is adjusted
+  ctimer_set(&sampler->timer, epoch_delay(sampler->tick, 1), sensor_read, \
+    (void*) sampler);
+
+  for(sub = list_head(active_subscriptions); sub != NULL; \
+      sub = list_item_next(sub)) {
+    if(sub->sub.type == sampler->type && !is_owner(&sub->sub) && \
+        sub->due <= sampler->tick && shared_leader(sub) == sub) {
+      due = 1;
+      break;
+    }
+  }
+
+  if(!due) {
+    sample_skip(sampler);
+    return;
+  }
+
+  mapping = get_mapping(sampler->type);
+
+  /* the subscriptions get the sample of a split-phase sensor once the
+     conversion is done */
+  if(mapping != NULL && mapping->start != NULL) {
+    s = get_sensor(sampler->type);
+
+    /* the conversion of an earlier tick is still running, this tick has
+       no sample of its own */
+    if(s->waiting) {
+      sample_skip(sampler);
+      return;
+    }
+
+    s->waiting = 1;
+    sensor_start(s);
+    return;
+  }
+
+  /* a blob is read for each subscription when it is published */
+  if(mapping == NULL || \
+      (mapping->r != BLOB && !sensor_sample(sampler->type, &value))) {
+    sample_skip(sampler);
+    return;
+  }
+
+  sample_dispatch(sampler, mapping, value);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * The driver of a split-phase sensor calls this function with the value once
+ * a conversion is done. A sampler waiting for it hands it to the
+ * subscriptions due.
+ */
+void
+sensor_done(sensor_t type, reading_val *value)
+{
+  struct sensor *s = get_sensor(type);
+  struct sampler *sampler;
+
+  /* too late, we gave up on it */
+  if(s == NULL || !s->busy) {
+    return;
+  }
+
+  ctimer_stop(&s->timeout);
+  s->busy = 0;
+  s->last = *value;
+  s->time = clock_time();
+  s->valid = 1;
+
+  if(!s->waiting) {
+    return;
+  }
+  s->waiting = 0;
+
+  for(sampler = list_head(samplers_list); sampler != NULL; \
+      sampler = list_item_next(sampler)) {
+    if(sampler->type == type) {
+      sample_dispatch(sampler, s->mapping, *value);
+      break;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* The driver of a split-phase sensor calls this function if a conversion
+   failed, the sample is skipped. */
+void
+sensor_failed(sensor_t type)
+{
+  struct sensor *s = get_sensor(type);
+  struct sampler *sampler;
+
+  if(s == NULL) {
+    return;
+  }
+
+  ctimer_stop(&s->timeout);
+  s->busy = 0;
+
+  if(!s->waiting) {
+    return;
+  }
+  s->waiting = 0;
+
+  /* the subscriptions due still have to start over */
+  for(sampler = list_head(samplers_list); sampler != NULL; \
+      sampler = list_item_next(sampler)) {
+    if(sampler->type == type) {
+      sample_skip(sampler);
+      break;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Work out the sampling schedule of sensor type after a subscription on it
+ * was added, changed or removed. The sensor is read every tick, the greatest
+ * common divisor of the sampling periods of all the subscriptions on it.
+ */
+void
+sampler_update(sensor_t type)
+{
+  struct sampler *sampler;
+  struct subscription *sub;
+  uint32_t tick = 0;
+
+  for(sampler = list_head(samplers_list); sampler != NULL; \
+      sampler = list_item_next(sampler)) {
+    if(sampler->type == type) {
+      break;
+    }
+  }
+
+  for(sub = list_head(active_subscriptions); sub != NULL; \
+      sub = list_item_next(sub)) {
+    if(sub->sub.type == type && !is_owner(&sub->sub)) {
+      tick = gcd(sampling_period(&sub->sub), tick);
+    }
+  }
+
+  /* nobody samples this sensor any more */
+  if(tick == 0) {
+    if(sampler != NULL) {
+      ctimer_stop(&sampler->timer);
+      list_remove(samplers_list, sampler);
+      memb_free(&samplers_memb, sampler);
+    }
+    return;
+  }
+
+  if(sampler == NULL) {
+    sampler = memb_alloc(&samplers_memb);
+
+    if(sampler == NULL) {
+      debug_printf("Samplers list full\n");
+      return;
+    }
+
+    sampler->type = type;
+    sampler->tick = 0;
+    list_add(samplers_list, sampler);
+  }
+
+  /* keep every subscription due on a tick */
+  for(sub = list_head(active_subscriptions); sub != NULL; \
+      sub = list_item_next(sub)) {
+    if(sub->sub.type == type && !is_owner(&sub->sub)) {
+      sub->due = (sub->due + tick - 1) / tick * tick;
+    }
+  }
+
+  if(sampler->tick != tick) {
+    debug_printf("sampling sensor %u every %lu ms\n", type, tick);
+
+    sampler->tick = tick;
+    ctimer_set(&sampler->timer, epoch_delay(tick, 0), sensor_read, \
+      (void*) sampler);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Start sampling for subscription s, first sample one period from now. */
+void
+sampler_add(struct subscription *s)
+{
+  s->due = sampling_period(&s->sub);
+  sampler_update(s->sub.type);
+}
+
+/*---------------------------------------------------------------------------*/
+
 reading_val
 get_reading_type(sensor_t t)
 {
@@ -216,9 +676,11 @@ remove_reading_sid(sid_t sID)
 /*---------------------------------------------------------------------------*/
 
 uint8_t
-reading_add(sid_t sID, rimeaddr_t* owner, reading_val* value)
+reading_add(sid_t sID, sensor_t type, rimeaddr_t* owner, reading_val* value, \
+    uint32_t time)
 {
   struct reading *new_reading;
+  subscription_t *sub;
 
   /* allocate space for the new reading */
   new_reading = memb_alloc(&readings_memb);
@@ -240,8 +702,10 @@ reading_add(sid_t sID, rimeaddr_t* owner, reading_val* value)
     }
   }
 
-  /* Initialize the type field. */
-  new_reading->type = get_subscription(sID)->type;
+  /* Initialize the type field, the one of the subscription if not given.
+     unknown on a sink that does not hold the subscription */
+  sub = get_subscription(sID);
+  new_reading->type = type != 0 ? type : sub != NULL ? sub->type : 0;
 
   new_reading->sID = sID;
 
@@ -249,6 +713,7 @@ reading_add(sid_t sID, rimeaddr_t* owner, reading_val* value)
 
   // add the new reading to the reading list
   new_reading->value = *value;
+  new_reading->time = time;
 
   /* Place the new reading on the readings list. */
   list_add(readings_list, new_reading);
@@ -270,6 +735,8 @@ get_reading_sid(sid_t sID)
     if(sID == r->sID) {
       value.value = r->value;
       value.owner = r->owner;
+      value.time = r->time;
+      value.type = r->type;
       break;
     }
   }
@@ -310,8 +777,14 @@ get_mapping(sensor_t type)
 void
 sensor_add(mapping_t* sensor)
 {
+	struct sensor *s;
+
 	list_add(sensors_list, memb_alloc(&sensors_memb));
-	((struct sensor*)list_tail(sensors_list))->mapping = sensor;
+	s = list_tail(sensors_list);
+	s->mapping = sensor;
+	s->busy = 0;
+	s->waiting = 0;
+	s->valid = 0;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -321,6 +794,8 @@ sensors_init()
 {
   memb_init(&sensors_memb);
   list_init(sensors_list);
+  memb_init(&samplers_memb);
+  list_init(samplers_list);
     /* Initialize the memory for the reading entries. */
   memb_init(&readings_memb);
   /* Initialize the list used for the sensor readings. */
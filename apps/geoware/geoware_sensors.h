@@ -9,7 +9,15 @@
 #define SENSOR_CREATE(name, strname, type, func)    \
   const uint8_t name = __COUNTER__/2 + 1; \
   mapping_t sensor_##name = {__COUNTER__/2 + 1, strname, type , \
-    (void (*)())func}
+    (void (*)())func, NULL}
+
+// a split-phase sensor: start(type) begins a conversion and returns at once,
+// the driver then calls sensor_done() with the value or sensor_failed(), from
+// a process or a ctimer, not from an interrupt handler
+#define SENSOR_CREATE_ASYNC(name, strname, type, start)    \
+  const uint8_t name = __COUNTER__/2 + 1; \
+  mapping_t sensor_##name = {__COUNTER__/2 + 1, strname, type , NULL, \
+    start}
 
 #define sensor_init(name) \
   sensor_add(&sensor_##name)
@@ -20,7 +28,9 @@
 // without creating a header just for this..
 typedef uint16_t sid_t;
 
-enum reading_types { UINT8, UINT16, UINT32, FLOAT };
+/* a BLOB sensor is read with uint16_t read(uint8_t *buf, uint16_t max),
+   returning how many bytes it put in buf */
+enum reading_types { UINT8, UINT16, UINT32, FLOAT, BLOB };
 typedef uint8_t reading_t;
 typedef uint8_t sensor_t;
 
@@ -34,6 +44,8 @@ typedef union {
 typedef struct {
   rimeaddr_t owner;
   reading_val value;
+  uint32_t time;    /* network time it was sampled at, in clock ticks */
+  sensor_t type;
 } reading_owned;
 
 typedef struct {
@@ -41,17 +53,36 @@ typedef struct {
   const char* strname;
   reading_t r;
   void (*read)();
+  void (*start)(sensor_t type);
 } mapping_t;
 
+struct subscription;
+
 struct sensor {
   struct sensor *next;
   mapping_t *mapping;
+
+  /* -> busy is set while a split-phase sensor converts, ->waiting if a
+     sampler waits for the result. ->timeout gives up on the conversion */
+  uint8_t busy;
+  uint8_t waiting;
+  struct ctimer timeout;
+
+  /* -> last holds the last value of a split-phase sensor, if ->valid, and
+     ->time the clock_time() its conversion was done at */
+  reading_val last;
+  clock_time_t time;
+  uint8_t valid;
 };
 
 void sensors_init();
 void remove_reading_type(sensor_t t);
 void remove_reading_sid(sid_t sID);
-void sensor_read(void *s);
+uint8_t sensor_sample(sensor_t type, reading_val *value);
+void sensor_done(sensor_t type, reading_val *value);
+void sensor_failed(sensor_t type);
+void sampler_add(struct subscription *s);
+void sampler_update(sensor_t type);
 void sensor_add(mapping_t* sensor);
 reading_val get_reading_type(sensor_t t);
 reading_owned get_reading_sid(sid_t sID);
@@ -0,0 +1,167 @@
+#include "contiki.h"
+
+#include <stdio.h> /* For printf() */
+
+#include "geoware.h"
+
+/* Uncomment below line to include debug output */
+#define DEBUG_PRINTS
+
+#ifdef DEBUG_PRINTS
+#define debug_printf printf
+#else
+#define debug_printf(format, args...)
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* This structure holds the last reading of one source stored under a
+   sensor type and key, at the home of the key or as one of its replicas. */
+struct stored {
+  /* The ->next pointer is needed since we are placing these
+     on a Contiki list. */
+  struct stored *next;
+
+  /* -> type and ->key name the data the reading is stored under */
+  sensor_t type;
+  uint8_t key;
+
+  /* -> source holds the address of the node the reading is from */
+  rimeaddr_t source;
+
+  reading_val value;
+
+  /* -> timestamp holds when the reading was stored, it is soft state and
+     forgotten GHT_TIMEOUT seconds later */
+  uint32_t timestamp;
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   stored readings. */
+MEMB(stored_memb, struct stored, GHT_MAX);
+
+/* The stored_list is a Contiki list that holds the stored readings. */
+LIST(stored_list);
+
+/*---------------------------------------------------------------------------*/
+
+void
+ght_init()
+{
+  memb_init(&stored_memb);
+  list_init(stored_list);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function hashes a sensor type and key to the point in the field
+ * where their readings are stored. The upper bits of the product depend on
+ * all bits of both.
+ */
+pos_t
+ght_point(sensor_t type, uint8_t key)
+{
+  uint32_t h = (((uint32_t)type << 8) | key) * 2654435761UL;
+  pos_t point;
+
+  point.x = (float)((h >> 16) & 0xff) * GHT_FIELD_WIDTH / 256;
+  point.y = (float)(h >> 24) * GHT_FIELD_HEIGHT / 256;
+
+  return point;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function drops stored readings older than GHT_TIMEOUT. */
+static void
+purge_stored()
+{
+  struct stored *s;
+  struct stored *next;
+
+  for(s = list_head(stored_list); s != NULL; s = next) {
+    next = list_item_next(s);
+
+    if(clock_seconds() - s->timestamp > GHT_TIMEOUT) {
+      list_remove(stored_list, s);
+      memb_free(&stored_memb, s);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function stores a reading under type and key, replacing the last one
+ * of the same source. If the table is full the oldest reading goes.
+ */
+void
+ght_store(sensor_t type, uint8_t key, const rimeaddr_t *source, \
+          reading_val *value)
+{
+  struct stored *s;
+  struct stored *oldest;
+
+  purge_stored();
+
+  for(s = list_head(stored_list); s != NULL; s = list_item_next(s)) {
+    if(s->type == type && s->key == key && rimeaddr_cmp(&s->source, source)) {
+      break;
+    }
+  }
+
+  if(s == NULL && (s = memb_alloc(&stored_memb)) == NULL) {
+    oldest = list_head(stored_list);
+    for(s = oldest; s != NULL; s = list_item_next(s)) {
+      if(s->timestamp < oldest->timestamp) {
+        oldest = s;
+      }
+    }
+
+    if(oldest == NULL) {
+      return;
+    }
+
+    list_remove(stored_list, oldest);
+    s = oldest;
+  }
+
+  s->type = type;
+  s->key = key;
+  rimeaddr_copy(&s->source, source);
+  s->value = *value;
+  s->timestamp = clock_seconds();
+
+  /* list_add() moves an entry already on the list to its end */
+  list_add(stored_list, s);
+
+  debug_printf("stored reading of type %d key %d from %d.%d\n", type, key, \
+    source->u8[0], source->u8[1]);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function finds the i-th reading stored under type and key. Returns
+ * 0 if there are no more.
+ */
+uint8_t
+ght_lookup(sensor_t type, uint8_t key, uint8_t i, rimeaddr_t *source, \
+           reading_val *value)
+{
+  struct stored *s;
+
+  purge_stored();
+
+  for(s = list_head(stored_list); s != NULL; s = list_item_next(s)) {
+    if(s->type != type || s->key != key) {
+      continue;
+    }
+
+    if(i-- == 0) {
+      rimeaddr_copy(source, &s->source);
+      *value = s->value;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
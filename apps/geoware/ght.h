@@ -0,0 +1,18 @@
+#ifndef GHT_H
+#define GHT_H
+
+#include <stdint.h>
+
+#include "net/rime.h"
+
+#include "geo.h"
+#include "geoware_sensors.h"
+
+void ght_init();
+pos_t ght_point(sensor_t type, uint8_t key);
+void ght_store(sensor_t type, uint8_t key, const rimeaddr_t *source, \
+               reading_val *value);
+uint8_t ght_lookup(sensor_t type, uint8_t key, uint8_t i, \
+                   rimeaddr_t *source, reading_val *value);
+
+#endif
@@ -0,0 +1,271 @@
+#include "contiki.h"
+#include "cfs/cfs.h"
+
+#include <stdio.h> /* For printf() and sprintf() */
+
+#include "geoware.h"
+
+/*---------------------------------------------------------------------------*/
+/* This structure is one sample in the log. */
+struct history_rec {
+  /* -> time holds clock_seconds() when the sample was taken */
+  uint32_t time;
+  reading_val value;
+  sensor_t type;
+};
+
+/* The log is a ring of HISTORY_PAGES files, the samples are appended to
+   the current one. This is the time index of each page. */
+static struct {
+  uint32_t first;
+  uint32_t last;
+  uint16_t count;
+} pages[HISTORY_PAGES];
+
+static uint8_t current;
+
+/* The scan of the log in progress: what to look for and what was found. */
+static struct {
+  sensor_t type;
+  uint32_t from;
+  uint32_t to;
+  uint16_t skip;      /**< Matching samples to pass over. */
+  uint8_t aggr;
+  uint16_t count;
+  float result;
+  reading_val value;
+  uint32_t time;
+} scan;
+
+/*---------------------------------------------------------------------------*/
+
+static void
+page_name(uint8_t page, char *name)
+{
+  sprintf(name, "hist%u", page);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * clock_seconds() restarts at boot, so the samples of an earlier run
+ * cannot be placed in time and the log starts empty.
+ */
+void
+history_init()
+{
+#if GEOWARE_FLASH_LOG
+  char name[8];
+  uint8_t i;
+
+  for(i = 0; i < HISTORY_PAGES; i++) {
+    page_name(i, name);
+    cfs_remove(name);
+    pages[i].count = 0;
+  }
+  current = 0;
+#endif /* GEOWARE_FLASH_LOG */
+}
+
+/*---------------------------------------------------------------------------*/
+/* Append a sample of sensor type taken now to the log. Once the current
+   page is full the oldest one is started over. */
+void
+history_append(sensor_t type, reading_val *value)
+{
+  struct history_rec rec;
+  char name[8];
+  int fd;
+
+  if(pages[current].count >= HISTORY_PAGE_RECORDS) {
+    current = (current + 1) % HISTORY_PAGES;
+    page_name(current, name);
+    cfs_remove(name);
+    pages[current].count = 0;
+  }
+
+  rec.time = clock_seconds();
+  rec.value = *value;
+  rec.type = type;
+
+  page_name(current, name);
+  fd = cfs_open(name, CFS_WRITE | CFS_APPEND);
+  if(fd < 0) {
+    printf("history: cannot open %s\n", name);
+    return;
+  }
+
+  if(cfs_write(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+    if(pages[current].count++ == 0) {
+      pages[current].first = rec.time;
+    }
+    pages[current].last = rec.time;
+  }
+
+  cfs_close(fd);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static float
+value_float(mapping_t *mapping, reading_val *value)
+{
+  switch(mapping->r) {
+    case UINT8:
+      return value->ui8;
+    case UINT16:
+      return value->ui16;
+    case UINT32:
+      return value->ui32;
+    default:
+      return value->fl;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void
+float_value(mapping_t *mapping, float f, reading_val *value)
+{
+  switch(mapping->r) {
+    case UINT8:
+      value->ui8 = (uint8_t)(f + 0.5);
+      break;
+    case UINT16:
+      value->ui16 = (uint16_t)(f + 0.5);
+      break;
+    case UINT32:
+      value->ui32 = (uint32_t)(f + 0.5);
+      break;
+    default:
+      value->fl = f;
+      break;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function goes through the samples matching the scan oldest first,
+ * reading only the pages whose time index overlaps it. With aggr set it
+ * folds them into scan.result, otherwise it stops at the one after
+ * scan.skip others. Returns the number of samples matched.
+ */
+static uint16_t
+history_scan(mapping_t *mapping)
+{
+  struct history_rec rec;
+  char name[8];
+  uint8_t i;
+  uint8_t page;
+  int fd;
+  float f;
+
+  scan.count = 0;
+
+  for(i = 1; i <= HISTORY_PAGES; i++) {
+    page = (current + i) % HISTORY_PAGES;
+
+    if(pages[page].count == 0 || pages[page].last < scan.from || \
+        pages[page].first > scan.to) {
+      continue;
+    }
+
+    page_name(page, name);
+    if((fd = cfs_open(name, CFS_READ)) < 0) {
+      continue;
+    }
+
+    while(cfs_read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+      if(rec.type != scan.type || rec.time < scan.from || rec.time > scan.to) {
+        continue;
+      }
+
+      if(scan.aggr == HISTORY_RAW) {
+        if(scan.count++ == scan.skip) {
+          scan.value = rec.value;
+          scan.time = rec.time;
+          cfs_close(fd);
+          return scan.count;
+        }
+        continue;
+      }
+
+      f = value_float(mapping, &rec.value);
+      if(scan.count++ == 0) {
+        scan.result = f;
+      }
+      else if(scan.aggr == HISTORY_MIN) {
+        scan.result = f < scan.result ? f : scan.result;
+      }
+      else if(scan.aggr == HISTORY_MAX) {
+        scan.result = f > scan.result ? f : scan.result;
+      }
+      else {
+        scan.result += f;
+      }
+    }
+
+    cfs_close(fd);
+  }
+
+  return scan.count;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Find the i-th sample of sensor type taken between the times from and to,
+ * oldest first, and the clock_seconds() it was taken at. Returns 0 if there
+ * are not that many.
+ */
+uint8_t
+history_get(sensor_t type, uint32_t from, uint32_t to, uint16_t i, \
+            reading_val *value, uint32_t *time)
+{
+  scan.type = type;
+  scan.from = from;
+  scan.to = to;
+  scan.skip = i;
+  scan.aggr = HISTORY_RAW;
+
+  if(history_scan(get_mapping(type)) <= i) {
+    return 0;
+  }
+
+  *value = scan.value;
+  *time = scan.time;
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Work out the minimum, maximum or average of the samples of sensor type
+ * taken between the times from and to. Returns the number of samples, the
+ * result is only set if there were any.
+ */
+uint16_t
+history_aggregate(sensor_t type, uint32_t from, uint32_t to, uint8_t aggr, \
+                  reading_val *result)
+{
+  mapping_t *mapping = get_mapping(type);
+
+  if(mapping == NULL) {
+    return 0;
+  }
+
+  scan.type = type;
+  scan.from = from;
+  scan.to = to;
+  scan.aggr = aggr;
+
+  if(history_scan(mapping) == 0) {
+    return 0;
+  }
+
+  if(aggr == HISTORY_AVG) {
+    scan.result /= scan.count;
+  }
+  float_value(mapping, scan.result, result);
+
+  return scan.count;
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,23 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#include "geoware_sensors.h"
+
+/* what a history query asks for */
+enum {
+  HISTORY_RAW,
+  HISTORY_MIN,
+  HISTORY_MAX,
+  HISTORY_AVG
+};
+
+void history_init();
+void history_append(sensor_t type, reading_val *value);
+uint8_t history_get(sensor_t type, uint32_t from, uint32_t to, uint16_t i, \
+                    reading_val *value, uint32_t *time);
+uint16_t history_aggregate(sensor_t type, uint32_t from, uint32_t to, \
+                           uint8_t aggr, reading_val *result);
+
+#endif
@@ -0,0 +1,325 @@
+#include "contiki.h"
+#include "cfs/cfs.h"
+
+#include <stdio.h> /* For printf() */
+#include <string.h> /* For memcpy */
+
+#include "geoware.h"
+
+/* Uncomment below line to include debug output */
+#define DEBUG_PRINTS
+
+#ifdef DEBUG_PRINTS
+#define debug_printf printf
+#else
+#define debug_printf(format, args...)
+#endif
+
+#define SPILL_FILE "outbox"
+
+/* The packets we hold, readings of every kind. */
+union held_pkt {
+  reading_pkt_t reading;
+  shared_reading_pkt_t shared;
+  knn_reply_pkt_t knn_reply;
+  ght_pkt_t ght;
+  vector_reading_pkt_t vector;
+};
+
+/*---------------------------------------------------------------------------*/
+/* This structure holds a reading we could not pass on, until a route to its
+   destination reappears. */
+struct held {
+  /* The ->next pointer is needed since we are placing these
+     on a Contiki list. */
+  struct held *next;
+
+  /* -> originator holds the node that sent the reading, it is sent on in
+     its name */
+  rimeaddr_t originator;
+
+  /* -> timestamp holds when we took the reading in */
+  uint32_t timestamp;
+
+  /* -> priority holds how much the reading is worth keeping, answers to
+     snapshot, history and kNN queries go first when the outbox fills and
+     are dropped once the querier stopped waiting for them */
+  uint8_t priority;
+
+  uint8_t len;
+  uint8_t data[sizeof(union held_pkt)];
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   held readings. */
+MEMB(held_memb, struct held, OUTBOX_MAX);
+
+/* The held_list is a Contiki list that holds the readings, oldest first. */
+LIST(held_list);
+
+#if GEOWARE_OUTBOX_SPILL
+/* The readings spilled to flash are older than the ones in RAM. They are
+   read back from spill_next on, the file is removed once it is drained.
+   The ones before spill_boot were spilled before we rebooted. */
+static uint16_t spill_num;
+static uint16_t spill_next;
+static uint16_t spill_boot;
+static struct held spilled;
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+/*---------------------------------------------------------------------------*/
+/*
+ * The spilled readings are kept across reboots, but clock_seconds() restarts
+ * and their timestamps cannot be compared any more. Answers among them are
+ * dropped, their querier is long gone.
+ */
+void
+outbox_init()
+{
+#if GEOWARE_OUTBOX_SPILL
+  int fd;
+
+  spill_num = 0;
+  spill_next = 0;
+
+  if((fd = cfs_open(SPILL_FILE, CFS_READ)) >= 0) {
+    spill_num = cfs_seek(fd, 0, CFS_SEEK_END) / sizeof(struct held);
+    cfs_close(fd);
+  }
+  spill_boot = spill_num;
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+  memb_init(&held_memb);
+  list_init(held_list);
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Answers to queries are worth less than the readings of a subscription. */
+static uint8_t
+priority(const geoware_hdr_t *hdr)
+{
+  if(hdr->type == GEOWARE_KNN_REPLY || \
+      (hdr->type == GEOWARE_READING && hdr->len == READING_ANSWER)) {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+#if GEOWARE_OUTBOX_SPILL
+/* This function moves a held reading to the spill file. Returns 0 if the
+   file is full or cannot be written. */
+static uint8_t
+spill(struct held *h)
+{
+  int fd;
+  int written;
+
+  if(spill_num >= OUTBOX_SPILL_MAX) {
+    return 0;
+  }
+
+  if((fd = cfs_open(SPILL_FILE, CFS_WRITE | CFS_APPEND)) < 0) {
+    return 0;
+  }
+  written = cfs_write(fd, h, sizeof(struct held));
+  cfs_close(fd);
+
+  if(written != sizeof(struct held)) {
+    return 0;
+  }
+
+  spill_num++;
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function passes over the oldest spilled reading, the file is removed
+   once all are read back. */
+static void
+spill_skip()
+{
+  if(++spill_next == spill_num) {
+    spill_next = spill_num = spill_boot = 0;
+    cfs_remove(SPILL_FILE);
+  }
+}
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function makes room for a reading of the given priority. The oldest
+ * reading in RAM is spilled to flash if there is room there, otherwise the
+ * oldest of the lowest priority is dropped. Returns NULL if all held
+ * readings are worth more than the new one.
+ */
+static struct held *
+evict(uint8_t prio)
+{
+  struct held *h;
+  struct held *victim = NULL;
+
+#if GEOWARE_OUTBOX_SPILL
+  if((h = list_head(held_list)) != NULL && spill(h)) {
+    list_remove(held_list, h);
+    return h;
+  }
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+  for(h = list_head(held_list); h != NULL; h = list_item_next(h)) {
+    if(h->priority <= prio && (victim == NULL || \
+        h->priority < victim->priority)) {
+      victim = h;
+    }
+  }
+
+  if(victim != NULL) {
+    printf("outbox full, dropping a reading held since %lu\n", \
+      victim->timestamp);
+    list_remove(held_list, victim);
+  }
+
+  return victim;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Hold a reading we could not pass on. Other packets are not held. Returns
+ * 0 if it was not taken in.
+ */
+uint8_t
+outbox_add(const void *pkt, uint8_t len, const rimeaddr_t *originator)
+{
+  struct held *h;
+  uint8_t type = ((geoware_hdr_t*)pkt)->type;
+  uint8_t prio = priority((geoware_hdr_t*)pkt);
+
+  if((type != GEOWARE_READING && type != GEOWARE_SHARED_READING && \
+      type != GEOWARE_KNN_REPLY && type != GEOWARE_GHT_STORE && \
+      type != GEOWARE_VECTOR_READING) || \
+      len > sizeof(union held_pkt)) {
+    return 0;
+  }
+
+  if((h = memb_alloc(&held_memb)) == NULL && (h = evict(prio)) == NULL) {
+    printf("outbox full, dropping reading\n");
+    return 0;
+  }
+
+  rimeaddr_copy(&h->originator, originator);
+  h->timestamp = clock_seconds();
+  h->priority = prio;
+  h->len = len;
+  memcpy(h->data, pkt, len);
+
+  list_add(held_list, h);
+
+  debug_printf("holding reading from %d.%d, %d held\n", \
+    originator->u8[0], originator->u8[1], list_length(held_list));
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* This function returns the oldest held reading, from flash or from RAM,
+   without taking it out. Answers the querier stopped waiting for are
+   dropped on the way. */
+static struct held *
+oldest()
+{
+  struct held *h;
+
+#if GEOWARE_OUTBOX_SPILL
+  int fd;
+
+  while(spill_next < spill_num) {
+    if((fd = cfs_open(SPILL_FILE, CFS_READ)) < 0) {
+      spill_next = spill_num = spill_boot = 0;
+      break;
+    }
+
+    cfs_seek(fd, spill_next * sizeof(struct held), CFS_SEEK_SET);
+    if(cfs_read(fd, &spilled, sizeof(struct held)) != sizeof(struct held)) {
+      cfs_close(fd);
+
+      /* the file is cut short, forget it */
+      spill_next = spill_num = spill_boot = 0;
+      cfs_remove(SPILL_FILE);
+      break;
+    }
+    cfs_close(fd);
+
+    if(spilled.priority > 0 || (spill_next >= spill_boot && \
+        clock_seconds() - spilled.timestamp <= SNAPSHOT_LEASE)) {
+      return &spilled;
+    }
+    spill_skip();
+  }
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+  while((h = list_head(held_list)) != NULL && h->priority == 0 && \
+      clock_seconds() - h->timestamp > SNAPSHOT_LEASE) {
+    list_remove(held_list, h);
+    memb_free(&held_memb, h);
+  }
+
+  return h;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Copy the oldest held reading to the packet buffer. Returns 0 if we hold
+ * none.
+ */
+uint8_t
+outbox_peek(rimeaddr_t *originator)
+{
+  struct held *h = oldest();
+
+  if(h == NULL) {
+    return 0;
+  }
+
+  packetbuf_copyfrom(h->data, h->len);
+  rimeaddr_copy(originator, &h->originator);
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Take out the oldest held reading, once it is sent on. */
+void
+outbox_pop()
+{
+  struct held *h;
+
+#if GEOWARE_OUTBOX_SPILL
+  if(spill_next < spill_num) {
+    spill_skip();
+    return;
+  }
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+  if((h = list_head(held_list)) != NULL) {
+    list_remove(held_list, h);
+    memb_free(&held_memb, h);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t
+outbox_empty()
+{
+#if GEOWARE_OUTBOX_SPILL
+  if(spill_next < spill_num) {
+    return 0;
+  }
+#endif /* GEOWARE_OUTBOX_SPILL */
+
+  return list_head(held_list) == NULL;
+}
+
+/*---------------------------------------------------------------------------*/
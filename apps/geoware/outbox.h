@@ -0,0 +1,14 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+
+#include "net/rime.h"
+
+void outbox_init();
+uint8_t outbox_add(const void *pkt, uint8_t len, const rimeaddr_t *originator);
+uint8_t outbox_peek(rimeaddr_t *originator);
+void outbox_pop();
+uint8_t outbox_empty();
+
+#endif
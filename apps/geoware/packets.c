@@ -1,57 +1,115 @@
+#include <string.h> /* For memcpy */
+
 #include "geoware.h"
 
 /*---------------------------------------------------------------------------*/
 
-void
-process_subscription(subscription_pkt_t *sub_pkt)
+/*
+ * Take part in a subscription we have not heard of before: add it if we are
+ * in its region, or remember it as seen if a neighbor could be. Returns 1 if
+ * the subscription has to be passed on.
+ */
+static uint8_t
+take_subscription(subscription_t *subscription)
 {
   struct neighbor *n;
 
+  /* check if we are in the region of interest */
+  if (region_contains(&subscription->region, own_pos)) {
+    /* add the subscription */
+    // TODO: what if we dont support the given sensor type?
+    // TODO: what if we didnt have enough space to add new subscription but 
+    // would like to forward?
+    return add_subscription(subscription) != NULL;
+  }
+
+  /* check if we know any neighbors that could be in the region of 
+     the interest */
+  for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+    if(region_contains(&subscription->region, neighbor_pos(n))) {
+      break;
+    }
+  }
+
+  if(n == NULL) {
+    return 0;
+  }
+
+  /* add subscription to the seen list */
+  add_seen_sub(subscription->subscription_hdr.sID, subscription->lease);
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_subscription(subscription_pkt_t *sub_pkt)
+{
   subscription_t *subscription = &sub_pkt->subscription;
 
+  if(!region_valid(&subscription->region)) {
+    return;
+  }
+
   /* check if we are already subscribed or already seen this subscription */
   if(is_subscribed(subscription->subscription_hdr.sID) || \
       was_seen(subscription->subscription_hdr.sID)) {
+    flood_heard(GEOWARE_SUBSCRIPTION, subscription->subscription_hdr.sID);
     return;
   }
 
-  /* check if we are in the region of interest */
-  if (distance(own_pos, subscription->center) <= subscription->radius) {
-    /* add the subscription */
-    // TODO: what if we dont support the given sensor type?
-    subscription_t *new_sub = add_subscription(subscription);
+  // rebroadcast
+  // posting synchronously to avoid having to copy buffers
+  printf("firework: %s\n", sub_pkt->hdr.firewrk ? "true" : "false");
+  if(take_subscription(subscription) && sub_pkt->hdr.firewrk) {
+    process_post_synch(&broadcast_process, broadcast_subscription_event, \
+      (void*)sub_pkt);
+  }
+}
 
-    // rebroadcast
-    // TODO: only if we havent previously requested
-    // TODO: what if we didnt have enough space to add new subscription but 
-    // would like to forward?
-    // posting synchronously to avoid having to copy buffers
-    printf("firework: %s\n", sub_pkt->hdr.firewrk ? "true" : "false");
-    if(new_sub != NULL && sub_pkt->hdr.firewrk) {
-      process_post_synch(&broadcast_process, broadcast_subscription_event, \
-        (void*)sub_pkt);
-    }
+/*---------------------------------------------------------------------------*/
+
+void
+process_subscription_batch(subscription_batch_pkt_t *batch_pkt)
+{
+  subscription_t *sub;
+  uint8_t relay = 0;
+  uint8_t i;
+
+  /* the first region is the one the batch is flooded over */
+  if(!region_valid(&batch_pkt->subs[0].region)) {
+    return;
   }
-  else {
-    /* check if we know any neighbors that could be in the region of 
-       the interest */
-    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
-      /* find the distance to the center of interest for current neighbor */
-      float tmp_dist = distance(n->pos[0], subscription->center);
 
-      if(tmp_dist <= subscription->radius) {
-        break;
-      }
+  for(i = 0; i < batch_pkt->hdr.len && i < SUBSCRIPTION_BATCH_MAX; i++) {
+    sub = &batch_pkt->subs[i];
+
+    if(!region_valid(&sub->region) || \
+        is_subscribed(sub->subscription_hdr.sID) || \
+        was_seen(sub->subscription_hdr.sID)) {
+      continue;
     }
 
-    if(n != NULL) {
-      /* add subscription to the seen list */
-      add_seen_sub(subscription->subscription_hdr.sID);
-      
-      process_post_synch(&broadcast_process, broadcast_subscription_event, \
-        (void*)sub_pkt);
+    if(take_subscription(sub)) {
+      relay = 1;
     }
   }
+
+  /* we pass the batch on if any of its subscriptions is new to us and
+     reaches us or a neighbor, the ones we know are skipped downstream */
+  if(!batch_pkt->hdr.firewrk) {
+    return;
+  }
+
+  if(!relay) {
+    flood_heard(GEOWARE_SUBSCRIPTION_BATCH, \
+      batch_pkt->subs[0].subscription_hdr.sID);
+    return;
+  }
+
+  process_post_synch(&broadcast_process, broadcast_subscription_batch_event, \
+    (void*)batch_pkt);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -59,6 +117,10 @@ process_subscription(subscription_pkt_t *sub_pkt)
 void
 process_unsubscription(unsubscription_pkt_t *unsub_pkt)
 {
+  if(!region_valid(&unsub_pkt->region)) {
+    return;
+  }
+
   // check if we are in the region of interest
   // if (distance(own_pos, unsubscription_pkt->center) > unsubscription_pkt->radius) {
   //   return;
@@ -70,6 +132,7 @@ process_unsubscription(unsubscription_pkt_t *unsub_pkt)
   if(is_subscribed(unsub_pkt->sID)) {
     /* Remove the subscription */
     remove_subscription(unsub_pkt->sID);
+    route_remove(unsub_pkt->sID);
 
     if(unsub_pkt->hdr.firewrk) {
       process_post_synch(&broadcast_process, broadcast_unsubscription_event, \
@@ -78,12 +141,183 @@ process_unsubscription(unsubscription_pkt_t *unsub_pkt)
   }
   else if(was_seen(unsub_pkt->sID)) {
     remove_seen_sub(unsub_pkt->sID);
+    route_remove(unsub_pkt->sID);
 
     if(unsub_pkt->hdr.firewrk) {
       process_post_synch(&broadcast_process, broadcast_unsubscription_event, \
         (void*)unsub_pkt);
     }
   }
+  else {
+    flood_heard(GEOWARE_UNSUBSCRIPTION, unsub_pkt->sID);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_owner_update(owner_update_pkt_t *update_pkt)
+{
+  subscription_t *sub;
+
+  if(!region_valid(&update_pkt->region)) {
+    return;
+  }
+
+  /* pass on every update only once, this also makes sure an older update
+     arriving late does not move the owner back */
+  if(!owner_update_is_new(update_pkt->sID, update_pkt->seq)) {
+    flood_heard(GEOWARE_OWNER_UPDATE, update_pkt->sID);
+    return;
+  }
+
+  if((sub = get_subscription(update_pkt->sID)) != NULL) {
+    /* send our readings to where the owner is now */
+    sub->subscription_hdr.owner_pos = update_pkt->owner_pos;
+  }
+
+  if(update_pkt->hdr.firewrk) {
+    process_post_synch(&broadcast_process, broadcast_owner_update_event, \
+      (void*)update_pkt);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_refresh(refresh_pkt_t *refresh_pkt)
+{
+  if(!region_valid(&refresh_pkt->region)) {
+    return;
+  }
+
+  /* renews the lease, every refresh is passed on only once */
+  if(!refresh_is_new(refresh_pkt->sID, refresh_pkt->epoch)) {
+    flood_heard(GEOWARE_REFRESH, refresh_pkt->sID);
+    return;
+  }
+
+  if(refresh_pkt->hdr.firewrk) {
+    process_post_synch(&broadcast_process, broadcast_refresh_event, \
+      (void*)refresh_pkt);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_subscription_update(subscription_update_pkt_t *update_pkt)
+{
+  struct neighbor *n;
+  subscription_t *update = &update_pkt->subscription;
+  sid_t sID = update->subscription_hdr.sID;
+  uint8_t inside;
+
+  if(!region_valid(&update->region)) {
+    return;
+  }
+  inside = region_contains(&update->region, own_pos);
+
+  if(is_subscribed(sID) || was_seen(sID)) {
+    /* pass on every update only once */
+    if(!subscription_update_is_new(sID, update_pkt->version)) {
+      flood_heard(GEOWARE_SUBSCRIPTION_UPDATE, sID);
+      return;
+    }
+
+    if(is_subscribed(sID)) {
+      if(inside) {
+        modify_subscription(update, update_pkt->changes);
+      }
+      else {
+        /* the region shrunk and left us out */
+        leave_subscription(sID);
+      }
+    }
+    else if(inside) {
+      /* the region grew to include us */
+      remove_seen_sub(sID);
+      if(add_subscription(update) != NULL) {
+        subscription_set_version(sID, update_pkt->version);
+      }
+    }
+
+    if(update_pkt->hdr.firewrk) {
+      process_post_synch(&broadcast_process, \
+        broadcast_subscription_update_event, (void*)update_pkt);
+    }
+    return;
+  }
+
+  /* we did not know the subscription, check if it reaches us now */
+  if(inside) {
+    if(add_subscription(update) == NULL) {
+      return;
+    }
+  }
+  else {
+    /* check if we know any neighbors that could be in the area the update
+       has to reach */
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      if(distance(neighbor_pos(n), update_pkt->reach_center) <= \
+          update_pkt->reach_radius) {
+        break;
+      }
+    }
+
+    if(n == NULL || add_seen_sub(sID, update->lease) == 0) {
+      return;
+    }
+  }
+
+  subscription_set_version(sID, update_pkt->version);
+
+  if(update_pkt->hdr.firewrk) {
+    process_post_synch(&broadcast_process, \
+      broadcast_subscription_update_event, (void*)update_pkt);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_snapshot(snapshot_pkt_t *snapshot_pkt)
+{
+  struct neighbor *n;
+  sid_t qID = snapshot_pkt->query_hdr.sID;
+
+  if(!region_valid(&snapshot_pkt->region)) {
+    return;
+  }
+
+  /* the seen list is all a snapshot leaves behind, for SNAPSHOT_LEASE */
+  if(was_seen(qID) || is_subscribed(qID)) {
+    flood_heard(GEOWARE_SNAPSHOT, qID);
+    return;
+  }
+
+  if(region_contains(&snapshot_pkt->region, own_pos)) {
+    answer_snapshot(snapshot_pkt);
+  }
+  else {
+    /* check if we know any neighbors that could be in the region */
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      if(region_contains(&snapshot_pkt->region, neighbor_pos(n))) {
+        break;
+      }
+    }
+
+    if(n == NULL) {
+      return;
+    }
+  }
+
+  add_seen_sub(qID, SNAPSHOT_LEASE);
+
+  if(snapshot_pkt->hdr.firewrk) {
+    process_post_synch(&broadcast_process, broadcast_snapshot_event, \
+      (void*)snapshot_pkt);
+  }
 }
 
 /*---------------------------------------------------------------------------*/
@@ -107,6 +341,123 @@ prepare_sub_pkt(subscription_pkt_t *sub_pkt, sid_t sID)
 
 /*---------------------------------------------------------------------------*/
 
+void
+prepare_sub_batch_pkt(subscription_batch_pkt_t *batch_pkt)
+{
+  batch_pkt->hdr.ver = GEOWARE_VERSION;
+  batch_pkt->hdr.type = GEOWARE_SUBSCRIPTION_BATCH;
+  batch_pkt->hdr.len = 0;
+  batch_pkt->hdr.pos = own_pos;
+  batch_pkt->hdr.firewrk = 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Append subscription sID to the batch. Returns 0 if it is full. */
+uint8_t
+sub_batch_add(subscription_batch_pkt_t *batch_pkt, sid_t sID)
+{
+  subscription_t *sub = get_subscription(sID);
+
+  if(sub == NULL || batch_pkt->hdr.len >= SUBSCRIPTION_BATCH_MAX) {
+    return 0;
+  }
+
+  batch_pkt->subs[batch_pkt->hdr.len++] = *sub;
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_history(history_pkt_t *history_pkt)
+{
+  struct neighbor *n;
+  sid_t qID = history_pkt->query_hdr.sID;
+
+  if(!region_valid(&history_pkt->region)) {
+    return;
+  }
+
+  if(was_seen(qID) || is_subscribed(qID)) {
+    flood_heard(GEOWARE_HISTORY, qID);
+    return;
+  }
+
+  if(region_contains(&history_pkt->region, own_pos)) {
+    answer_history(history_pkt);
+  }
+  else {
+    /* check if we know any neighbors that could be in the region */
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      if(region_contains(&history_pkt->region, neighbor_pos(n))) {
+        break;
+      }
+    }
+
+    if(n == NULL) {
+      return;
+    }
+  }
+
+  add_seen_sub(qID, SNAPSHOT_LEASE);
+
+  if(history_pkt->hdr.firewrk) {
+    process_post_synch(&broadcast_process, broadcast_history_event, \
+      (void*)history_pkt);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+process_knn(knn_pkt_t *knn_pkt)
+{
+  struct neighbor *n;
+  sid_t rID = knn_pkt->home_hdr.sID;
+  float dist;
+
+  /* still on the way to the point and no one is nearer to it than us */
+  if(!knn_pkt->hdr.firewrk) {
+    knn_home(knn_pkt);
+    return;
+  }
+
+  /* pass on every ring only once */
+  if(!was_seen(rID) && add_seen_sub(rID, SNAPSHOT_LEASE) == 0) {
+    return;
+  }
+  if(!subscription_update_is_new(rID, knn_pkt->ring)) {
+    flood_heard(GEOWARE_KNN, rID);
+    return;
+  }
+
+  dist = distance(own_pos, knn_pkt->point);
+
+  if(dist <= knn_pkt->outer) {
+    /* the nodes within the inner radius answered an earlier ring */
+    if(dist > knn_pkt->inner) {
+      answer_knn(knn_pkt);
+    }
+  }
+  else {
+    /* check if we know any neighbors that could be in the ring */
+    for(n = list_head(neighbors_list); n != NULL; n = list_item_next(n)) {
+      if(distance(neighbor_pos(n), knn_pkt->point) <= knn_pkt->outer) {
+        break;
+      }
+    }
+
+    if(n == NULL) {
+      return;
+    }
+  }
+
+  process_post_synch(&broadcast_process, broadcast_knn_event, (void*)knn_pkt);
+}
+
+/*---------------------------------------------------------------------------*/
+
 uint8_t
 prepare_unsub_pkt(unsubscription_pkt_t *unsub_pkt, sid_t sID)
 {
@@ -119,8 +470,30 @@ prepare_unsub_pkt(unsubscription_pkt_t *unsub_pkt, sid_t sID)
     unsub_pkt->hdr.pos = own_pos;
     unsub_pkt->hdr.firewrk = 1;
     unsub_pkt->sID = sub->subscription_hdr.sID;
-    unsub_pkt->center = sub->center;
-    unsub_pkt->radius = sub->radius;
+    unsub_pkt->region = sub->region;
+  }
+
+  return sub != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t
+prepare_owner_update_pkt(owner_update_pkt_t *update_pkt, sid_t sID, \
+                         uint8_t seq)
+{
+  subscription_t *sub = get_subscription(sID);
+
+  if(sub != NULL) {
+    update_pkt->hdr.ver = GEOWARE_VERSION;
+    update_pkt->hdr.type = GEOWARE_OWNER_UPDATE;
+    update_pkt->hdr.len = 0;
+    update_pkt->hdr.pos = own_pos;
+    update_pkt->hdr.firewrk = 1;
+    update_pkt->sID = sub->subscription_hdr.sID;
+    update_pkt->seq = seq;
+    update_pkt->owner_pos = sub->subscription_hdr.owner_pos;
+    update_pkt->region = sub->region;
   }
 
   return sub != NULL;
@@ -128,14 +501,149 @@ prepare_unsub_pkt(unsubscription_pkt_t *unsub_pkt, sid_t sID)
 
 /*---------------------------------------------------------------------------*/
 
+uint8_t
+prepare_refresh_pkt(refresh_pkt_t *refresh_pkt, sid_t sID)
+{
+  struct subscription *s = get_subscription_struct(sID);
+
+  if(s != NULL) {
+    refresh_pkt->hdr.ver = GEOWARE_VERSION;
+    refresh_pkt->hdr.type = GEOWARE_REFRESH;
+    refresh_pkt->hdr.len = 0;
+    refresh_pkt->hdr.pos = own_pos;
+    refresh_pkt->hdr.firewrk = 1;
+    refresh_pkt->sID = sID;
+    refresh_pkt->epoch = ++s->epoch;
+    refresh_pkt->region = s->sub.region;
+  }
+
+  return s != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t
+prepare_subscription_update_pkt(subscription_update_pkt_t *update_pkt, \
+                                sid_t sID, uint8_t changes, \
+                                pos_t reach_center, float reach_radius)
+{
+  struct subscription *s = get_subscription_struct(sID);
+
+  if(s != NULL) {
+    update_pkt->hdr.ver = GEOWARE_VERSION;
+    update_pkt->hdr.type = GEOWARE_SUBSCRIPTION_UPDATE;
+    update_pkt->hdr.len = 0;
+    update_pkt->hdr.pos = own_pos;
+    update_pkt->hdr.firewrk = 1;
+    update_pkt->version = s->version;
+    update_pkt->changes = changes;
+    update_pkt->reach_center = reach_center;
+    update_pkt->reach_radius = reach_radius;
+    update_pkt->subscription = s->sub;
+  }
+
+  return s != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
 void
 print_unsubscription(unsubscription_pkt_t *unsub_pkt)
 {
   printf("sID: %u\n", unsub_pkt->sID);
-  printf("center: ");
-  print_pos(unsub_pkt->center);
-  printf("radius: "PRINTFLOAT"\n", (long)unsub_pkt->radius, \
-    decimals(unsub_pkt->radius));
+  print_region(&unsub_pkt->region);
 }
 
-/*---------------------------------------------------------------------------*/
\ No newline at end of file
+/*---------------------------------------------------------------------------*/
+/* Bytes a value of reading type r takes in a vector reading. */
+static uint8_t
+value_size(reading_t r)
+{
+  switch(r) {
+    case UINT8:
+      return 1;
+    case UINT16:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Bytes the first n values of a vector reading take. */
+static uint8_t
+values_size(vector_reading_pkt_t *pkt, uint8_t n)
+{
+  uint8_t i;
+  uint8_t off = 0;
+
+  for(i = 0; i < n && off < sizeof(pkt->values); i++) {
+    off += 1 + value_size(pkt->values[off] >> 6);
+  }
+
+  return off;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Append the reading of sensor type to a vector reading. Returns 0 if the
+ * sensor is not known here or the packet is full.
+ */
+uint8_t
+vector_add(vector_reading_pkt_t *pkt, sensor_t type, reading_val *value)
+{
+  mapping_t *mapping = get_mapping(type);
+  uint8_t off = values_size(pkt, pkt->reading_hdr.hdr.len);
+
+  if(mapping == NULL || mapping->r == BLOB || \
+      pkt->reading_hdr.hdr.len == SUB_MAX_SENSORS || \
+      off + 1 + value_size(mapping->r) > sizeof(pkt->values)) {
+    return 0;
+  }
+
+  /* the members of the union all start at its first byte */
+  pkt->values[off] = (mapping->r << 6) | (type & 0x3f);
+  memcpy(&pkt->values[off + 1], value, value_size(mapping->r));
+  pkt->reading_hdr.hdr.len++;
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Get the i-th value of a vector reading and the sensor it was read from.
+ * Returns 0 if there are not that many.
+ */
+uint8_t
+vector_get(vector_reading_pkt_t *pkt, uint8_t i, sensor_t *type, \
+    reading_val *value)
+{
+  uint8_t off = values_size(pkt, i);
+  uint8_t size;
+
+  if(i >= pkt->reading_hdr.hdr.len || off >= sizeof(pkt->values)) {
+    return 0;
+  }
+
+  size = value_size(pkt->values[off] >> 6);
+  if(off + 1 + size > sizeof(pkt->values)) {
+    return 0;
+  }
+
+  *type = pkt->values[off] & 0x3f;
+  value->ui32 = 0;
+  memcpy(value, &pkt->values[off + 1], size);
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Length of a vector reading packet with the values it holds. */
+uint8_t
+vector_len(vector_reading_pkt_t *pkt)
+{
+  return offsetof(vector_reading_pkt_t, values) + \
+    values_size(pkt, pkt->reading_hdr.hdr.len);
+}
+
+/*---------------------------------------------------------------------------*/
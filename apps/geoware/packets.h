@@ -1,9 +1,12 @@
 #ifndef PACKETS_H
 #define PACKETS_H
 
+#include <stddef.h> /* For offsetof */
+
 #include "subscriptions.h"
 #include "geoware_sensors.h"
 #include "geo.h"
+#include "timesync.h"
 
 enum {
 	GEOWARE_RESERVED = 0,
@@ -11,20 +14,41 @@ enum {
   GEOWARE_SUBSCRIPTION,
   GEOWARE_UNSUBSCRIPTION,
 	GEOWARE_SID_DISCOVERY,
-  GEOWARE_READING
+  GEOWARE_READING,
+  GEOWARE_OWNER_UPDATE,
+  GEOWARE_REFRESH,
+  GEOWARE_SUBSCRIPTION_UPDATE,
+  GEOWARE_SUBSCRIPTION_BATCH,
+  GEOWARE_SHARED_READING,
+  GEOWARE_SNAPSHOT,
+  GEOWARE_KNN,
+  GEOWARE_KNN_REPLY,
+  GEOWARE_GHT_STORE,
+  GEOWARE_GHT_REPLICA,
+  GEOWARE_GHT_QUERY,
+  GEOWARE_HISTORY,
+  GEOWARE_VECTOR_READING,
+  GEOWARE_BLOB_FRAGMENT,
+  GEOWARE_BLOB_NACK
 };
 
 typedef struct {
   uint8_t ver  : 2;		/**< Protocol version. */
-  uint8_t type : 3;		/**< Packet type. */
-  uint8_t len  : 3;
+  uint8_t type : 5;		/**< Packet type. */
   uint8_t firewrk : 1;
+  uint8_t len  : 4;
   uint8_t cost  : 4;
   pos_t pos;
 } geoware_hdr_t;
 
 typedef struct {
 	geoware_hdr_t hdr;
+	uint8_t txpower;  /**< Radio power level the beacon was sent with. */
+	uint8_t energy;   /**< Residual energy in percent. */
+	uint8_t load;     /**< Packets queued or relayed in the last period. */
+	uint8_t marked;   /**< Backbone marker, see backbone.h. */
+	uint8_t slot;     /**< Publish slot, see pick_slot(). */
+	timesync_t sync;  /**< Network time, see timesync.c. */
 	pos_t npos[MAX_NEIGHBOR_NEIGHBORS];
 } broadcast_pkt_t;
 
@@ -33,13 +57,46 @@ typedef struct {
   subscription_t subscription;
 } subscription_pkt_t;
 
+/* Several subscriptions in one packet, hdr.len holds how many. When flooded
+   the first one gives the region, the others have to lie within it. */
+typedef struct {
+  geoware_hdr_t hdr;
+  subscription_t subs[SUBSCRIPTION_BATCH_MAX];
+} subscription_batch_pkt_t;
+
+#define SUBSCRIPTION_BATCH_LEN(n) \
+  (offsetof(subscription_batch_pkt_t, subs) + (n) * sizeof(subscription_t))
+
 typedef struct {
   geoware_hdr_t hdr;
   sid_t sID;
-  pos_t center;
-  float radius;
+  region_t region;
 } unsubscription_pkt_t;
 
+typedef struct {
+  geoware_hdr_t hdr;
+  sid_t sID;
+  uint8_t seq;      /**< Increases with every update of the owner. */
+  pos_t owner_pos;
+  region_t region;
+} owner_update_pkt_t;
+
+typedef struct {
+  geoware_hdr_t hdr;
+  sid_t sID;
+  uint8_t epoch;    /**< Increases with every refresh of the lease. */
+  region_t region;
+} refresh_pkt_t;
+
+typedef struct {
+  geoware_hdr_t hdr;
+  uint8_t version;  /**< Increases with every update of the subscription. */
+  uint8_t changes;  /**< SUB_UPDATE_* mask of what was changed. */
+  pos_t reach_center;   /**< Circle around the old and the new region. */
+  float reach_radius;
+  subscription_t subscription;
+} subscription_update_pkt_t;
+
 typedef struct {
   geoware_hdr_t hdr;
   subscription_hdr_t subscription_hdr;
@@ -48,8 +105,142 @@ typedef struct {
 typedef struct {
 	reading_hdr_t reading_hdr;
 	reading_val value;
+#if GEOWARE_TIMESTAMPS
+	uint16_t stamp;     /**< timesync_stamp() of when it was sampled. */
+#endif
+	uint8_t sinks_num;  /**< Other sinks, nearest first, 0 for owner only. */
+	uint8_t sink_next;  /**< The sink to try if this one is unreachable. */
+	sink_t sinks[MAX_SINKS];
 } reading_pkt_t;
 
+/* reading_hdr.hdr.len of a reading answering a snapshot or history query,
+   the readings of a subscription have 0. */
+#define READING_ANSWER 1
+
+/* A one-shot query, every node in the region answers it once with a
+   reading for query_hdr.sID and keeps nothing but that it has seen it. */
+typedef struct {
+  geoware_hdr_t hdr;
+  subscription_hdr_t query_hdr;   /**< Query ID and where to answer. */
+  sensor_t type;
+  region_t region;
+} snapshot_pkt_t;
+
+/* A query for the k nodes nearest to point that carry sensor type. It
+   goes greedily to the node nearest to point, its home, which floods rings
+   of growing radius around point until k nodes have answered. */
+typedef struct {
+  geoware_hdr_t hdr;
+  subscription_hdr_t query_hdr;   /**< Query ID and where the results go. */
+  subscription_hdr_t home_hdr;    /**< Ring ID and where the answers go. */
+  sensor_t type;
+  uint8_t k;
+  uint8_t ring;     /**< Increases with every ring the home floods. */
+  pos_t point;
+  float inner;      /**< Nodes up to inner answered an earlier ring. */
+  float outer;
+} knn_pkt_t;
+
+/* The answer of a node to a kNN query, and the result it becomes. */
+typedef struct {
+  reading_hdr_t reading_hdr;
+  reading_val value;
+  rimeaddr_t node;
+  pos_t pos;
+} knn_reply_pkt_t;
+
+/* A reading stored at the node nearest to the point its type and key hash
+   to, the home of the key, which copies it to its neighbors around that
+   point as GEOWARE_GHT_REPLICA. */
+typedef struct {
+  geoware_hdr_t hdr;
+  sensor_t type;
+  uint8_t key;
+  rimeaddr_t source;
+  pos_t point;      /**< ght_point(type, key). */
+  reading_val value;
+} ght_pkt_t;
+
+/* A query for the readings stored under type and key. The home answers it,
+   or the replica nearest to the point if the home is gone, with a
+   knn_reply_pkt_t for every source. */
+typedef struct {
+  geoware_hdr_t hdr;
+  subscription_hdr_t query_hdr;
+  sensor_t type;
+  uint8_t key;
+  pos_t point;
+} ght_query_pkt_t;
+
+/* A query for the samples a region took in the past, answered from the
+   flash log of every node with a reading, or with up to HISTORY_RAW_MAX
+   readings stamped with when they were taken for HISTORY_RAW. Only the
+   sensors a subscription samples are logged. The time range is in seconds before the query
+   arrives, nodes do not share a clock. */
+typedef struct {
+  geoware_hdr_t hdr;
+  subscription_hdr_t query_hdr;
+  sensor_t type;
+  uint8_t aggr;     /**< HISTORY_* */
+  uint32_t since;
+  uint32_t until;
+  region_t region;
+} history_pkt_t;
+
+/* One reading for several subscriptions asking for the same samples, each
+   with its own owner. hdr.len holds the number of destinations. The node
+   that took the reading is in source, a relay splitting off destinations
+   sends them on as the originator. */
+typedef struct {
+  geoware_hdr_t hdr;
+  reading_val value;
+#if GEOWARE_TIMESTAMPS
+  uint16_t stamp;
+#endif
+  rimeaddr_t source;
+  subscription_hdr_t dests[SHARED_READING_MAX];
+} shared_reading_pkt_t;
+
+#define SHARED_READING_LEN(n) \
+  (offsetof(shared_reading_pkt_t, dests) + (n) * sizeof(subscription_hdr_t))
+
+/* The readings of all the sensors of a subscription, sampled together.
+   hdr.len holds the number of values. Each is a byte with the reading_t in
+   the top two bits and the sensor type below, followed by the value in as
+   many bytes as its reading_t takes. */
+typedef struct {
+  reading_hdr_t reading_hdr;
+#if GEOWARE_TIMESTAMPS
+  uint16_t stamp;
+#endif
+  uint8_t values[SUB_MAX_SENSORS * (1 + sizeof(reading_val))];
+} vector_reading_pkt_t;
+
+/* A fragment of a blob reading: BLOB_FRAG_SIZE bytes from frag on, or
+   what is left of size. */
+typedef struct {
+  reading_hdr_t reading_hdr;
+#if GEOWARE_TIMESTAMPS
+  uint16_t stamp;
+#endif
+  pos_t source_pos;   /**< Where to ask for missing fragments. */
+  uint8_t blob;       /**< Increases with every blob the source reads. */
+  uint8_t frag;
+  uint16_t size;
+  uint8_t data[BLOB_FRAG_SIZE];
+} blob_frag_pkt_t;
+
+#define BLOB_FRAG_LEN(n) (offsetof(blob_frag_pkt_t, data) + (n))
+
+/* Asks the source of a blob for the fragments the owner is missing. It is
+   routed like a reading, with the source as the owner. */
+typedef struct {
+  geoware_hdr_t hdr;
+  subscription_hdr_t source_hdr;
+  uint8_t blob;
+  uint32_t missing;   /**< Bit i set for every fragment i missing. */
+} blob_nack_pkt_t;
+
 typedef struct {
   sid_t* sIDs;
 } sid_discovery_t;
@@ -57,8 +248,29 @@ typedef struct {
 
 void process_subscription(subscription_pkt_t *sub_pkt);
 void process_unsubscription(unsubscription_pkt_t *unsub_pkt);
+void process_subscription_batch(subscription_batch_pkt_t *batch_pkt);
+void prepare_sub_batch_pkt(subscription_batch_pkt_t *batch_pkt);
+uint8_t sub_batch_add(subscription_batch_pkt_t *batch_pkt, sid_t sID);
 uint8_t prepare_sub_pkt(subscription_pkt_t *sub_pkt, sid_t sID);
 uint8_t prepare_unsub_pkt(unsubscription_pkt_t *unsub_pkt, sid_t sID);
+void process_owner_update(owner_update_pkt_t *update_pkt);
+uint8_t prepare_owner_update_pkt(owner_update_pkt_t *update_pkt, sid_t sID, \
+                                 uint8_t seq);
+void process_refresh(refresh_pkt_t *refresh_pkt);
+uint8_t prepare_refresh_pkt(refresh_pkt_t *refresh_pkt, sid_t sID);
+void process_snapshot(snapshot_pkt_t *snapshot_pkt);
+void process_knn(knn_pkt_t *knn_pkt);
+void process_history(history_pkt_t *history_pkt);
+void process_subscription_update(subscription_update_pkt_t *update_pkt);
+uint8_t prepare_subscription_update_pkt(subscription_update_pkt_t *update_pkt,\
+                                        sid_t sID, uint8_t changes, \
+                                        pos_t reach_center, \
+                                        float reach_radius);
+uint8_t vector_add(vector_reading_pkt_t *pkt, sensor_t type, \
+                   reading_val *value);
+uint8_t vector_get(vector_reading_pkt_t *pkt, uint8_t i, sensor_t *type, \
+                   reading_val *value);
+uint8_t vector_len(vector_reading_pkt_t *pkt);
 void print_unsubscription(unsubscription_pkt_t *unsub_pkt);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "contiki.h"
+
+#include <stdio.h> /* For printf() */
+
+#include "geoware.h"
+
+/* Uncomment below line to include debug output */
+#define DEBUG_PRINTS
+
+#ifdef DEBUG_PRINTS
+#define debug_printf printf
+#else
+#define debug_printf(format, args...)
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* This structure holds the reverse path of a subscription: the neighbor we
+   first heard the subscription from, which leads back to its owner. */
+struct route {
+  /* The ->next pointer is needed since we are placing these
+     on a Contiki list. */
+  struct route *next;
+
+  /* -> sID holds the id of the subscription */
+  sid_t sID;
+
+  /* -> hop holds the address of the neighbor the subscription came from */
+  rimeaddr_t hop;
+
+  /* -> timestamp holds the last time the subscription came from ->hop, the
+     route is soft state and forgotten ROUTE_TIMEOUT seconds later */
+  uint32_t timestamp;
+};
+
+/* This MEMB() definition defines a memory pool from which we allocate
+   route entries. */
+MEMB(routes_memb, struct route, MAX_ROUTES);
+
+/* The routes_list is a Contiki list that holds the reverse paths. */
+LIST(routes_list);
+
+/*---------------------------------------------------------------------------*/
+
+void
+routes_init()
+{
+  memb_init(&routes_memb);
+  list_init(routes_list);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static struct route*
+find_route(sid_t sID)
+{
+  struct route *r;
+
+  for(r = list_head(routes_list); r != NULL; r = list_item_next(r)) {
+    if(sID == r->sID) {
+      break;
+    }
+  }
+
+  /* soft state, drop it once it is too old */
+  if(r != NULL && clock_seconds() - r->timestamp > ROUTE_TIMEOUT) {
+    list_remove(routes_list, r);
+    memb_free(&routes_memb, r);
+    r = NULL;
+  }
+
+  return r;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function records the neighbor a subscription (or its refresh) came
+ * from. The first copy we hear came the shortest way, so an existing route
+ * is only refreshed, not replaced, until it times out.
+ */
+void
+route_add(sid_t sID, const rimeaddr_t *hop)
+{
+  struct route *r;
+  struct route *oldest;
+
+  r = find_route(sID);
+
+  if(r != NULL) {
+    if(rimeaddr_cmp(&r->hop, hop)) {
+      r->timestamp = clock_seconds();
+    }
+    return;
+  }
+
+  r = memb_alloc(&routes_memb);
+
+  /* If the table is full, reuse the oldest route */
+  if(r == NULL) {
+    oldest = list_head(routes_list);
+    for(r = oldest; r != NULL; r = list_item_next(r)) {
+      if(r->timestamp < oldest->timestamp) {
+        oldest = r;
+      }
+    }
+
+    if(oldest == NULL) {
+      return;
+    }
+
+    list_remove(routes_list, oldest);
+    r = oldest;
+  }
+
+  r->sID = sID;
+  rimeaddr_copy(&r->hop, hop);
+  r->timestamp = clock_seconds();
+
+  list_add(routes_list, r);
+
+  debug_printf("route for sID %u via %d.%d\n", sID, hop->u8[0], hop->u8[1]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+rimeaddr_t*
+route_lookup(sid_t sID)
+{
+  struct route *r = find_route(sID);
+
+  return r != NULL ? &r->hop : NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+route_remove(sid_t sID)
+{
+  struct route *r = find_route(sID);
+
+  if(r != NULL) {
+    list_remove(routes_list, r);
+    memb_free(&routes_memb, r);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,15 @@
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include <stdint.h>
+
+#include "net/rime.h"
+
+typedef uint16_t sid_t;
+
+void routes_init();
+void route_add(sid_t sID, const rimeaddr_t *hop);
+rimeaddr_t* route_lookup(sid_t sID);
+void route_remove(sid_t sID);
+
+#endif
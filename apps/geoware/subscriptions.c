@@ -26,6 +26,25 @@ struct seen_sub {
 
   /* -> sID holds the id of seen subscription */
   sid_t sID;
+
+  /* -> owner_seq holds the sequence number of the last owner position
+     update we passed on */
+  uint8_t owner_seq;
+
+  /* -> epoch holds the epoch of the last lease refresh we passed on */
+  uint8_t epoch;
+
+  /* -> version holds the version of the last subscription update we
+     passed on */
+  uint8_t version;
+
+  /* -> known holds the SEQ_* of the sequence numbers above we heard */
+  uint8_t known;
+
+  /* -> lease holds the lease of the subscription (0 if none) and
+     -> timestamp when we last heard of it, we forget it once it expired */
+  uint16_t lease;
+  uint32_t timestamp;
 };
 
 /* This MEMB() definition defines a memory pool from which we allocate
@@ -35,13 +54,54 @@ MEMB(seen_subs_memb, struct seen_sub, MAX_ACTIVE_SUBSCRIPTIONS);
 /* The seen_subscriptions is a Contiki list that holds what it says. */
 LIST(seen_subs);
 
+/*---------------------------------------------------------------------------*/
+/* Forget the seen subscriptions whose lease ran out. */
+static void
+purge_seen_subs()
+{
+  struct seen_sub *s;
+  struct seen_sub *next;
+
+  for(s = list_head(seen_subs); s != NULL; s = next) {
+    next = list_item_next(s);
+
+    if(s->lease != 0 && clock_seconds() - s->timestamp > s->lease) {
+      debug_printf("seen sub lease expired: %u\n", s->sID);
+      list_remove(seen_subs, s);
+      memb_free(&seen_subs_memb, s);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+static struct seen_sub*
+get_seen_sub(sid_t sID)
+{
+  struct seen_sub *s;
+
+  purge_seen_subs();
+
+  for(s = list_head(seen_subs); s != NULL; s = list_item_next(s)) {
+    /* We break out of the loop if the sID in quesiton matches current
+       subscription. */
+    if(sID == s->sID) {
+      break;
+    }
+  }
+
+  return s;
+}
+
 /*---------------------------------------------------------------------------*/
 
 sid_t
-add_seen_sub(sid_t sID)
+add_seen_sub(sid_t sID, uint16_t lease)
 {
   struct seen_sub *new_sub;
 
+  purge_seen_subs();
+
   new_sub = memb_alloc(&seen_subs_memb);
 
   /* If we could not allocate a new neighbor entry, we give up. We
@@ -54,6 +114,12 @@ add_seen_sub(sid_t sID)
 
   /* Initialize the fields. */
   new_sub->sID = sID;
+  new_sub->owner_seq = 0;
+  new_sub->epoch = 0;
+  new_sub->version = 0;
+  new_sub->known = 0;
+  new_sub->lease = lease;
+  new_sub->timestamp = clock_seconds();
 
   /* Place the subscription on the active_subscriptions list. */
   list_add(seen_subs, new_sub);
@@ -94,17 +160,7 @@ remove_seen_sub(sid_t sID)
 /*---------------------------------------------------------------------------*/
 
 uint8_t was_seen(sid_t sID) {
-  struct seen_sub *s;
-
-  for(s = list_head(seen_subs); s != NULL; s = list_item_next(s)) {
-    /* We break out of the loop if the sID in quesiton matches current
-       subscription. */
-    if(sID == s->sID) {
-      break;
-    }
-  }
-
-  return s != NULL;
+  return get_seen_sub(sID) != NULL;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -133,6 +189,183 @@ is_subscribed(sid_t sID)
   return s != NULL;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Check if we are the owner of the subscription. */
+uint8_t
+is_owner(subscription_t *sub)
+{
+  return rimeaddr_cmp(&sub->subscription_hdr.owner, &rimeaddr_node_addr);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Check if seq is newer than *last and remember it if so. Sequence numbers
+ * wrap, so a node that learned of the subscription late cannot tell how far
+ * the owner counted: the first one it hears, with bit not set in *known, is
+ * taken as new.
+ */
+static uint8_t
+seq_is_new(uint8_t *known, uint8_t bit, uint8_t *last, uint8_t seq)
+{
+  if(last == NULL || ((*known & bit) && (int8_t)(seq - *last) <= 0)) {
+    return 0;
+  }
+
+  *known |= bit;
+  *last = seq;
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Check if an owner position update for sID is newer than the last one we
+ * applied or passed on, and remember it if so.
+ */
+uint8_t
+owner_update_is_new(sid_t sID, uint8_t seq)
+{
+  struct subscription *s;
+  struct seen_sub *seen;
+  uint8_t *last = NULL;
+  uint8_t *known = NULL;
+
+  if((s = get_subscription_struct(sID)) != NULL) {
+    last = &s->owner_seq;
+    known = &s->known;
+  }
+  else if((seen = get_seen_sub(sID)) != NULL) {
+    last = &seen->owner_seq;
+    known = &seen->known;
+  }
+
+  return seq_is_new(known, SEQ_OWNER, last, seq);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Check if an update of subscription sID is newer than the last one we
+ * applied or passed on, and remember it if so.
+ */
+uint8_t
+subscription_update_is_new(sid_t sID, uint8_t version)
+{
+  struct subscription *s;
+  struct seen_sub *seen;
+  uint8_t *last = NULL;
+  uint8_t *known = NULL;
+
+  if((s = get_subscription_struct(sID)) != NULL) {
+    last = &s->version;
+    known = &s->known;
+  }
+  else if((seen = get_seen_sub(sID)) != NULL) {
+    last = &seen->version;
+    known = &seen->known;
+  }
+
+  return seq_is_new(known, SEQ_VERSION, last, version);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Check if a lease refresh for sID is newer than the last one we applied or
+ * passed on. If so remember it and renew the lease. Epochs wrap.
+ */
+uint8_t
+refresh_is_new(sid_t sID, uint8_t epoch)
+{
+  struct subscription *s;
+  struct seen_sub *seen;
+
+  if((s = get_subscription_struct(sID)) != NULL) {
+    if(!seq_is_new(&s->known, SEQ_EPOCH, &s->epoch, epoch)) {
+      return 0;
+    }
+
+    if(s->sub.lease != 0) {
+      ctimer_restart(&s->lease_timer);
+    }
+    return 1;
+  }
+
+  if((seen = get_seen_sub(sID)) != NULL) {
+    if(!seq_is_new(&seen->known, SEQ_EPOCH, &seen->epoch, epoch)) {
+      return 0;
+    }
+
+    seen->timestamp = clock_seconds();
+    return 1;
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Remember version as the last update applied to or passed on for sID. */
+void
+subscription_set_version(sid_t sID, uint8_t version)
+{
+  struct subscription *s;
+  struct seen_sub *seen;
+
+  if((s = get_subscription_struct(sID)) != NULL) {
+    s->version = version;
+    s->known |= SEQ_VERSION;
+  }
+  else if((seen = get_seen_sub(sID)) != NULL) {
+    seen->version = version;
+    seen->known |= SEQ_VERSION;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Stop taking part in subscription sID but keep it on the seen list, with
+ * the sequence numbers we know, so we still pass on its floods once.
+ */
+void
+leave_subscription(sid_t sID)
+{
+  struct subscription *s;
+  struct seen_sub *seen;
+
+  if((s = get_subscription_struct(sID)) == NULL) {
+    return;
+  }
+
+  if(add_seen_sub(sID, s->sub.lease) != 0 && \
+      (seen = get_seen_sub(sID)) != NULL) {
+    seen->owner_seq = s->owner_seq;
+    seen->epoch = s->epoch;
+    seen->version = s->version;
+    seen->known = s->known;
+  }
+
+  remove_subscription(sID);
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * This function is called by the lease ctimer of a subscription. On the
+ * owner it is time to refresh the lease, anywhere else the lease ran out
+ * without a refresh and the subscription is dropped.
+ */
+static void
+lease_timeout(void *ptr)
+{
+  struct subscription *s = ptr;
+
+  if(is_owner(&s->sub)) {
+    ctimer_reset(&s->lease_timer);
+    refresh(s->sub.subscription_hdr.sID);
+  }
+  else {
+    debug_printf("lease expired: %u\n", s->sub.subscription_hdr.sID);
+    route_remove(s->sub.subscription_hdr.sID);
+    remove_subscription(s->sub.subscription_hdr.sID);
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 
 subscription_t*
@@ -152,26 +385,123 @@ add_subscription(subscription_t *sub)
 
   /* Initialize the fields. */
   new_sub->sub = *sub;
-
-  /* set the sensor reading callback timer, only if we are not the owner */
-  if(distance(sub->subscription_hdr.owner_pos, own_pos) != 0) {
-    ctimer_set(&new_sub->callback, new_sub->sub.period * CLOCK_SECOND / 1000, \
-      sensor_read, (void*) new_sub);
-  }
-  else {
-    /* otherwise set the process that called us to be able to send the
-       received readings back to it */
+  new_sub->owner_seq = 0;
+  new_sub->epoch = 0;
+  new_sub->version = 0;
+  /* the owner counts them, anywhere else we wait to hear one */
+  new_sub->known = is_owner(sub) ? SEQ_OWNER | SEQ_EPOCH | SEQ_VERSION : 0;
+
+  /* the owner does not sample, it keeps the process that called us to be
+     able to send the received readings back to it */
+  if(is_owner(sub)) {
     new_sub->proc = PROCESS_CURRENT();
   }
 
+  /* the owner refreshes the lease LEASE_REFRESHES times per lease, so a
+     lost refresh does not end the subscription */
+  if(new_sub->sub.lease != 0) {
+    ctimer_set(&new_sub->lease_timer, is_owner(sub) ? \
+      (clock_time_t)new_sub->sub.lease * CLOCK_SECOND / LEASE_REFRESHES : \
+      (clock_time_t)new_sub->sub.lease * CLOCK_SECOND, \
+      lease_timeout, (void*) new_sub);
+  }
+
   /* Place the subscription on the active_subscriptions list. */
   list_add(active_subscriptions, new_sub);
 
+  if(!is_owner(sub)) {
+    sampler_add(new_sub);
+  }
+
   debug_printf("subscription added: %u\n", new_sub->sub.subscription_hdr.sID);
 
   return &new_sub->sub;
 }
 
+/*---------------------------------------------------------------------------*/
+/*
+ * Apply an update of an active subscription in place. Only the parts named
+ * in changes are taken from sub, the readings collected so far are kept so
+ * the aggregate carries on with the new parameters.
+ */
+subscription_t*
+modify_subscription(subscription_t *sub, uint8_t changes)
+{
+  struct subscription *s;
+
+  if((s = get_subscription_struct(sub->subscription_hdr.sID)) == NULL) {
+    return NULL;
+  }
+
+  if(changes & SUB_UPDATE_PERIOD) {
+    s->sub.period = sub->period;
+
+    /* the owner does not sample */
+    if(!is_owner(&s->sub)) {
+      sampler_add(s);
+    }
+  }
+
+  if(changes & SUB_UPDATE_AGGR) {
+    s->sub.aggr_type = sub->aggr_type;
+    s->sub.aggr_num = sub->aggr_num;
+  }
+
+  if(changes & SUB_UPDATE_REGION) {
+    s->sub.region = sub->region;
+  }
+
+  debug_printf("subscription modified: %u\n", s->sub.subscription_hdr.sID);
+
+  return &s->sub;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Check if two subscriptions ask for the same samples: the same sensor
+   read at the same period and aggregated the same way. Readings of
+   subscriptions with other sinks, stored ones or ones reading other
+   sensors along are not shared. */
+uint8_t
+subscriptions_equivalent(subscription_t *a, subscription_t *b)
+{
+  return a->type == b->type && a->period == b->period && \
+    a->aggr_type == b->aggr_type && a->aggr_num == b->aggr_num && \
+    a->sinks_num == 0 && b->sinks_num == 0 && \
+    a->store_key == 0 && b->store_key == 0 && a->more == 0 && b->more == 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Find the subscription that samples and publishes for s. Subscriptions of
+ * other owners asking for the same samples share it in groups of
+ * SHARED_READING_MAX, the owners one packet can carry. The first of each
+ * group we hold takes the samples. Returns s if it samples by itself.
+ */
+struct subscription*
+shared_leader(struct subscription *s)
+{
+  struct subscription *lead = NULL;
+  struct subscription *e;
+  uint8_t before = 0;
+
+  if(is_owner(&s->sub)) {
+    return s;
+  }
+
+  for(e = list_head(active_subscriptions); e != NULL && e != s; \
+      e = list_item_next(e)) {
+    if(!is_owner(&e->sub) && subscriptions_equivalent(&e->sub, &s->sub)) {
+      /* a group starts every SHARED_READING_MAX subscriptions */
+      if(before % SHARED_READING_MAX == 0) {
+        lead = e;
+      }
+      before++;
+    }
+  }
+
+  return before % SHARED_READING_MAX == 0 ? s : lead;
+}
+
 /*---------------------------------------------------------------------------*/
 
 subscription_t*
@@ -224,10 +554,16 @@ remove_subscription(sid_t sID)
   if(s != NULL) {
     printf("removing subscription %u\n", sID);
 
-    ctimer_stop(&s->callback);
+    sensor_t type = s->sub.type;
+
+    ctimer_stop(&s->lease_timer);
+    ctimer_stop(&s->publish_timer);
     list_remove(active_subscriptions, s);
     memb_free(&subscriptions_memb, s);
 
+    /* the sensor may be read less often now */
+    sampler_update(type);
+
     return sID;
   }
   
@@ -244,10 +580,11 @@ print_subscription(subscription_t *sub)
   printf("owner pos: ");
   print_pos(sub->subscription_hdr.owner_pos);
   printf("type: %u\n", sub->type);
+  if(sub->more != 0) {
+    printf("more types: 0x%x\n", sub->more);
+  }
   printf("period: %lu\n", sub->period);
-  printf("center: ");
-  print_pos(sub->center);
-  printf("radius: "PRINTFLOAT"\n", (long)sub->radius, decimals(sub->radius));
+  print_region(&sub->region);
 }
 
 /*---------------------------------------------------------------------------*/
\ No newline at end of file
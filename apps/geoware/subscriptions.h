@@ -3,25 +3,51 @@
 
 #include <stdint.h>
 
+#include "net/rime.h"
+
 #include "geoware_sensors.h"
 #include "geo.h"
 #include "aggregates.h"
 
 typedef uint16_t sid_t;
 
+/* what a subscription update changes */
+#define SUB_UPDATE_PERIOD   0x01
+#define SUB_UPDATE_AGGR     0x02
+#define SUB_UPDATE_REGION   0x04
+
+/* which sequence numbers of a subscription we heard, until then the first
+   one that comes is new */
+#define SEQ_OWNER           0x01
+#define SEQ_EPOCH           0x02
+#define SEQ_VERSION         0x04
+
 typedef struct {
   sid_t sID;
   pos_t owner_pos;
+  rimeaddr_t owner;
 } subscription_hdr_t;
 
+/* A gateway the readings of a subscription can be delivered to, besides
+   its owner. */
+typedef struct {
+  rimeaddr_t addr;
+  pos_t pos;
+} sink_t;
+
+/* Fields are ordered to leave no padding, subscriptions go in packets. */
 typedef struct {
   subscription_hdr_t subscription_hdr;
-  sensor_t type;
   uint32_t period; //in units of ms
+  sensor_t type;
   aggr_t aggr_type;
   uint8_t aggr_num;
-  pos_t center;
-  float radius;
+  uint8_t store_key; // readings are stored under this GHT key, 0 if not
+  region_t region;
+  uint16_t lease; // in seconds, 0 if the subscription never expires
+  uint16_t more; // other sensors read along, bit t for sensor type t
+  uint8_t sinks_num;
+  sink_t sinks[MAX_SINKS];
 } subscription_t;
 
 /* This structure holds information about active subscriptions. */
@@ -33,27 +59,61 @@ struct subscription {
   /* -> sub holds the subscription information */
   subscription_t sub;
 
-  /* -> callback is a ctimer that gets fired according to the subscription
-     and reads the specified sensor type */
-  struct ctimer callback;
+  /* -> due holds the time (in ms) until the next sample for this
+     subscription, the sampler of its sensor type counts it down */
+  uint32_t due;
 
   uint8_t num;
 
+  /* -> owner_seq holds the sequence number of the last owner position
+     update applied to this subscription */
+  uint8_t owner_seq;
+
+  /* -> lease_timer removes the subscription when its lease runs out, on the
+     owner it fires to send the refreshes instead */
+  struct ctimer lease_timer;
+
+  /* -> epoch holds the epoch of the last refresh of the lease */
+  uint8_t epoch;
+
+  /* -> version holds the version of the last update of the subscription */
+  uint8_t version;
+
+  /* -> known holds the SEQ_* of the sequence numbers above we heard */
+  uint8_t known;
+
+  /* -> publish_timer sends ->pending, the last reading published and the
+     ones of the other sensors read along, in our publish slot. They were
+     sampled at ->pending_time */
+  struct ctimer publish_timer;
+  reading_val pending[SUB_MAX_SENSORS];
+  uint32_t pending_time;
+
   struct process *proc;
 };
 
 extern list_t active_subscriptions;
 
-sid_t add_seen_sub(sid_t sID);
+sid_t add_seen_sub(sid_t sID, uint16_t lease);
 sid_t remove_seen_sub(sid_t sID);
 uint8_t was_seen(sid_t sID);
 uint8_t is_subscribed(sid_t sID);
+uint8_t is_owner(subscription_t *sub);
+uint8_t owner_update_is_new(sid_t sID, uint8_t seq);
+uint8_t refresh_is_new(sid_t sID, uint8_t epoch);
+uint8_t subscription_update_is_new(sid_t sID, uint8_t version);
+subscription_t* modify_subscription(subscription_t *sub, uint8_t changes);
+uint8_t subscriptions_equivalent(subscription_t *a, subscription_t *b);
+struct subscription* shared_leader(struct subscription *s);
+void subscription_set_version(sid_t sID, uint8_t version);
+void leave_subscription(sid_t sID);
 subscription_t* add_subscription(subscription_t *sub);
 subscription_t* get_subscription(sid_t sID);
 struct subscription* get_subscription_struct(sid_t sID);
 sid_t remove_subscription(sid_t sID);
 void print_subscription(subscription_t *sub);
 reading_val get_reading_type(sensor_t t);
-uint8_t reading_add(sid_t sID, rimeaddr_t* owner, reading_val* value);
+uint8_t reading_add(sid_t sID, sensor_t type, rimeaddr_t* owner, \
+                    reading_val* value, uint32_t time);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "contiki.h"
+
+#include <stdio.h> /* For printf() */
+
+#include "geoware.h"
+
+/* Uncomment below line to include debug output */
+#define DEBUG_PRINTS
+
+#ifdef DEBUG_PRINTS
+#define debug_printf printf
+#else
+#define debug_printf(format, args...)
+#endif
+
+/* clock ticks per unit of a compact timestamp, an eighth of a second */
+#define STAMP_TICKS (CLOCK_SECOND / 8)
+
+/*---------------------------------------------------------------------------*/
+/* The root we follow, the last of its beacons we took the time from and
+   how far (in clock ticks) its clock is ahead of ours. */
+static rimeaddr_t root;
+static uint8_t seq;
+static int32_t offset;
+
+/* our beacons since we last heard newer time from the root */
+static uint8_t missed;
+
+/* the root we gave up on and its last round, still passed on by the nodes
+   that did not notice yet */
+static rimeaddr_t lost;
+static uint8_t lost_seq;
+
+/*---------------------------------------------------------------------------*/
+
+static uint16_t
+id(const rimeaddr_t *addr)
+{
+  return (addr->u8[0] << 8) | addr->u8[1];
+}
+
+/*---------------------------------------------------------------------------*/
+/* The local clock in ticks. clock_time() wraps too soon on some platforms,
+   so the seconds are taken from clock_seconds(). */
+static uint32_t
+local_time()
+{
+  return clock_seconds() * CLOCK_SECOND + clock_time() % CLOCK_SECOND;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Until we hear of a lower address we are the root of our own time. */
+void
+timesync_init()
+{
+  rimeaddr_copy(&root, &rimeaddr_node_addr);
+  rimeaddr_copy(&lost, &rimeaddr_null);
+  seq = 0;
+  offset = 0;
+  missed = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* The network time, in clock ticks. */
+uint32_t
+timesync_time()
+{
+  return local_time() + offset;
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Fill in the time for a beacon we are about to send. The root starts a new
+ * round, the others pass on the last one they heard. A node that heard no
+ * newer round for TIMESYNC_ROOT_TIMEOUT beacons takes over as root, keeping
+ * the time it has.
+ */
+void
+timesync_beacon(timesync_t *sync)
+{
+  if(!rimeaddr_cmp(&root, &rimeaddr_node_addr) && \
+      ++missed > TIMESYNC_ROOT_TIMEOUT) {
+    printf("time sync root %d.%d lost\n", root.u8[0], root.u8[1]);
+    rimeaddr_copy(&lost, &root);
+    lost_seq = seq;
+    rimeaddr_copy(&root, &rimeaddr_node_addr);
+  }
+
+  if(rimeaddr_cmp(&root, &rimeaddr_node_addr)) {
+    seq++;
+    missed = 0;
+  }
+
+  rimeaddr_copy(&sync->root, &root);
+  sync->seq = seq;
+  sync->time = timesync_time();
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ * Take the time from a neighbor's beacon if it follows a lower root than we
+ * do, or the same root in a newer round. The delay of the beacon in the MAC
+ * layer is not accounted for, every hop adds a few ticks of error.
+ */
+void
+timesync_heard(const timesync_t *sync)
+{
+  if(id(&sync->root) > id(&root) || (rimeaddr_cmp(&sync->root, &root) && \
+      (int8_t)(sync->seq - seq) <= 0)) {
+    return;
+  }
+
+  if(rimeaddr_cmp(&sync->root, &lost) && (int8_t)(sync->seq - lost_seq) <= 0) {
+    return;
+  }
+
+  if(!rimeaddr_cmp(&sync->root, &root)) {
+    debug_printf("following time of %d.%d\n", \
+      sync->root.u8[0], sync->root.u8[1]);
+  }
+
+  rimeaddr_copy(&root, &sync->root);
+  seq = sync->seq;
+  offset = (int32_t)(sync->time - local_time());
+  missed = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Compact a network time to eighths of a second, it wraps after about two
+   hours. */
+uint16_t
+timesync_stamp(uint32_t time)
+{
+  return time / STAMP_TICKS;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Expand a compact timestamp to the network time, as the latest time it can
+   stand for that is not in the future. */
+uint32_t
+timesync_unstamp(uint16_t stamp)
+{
+  uint32_t now = timesync_time();
+  uint16_t age = timesync_stamp(now) - stamp;
+
+  return (now / STAMP_TICKS - age) * STAMP_TICKS;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+print_timesync()
+{
+  uint32_t now = timesync_time();
+
+  printf("time %lu.%03lu root %d.%d round %u offset %ld\n", \
+    now / CLOCK_SECOND, (now % CLOCK_SECOND) * 1000 / CLOCK_SECOND, \
+    root.u8[0], root.u8[1], seq, (long)offset);
+}
+
+/*---------------------------------------------------------------------------*/
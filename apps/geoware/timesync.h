@@ -0,0 +1,26 @@
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+#include <stdint.h>
+
+#include "net/rime.h"
+
+/* The time of the sync root as carried in the beacons. */
+typedef struct {
+  rimeaddr_t root;  /**< Lowest address heard, all nodes follow its clock. */
+  uint8_t seq;      /**< Increases with every beacon of the root. */
+  uint32_t time;    /**< Network time (in clock ticks) when sent. */
+} timesync_t;
+
+/* Seconds a compact timestamp spans before it wraps, 2^16 eighths. */
+#define TIMESYNC_STAMP_SPAN 8192
+
+void timesync_init();
+uint32_t timesync_time();
+void timesync_beacon(timesync_t *sync);
+void timesync_heard(const timesync_t *sync);
+uint16_t timesync_stamp(uint32_t time);
+uint32_t timesync_unstamp(uint16_t stamp);
+void print_timesync();
+
+#endif
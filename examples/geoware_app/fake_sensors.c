@@ -1,3 +1,4 @@
+#include "contiki.h"
 #include "lib/random.h"
 
 #include "fake_sensors.h"
@@ -40,4 +41,21 @@ uint16_t get_light() {
 uint8_t get_humidity() {
   uint8_t h = 50 + random_rand()%10;
   return h;
+}
+
+// a humidity sensor that takes a while to convert, like one on I2C
+static struct ctimer humidity_timer;
+
+static void humidity_ready(void *ptr) {
+  reading_val value;
+
+  value.ui8 = get_humidity();
+  sensor_done(*(sensor_t*)ptr, &value);
+}
+
+void start_humidity(sensor_t type) {
+  static sensor_t humidity;
+
+  humidity = type;
+  ctimer_set(&humidity_timer, CLOCK_SECOND / 8, humidity_ready, &humidity);
 }
\ No newline at end of file
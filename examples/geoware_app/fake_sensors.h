@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 
+#include "geoware_sensors.h"
+
 float get_temperature();
 uint16_t get_light();
 uint8_t get_humidity();
+void start_humidity(sensor_t type);
 
 #endif
\ No newline at end of file
@@ -10,7 +10,7 @@
 
 SENSOR_CREATE(TEMPERATURE, "temperature", FLOAT, get_temperature);
 SENSOR_CREATE(LIGHT, "light", UINT16, get_light);
-SENSOR_CREATE(HUMIDITY, "humidity", UINT8, get_humidity);
+SENSOR_CREATE_ASYNC(HUMIDITY, "humidity", UINT8, start_humidity);
 
 AGGREGATE_CREATE(MAXIMUM, maximum);
 AGGREGATE_CREATE(AVERAGE, average);
@@ -76,9 +76,10 @@ PROCESS_THREAD(app_process, ev, data)
         int i = 0;
         // read all the readings present in the list for given sid
         while(HAS_MORE_READINGS(new_value = get_reading_sid(sID))) {
-          printf("%d: received reading from: %d.%d sID: %u value: %u\n", \
-           i++, new_value.owner.u8[0], new_value.owner.u8[1],\
-           sID, new_value.value.ui8);
+          printf("%d: received reading from: %d.%d sID: %u type: %u " \
+           "value: %u at: %lu\n", i++, new_value.owner.u8[0], \
+           new_value.owner.u8[1], sID, new_value.type, new_value.value.ui8, \
+           new_value.time / CLOCK_SECOND);
         }
       }
   	}
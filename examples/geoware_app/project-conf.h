@@ -22,6 +22,161 @@
 #define NEIGHBOR_TIMEOUT			2*BROADCAST_PERIOD
 /* How many 2nd degree neighbors will be reported in the broadcast */
 #define MAX_NEIGHBOR_NEIGHBORS		8
+/* For how long (in seconds) a neighbor's position is extrapolated from its
+   estimated velocity */
+#define EXTRAPOLATION_LIMIT			BROADCAST_PERIOD
+/* How far a subscription owner moves before it tells the subscription
+   regions its new position */
+#define OWNER_UPDATE_DISTANCE		5.0
+/* Backoff (in clock ticks) before rebroadcasting a flood: the minimum, the
+   extra span for a node right next to the sender and a random jitter */
+#define FLOOD_BACKOFF_MIN			(CLOCK_SECOND/2)
+#define FLOOD_BACKOFF_SPAN			(CLOCK_SECOND*2)
+#define FLOOD_JITTER				(CLOCK_SECOND/4)
+/* Set to 1 to have only the nodes of a locally computed connected dominating
+   set rebroadcast floods and answer SID discovery requests */
+#define GEOWARE_CDS_RELAY			0
+/* A pending rebroadcast is cancelled once the flood was heard this many
+   times during the backoff */
+#define FLOOD_SUPPRESS_COUNT		3
+/* Floods backing off to be rebroadcast at the same time */
+#define FLOOD_QUEUE				3
+/* Maximum number of subscription reverse paths we remember, and for how
+   long (in seconds) one is used after the subscription last came by */
+#define MAX_ROUTES					6
+#define ROUTE_TIMEOUT				600
+/* Lease (in seconds) of new subscriptions, nodes drop a subscription that
+   was not refreshed for that long. 0 keeps subscriptions until unsubscribed */
+#define SUBSCRIPTION_LEASE			300
+/* How many refreshes the owner sends per lease */
+#define LEASE_REFRESHES			3
+/* Sinks a subscription can have besides its owner, each adds 10 bytes to
+   subscriptions and readings */
+#define MAX_SINKS					1
+/* Points of a subscription region: two per circle or rectangle, or the
+   vertices of one convex polygon. Each adds 4 bytes to subscriptions and
+   to the packets flooded over their region. Polygons and regions of several
+   parts need more than 2, then only one subscription fits in a batch */
+#define REGION_MAX_POINTS			2
+/* Sensors one subscription can read, the first included. The readings of
+   all of them go in one packet */
+#define SUB_MAX_SENSORS				4
+/* Subscriptions per multi-subscription packet, at most 15. About 46 bytes
+   each, two fit in a frame next to the headers */
+#define SUBSCRIPTION_BATCH_MAX		2
+/* Subscriptions issued within this window (in clock ticks) are sent out
+   together, and the gap between two packets of the same batch */
+#define SUBSCRIPTION_BATCH_WINDOW	(CLOCK_SECOND / 4)
+#define SUBSCRIPTION_BATCH_GAP		(CLOCK_SECOND / 8)
+/* Owners one shared reading goes to at most, and the delay (in clock ticks)
+   before the destinations that split off are sent on */
+#define SHARED_READING_MAX			3
+#define SHARED_SPLIT_DELAY			(CLOCK_SECOND / 8)
+/* Snapshot queries a node waits for answers to at a time, for how long (in
+   seconds), and the random delay (in clock ticks) before a node answers */
+#define SNAPSHOT_MAX				2
+#define SNAPSHOT_LEASE				30
+#define SNAPSHOT_JITTER				(CLOCK_SECOND * 2)
+/* Nearest nodes a kNN query can ask for, the rings its home floods at most
+   and waits for the answers to (in clock ticks, longer than
+   SNAPSHOT_JITTER), and the gap between the results it sends back */
+#define KNN_MAX					5
+#define KNN_MAX_RINGS				4
+#define KNN_RING_WAIT				(CLOCK_SECOND * 3)
+#define KNN_REPLY_GAP				(CLOCK_SECOND / 8)
+/* Queries a node answers at the same time, each from a slot of its own */
+#define ANSWER_MAX				3
+/* Size of the field (in position units) keys of stored readings hash into,
+   readings a node keeps as a home or replica and for how long (in seconds),
+   and how close to the point of a key (in position units) the neighbors of
+   its home keep a replica */
+#define GHT_FIELD_WIDTH				100
+#define GHT_FIELD_HEIGHT			100
+#define GHT_MAX					8
+#define GHT_TIMEOUT				600
+#define GHT_REPLICA_RADIUS			15
+/* Set to 1 to log the samples taken for subscriptions to flash for history
+   queries, in HISTORY_PAGES files of HISTORY_PAGE_RECORDS samples each. The
+   oldest page is started over when all are full. Sensors no subscription
+   reads are not logged */
+#define GEOWARE_FLASH_LOG			0
+#define HISTORY_PAGES				4
+#define HISTORY_PAGE_RECORDS		64
+/* Raw samples a node sends back at most for one history query */
+#define HISTORY_RAW_MAX				8
+/* Readings a node holds while it finds no way to pass them on, how long (in
+   clock ticks) it waits before trying again and the gap between the held
+   readings it sends on once a route is back */
+#define OUTBOX_MAX				8
+#define OUTBOX_RETRY				(CLOCK_SECOND * 5)
+#define OUTBOX_DRAIN_GAP			(CLOCK_SECOND / 4)
+/* Set to 1 to move the oldest held readings to flash when the outbox is
+   full, at most OUTBOX_SPILL_MAX of them. They are kept across reboots */
+#define GEOWARE_OUTBOX_SPILL			0
+#define OUTBOX_SPILL_MAX			32
+/* Slots in the period readings are published in, at most 16, and the
+   longest a slot lasts (in clock ticks). Neighbors pick distinct slots */
+#define PUBLISH_SLOTS				8
+#define PUBLISH_SLOT_LEN			(CLOCK_SECOND / 16)
+/* Largest blob a sensor can read (in bytes), at most 32 fragments of
+   BLOB_FRAG_SIZE bytes, and the blobs an owner reassembles at a time */
+#define BLOB_MAX_SIZE				192
+#define BLOB_FRAG_SIZE				48
+#define BLOB_REASSEMBLY				2
+/* Gap (in clock ticks) between the fragments of a blob, how long the owner
+   waits for a missing fragment and how many times it asks for them */
+#define BLOB_FRAG_GAP				(CLOCK_SECOND / 16)
+#define BLOB_NACK_WAIT				(CLOCK_SECOND * 2)
+#define BLOB_MAX_NACKS				3
+/* How many times a packet is re-routed after its next hop failed to
+   acknowledge it */
+#define MAX_REROUTES				2
+/* Unicasts waiting for the MAC layer's report we keep a copy of to re-route
+   them */
+#define INFLIGHT_MAX				4
+
+/* Beacons a node sends without hearing a new round of the time sync root
+   before it takes over as root */
+#define TIMESYNC_ROOT_TIMEOUT			4
+/* Set to 1 to have readings carry when they were sampled (2 bytes), in
+   network time, instead of being stamped by the owner on arrival */
+#define GEOWARE_TIMESTAMPS			1
+
+/* Radio power level (0-31) for beacons and for subscription floods,
+   0 keeps whatever the radio is set to (see the txp shell command) */
+#define BEACON_TXPOWER				0
+#define FLOOD_TXPOWER				0
+/* Fade margin (in dB) kept on top of the estimated path loss when choosing
+   the power level for a neighbor, and how it grows on retransmissions */
+#define TXPOWER_MARGIN				6
+#define TXPOWER_MARGIN_STEP			3
+#define TXPOWER_MARGIN_MAX			20
+
+/* Set to 1 when running a duty cycled MAC (ContikiMAC, X-MAC). Next hops
+   are then picked by their wake-up phase and readings go out in trains */
+#define GEOWARE_LOW_POWER			0
+/* Distance (in the units of the positions) within which a neighbor's
+   progress counts as comparable to the best one */
+#define PROGRESS_SLACK				2.0
+/* Weights of residual energy, load and (on a duty cycled MAC) wake-up delay
+   against geographic progress when choosing among comparable next hops.
+   A load of LOAD_SCALE packets per beacon period costs LOAD_WEIGHT */
+#define ENERGY_WEIGHT				1.0
+#define LOAD_WEIGHT					0.5
+#define LOAD_SCALE					10
+#define WAKEUP_WEIGHT				1.0
+/* Battery model for the residual energy advertised in the beacons (needs
+   ENERGEST_CONF_ON), capacity in mAh and currents in mA */
+#define BATTERY_CAPACITY			2500
+#define CURRENT_CPU					1.8
+#define CURRENT_LPM					0.0545
+#define CURRENT_TRANSMIT			17.7
+#define CURRENT_LISTEN				20.0
+
+/* Maximum number of readings in a packet train, and how long (in seconds)
+   a reading waits for the train to fill up */
+#define TRAIN_MAX					4
+#define TRAIN_HOLD					10
 
 /* Maximum number of readings we can store and use with aggregate functions */
 #define MAX_READINGS				30
@@ -29,6 +184,14 @@
 /* maximum number of sensors geoware will support, used to allocate memory
    for the sensor mappings */
 #define MAX_SENSORS					5
+/* How long (in clock ticks) a split-phase sensor may take to convert */
+#define SENSOR_TIMEOUT				(CLOCK_SECOND / 2)
+/* How old (in clock ticks) the last value of a split-phase sensor may be
+   when a query reads it, if no subscription samples that sensor */
+#define SENSOR_MAX_AGE				(CLOCK_SECOND * 10)
+/* Sampling periods are aligned to this many ms, so subscriptions on the same
+   sensor share reads */
+#define SAMPLING_QUANTUM			250
 
 #define MAX_AGGREGATES				3
 